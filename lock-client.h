@@ -0,0 +1,429 @@
+/**
+ * @file lock-client.h
+ * @brief Client for the lock server's binary protocol that batches concurrent calls.
+ *
+ * Application threads call lock/unlock/upgrade and get a std::future<bool>.
+ * A call only pushes the request onto a shared queue; a batching thread
+ * collects everything queued within a short window (or until a batch is full)
+ * and sends it as BATCH frames over the least-loaded connection of a small
+ * pool. One reader thread per connection completes the futures in order as
+ * RESULTS frames arrive.
+ *
+ * Labels are resolved to node indices on first use with a RESOLVE frame sent
+ * ahead of the batch; until the answer arrives those records travel in a
+ * LABEL_BATCH, afterwards as 12-byte index records.
+ *
+ * Calls within one batch run in submission order. Calls that land in different
+ * batches may run on different connections in either order, so a caller that
+ * needs "lock, then unlock" ordered must wait for the first future.
+ *
+ *   LockClient client;
+ *   if (!client.connect("/tmp/lock.sock", 4)) ...
+ *   future<bool> locked = client.lock("node7", 42);
+ *   if (locked.get()) ...
+ *
+ * If a connection fails, its outstanding futures throw std::runtime_error.
+ */
+#ifndef LOCK_CLIENT_H
+#define LOCK_CLIENT_H
+
+#include "lock-protocol.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class LockClient {
+public:
+    static const size_t DEFAULT_MAX_BATCH = 4096;
+
+private:
+    static const uint32_t RESOLVING = NODE_UNKNOWN - 1; // Cache entry whose RESOLVE is in flight.
+
+    /**
+     * @brief One queued call. 'label' is empty when the caller passed an index.
+     */
+    struct PendingOp {
+        uint8_t opcode;
+        uint32_t nodeIndex;
+        int32_t userID;
+        std::string label;
+        std::promise<bool> result;
+    };
+
+    /**
+     * @brief A request frame awaiting its response, in send order per connection.
+     */
+    struct InFlight {
+        uint8_t responseType; // FRAME_RESULTS or FRAME_RESOLVED.
+        std::vector<std::promise<bool>> results;
+        std::vector<std::string> labels; // RESOLVE: labels to cache from the answer.
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::mutex inFlightMutex;
+        std::deque<InFlight> inFlight;
+        std::atomic<size_t> outstanding{0}; // Operations sent but not yet answered.
+        std::atomic<bool> failed{false};
+        std::thread reader;
+    };
+
+    std::vector<std::unique_ptr<Connection>> connections;
+    uint32_t numNodes = 0;
+
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::vector<PendingOp> queue;
+    bool stopping = false;
+    std::thread batcher;
+    std::chrono::microseconds window;
+    size_t maxBatch;
+
+    std::mutex cacheMutex;
+    std::unordered_map<std::string, uint32_t> labelCache; // NODE_UNKNOWN for labels the tree lacks.
+
+    static bool sendAll(int fd, const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    static bool receiveAll(int fd, char *data, size_t length) {
+        while (length > 0) {
+            ssize_t received = recv(fd, data, length, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sends the magic and checks the server's HELLO.
+     */
+    bool handshake(int fd) {
+        char hello[sizeof(FrameHeader) + 8];
+        if (!sendAll(fd, PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC)) || !receiveAll(fd, hello, sizeof(hello))) return false;
+        if (readWire<uint8_t>(hello + offsetof(FrameHeader, type)) != FRAME_HELLO ||
+            readWire<uint32_t>(hello + sizeof(FrameHeader)) != PROTOCOL_VERSION)
+            return false;
+        numNodes = readWire<uint32_t>(hello + sizeof(FrameHeader) + 4);
+        return true;
+    }
+
+    static void failAll(std::vector<std::promise<bool>>& results, const char *message) {
+        for (std::promise<bool>& result : results)
+            result.set_exception(std::make_exception_ptr(std::runtime_error(message)));
+        results.clear();
+    }
+
+    void failConnection(Connection& connection, const char *message) {
+        connection.failed = true;
+        std::lock_guard<std::mutex> guard(connection.inFlightMutex);
+        for (InFlight& frame : connection.inFlight) failAll(frame.results, message);
+        connection.inFlight.clear();
+        connection.outstanding = 0;
+    }
+
+    /**
+     * @brief Completes the oldest in-flight frame of 'connection' from one response.
+     * @return false on a response the client did not expect.
+     */
+    bool completeFrame(Connection& connection, uint8_t type, const char *payload, uint32_t length) {
+        InFlight frame;
+        {
+            std::lock_guard<std::mutex> guard(connection.inFlightMutex);
+            if (connection.inFlight.empty()) return false;
+            frame = std::move(connection.inFlight.front());
+            connection.inFlight.pop_front();
+        }
+        if (type != frame.responseType || length < 4) {
+            failAll(frame.results, type == FRAME_ERROR ? "lock server reported a protocol error" : "unexpected response");
+            return false;
+        }
+
+        uint32_t count = readWire<uint32_t>(payload);
+        if (type == FRAME_RESOLVED) {
+            if (count != frame.labels.size() || length != 4 + 4ull * count) return false;
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            for (uint32_t i = 0; i < count; i++) labelCache[frame.labels[i]] = readWire<uint32_t>(payload + 4 + 4 * i);
+            return true;
+        }
+
+        if (count != frame.results.size() || length != 4 + (count + 7) / 8) return false;
+        const unsigned char *bits = (const unsigned char *)payload + 4;
+        for (uint32_t i = 0; i < count; i++) frame.results[i].set_value((bits[i >> 3] >> (i & 7)) & 1);
+        connection.outstanding -= count;
+        return true;
+    }
+
+    /**
+     * @brief Reader thread: parses response frames and completes their futures.
+     */
+    void readLoop(Connection& connection) {
+        std::string buffer;
+        size_t start = 0;
+        char chunk[64 * 1024];
+        while (true) {
+            ssize_t received = recv(connection.fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) break;
+            buffer.append(chunk, received);
+
+            while (buffer.size() - start >= sizeof(FrameHeader)) {
+                const char *frame = buffer.data() + start;
+                uint32_t length = readWire<uint32_t>(frame + offsetof(FrameHeader, length));
+                if (buffer.size() - start < sizeof(FrameHeader) + length) break;
+                if (!completeFrame(connection, readWire<uint8_t>(frame + offsetof(FrameHeader, type)),
+                                   frame + sizeof(FrameHeader), length)) {
+                    failConnection(connection, "lock server connection failed");
+                    shutdown(connection.fd, SHUT_RDWR);
+                    return;
+                }
+                start += sizeof(FrameHeader) + length;
+            }
+            buffer.erase(0, start);
+            start = 0;
+        }
+        failConnection(connection, "lock server connection closed");
+    }
+
+    /**
+     * @brief The live connection with the fewest unanswered operations.
+     */
+    Connection *pickConnection() {
+        Connection *best = nullptr;
+        for (std::unique_ptr<Connection>& connection : connections) {
+            if (connection->failed) continue;
+            if (!best || connection->outstanding < best->outstanding) best = connection.get();
+        }
+        return best;
+    }
+
+    /**
+     * @brief Encodes one batch as consecutive BATCH / LABEL_BATCH frames (keeping
+     * submission order), preceded by a RESOLVE for labels not seen before, and
+     * sends it on one connection.
+     */
+    void sendBatch(std::vector<PendingOp>& batch, std::string& wire, std::vector<InFlight>& frames) {
+        Connection *connection = pickConnection();
+        if (!connection) {
+            for (PendingOp& op : batch)
+                op.result.set_exception(std::make_exception_ptr(std::runtime_error("no lock server connection")));
+            return;
+        }
+
+        wire.clear();
+        frames.clear();
+        std::vector<std::string> unresolved;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            for (PendingOp& op : batch) {
+                if (op.label.empty()) continue;
+                auto it = labelCache.find(op.label);
+                if (it != labelCache.end() && it->second != RESOLVING) {
+                    op.nodeIndex = it->second;
+                    op.label.clear();
+                } else if (it == labelCache.end()) {
+                    labelCache[op.label] = RESOLVING;
+                    unresolved.push_back(op.label);
+                }
+            }
+        }
+
+        if (!unresolved.empty()) {
+            size_t frameStart = wire.size();
+            appendFrameHeader(wire, FRAME_RESOLVE, 0);
+            appendWire<uint32_t>(wire, (uint32_t)unresolved.size());
+            for (const std::string& label : unresolved) {
+                appendWire<uint16_t>(wire, (uint16_t)label.size());
+                wire.append(label);
+            }
+            uint32_t length = (uint32_t)(wire.size() - frameStart - sizeof(FrameHeader));
+            memcpy(&wire[frameStart], &length, sizeof(length));
+            frames.push_back(InFlight{FRAME_RESOLVED, {}, std::move(unresolved)});
+        }
+
+        for (size_t first = 0; first < batch.size();) {
+            bool byLabel = !batch[first].label.empty();
+            size_t last = first;
+            while (last < batch.size() && batch[last].label.empty() != byLabel) last++;
+
+            size_t frameStart = wire.size();
+            appendFrameHeader(wire, byLabel ? FRAME_LABEL_BATCH : FRAME_BATCH, 0);
+            appendWire<uint32_t>(wire, (uint32_t)(last - first));
+            InFlight frame{FRAME_RESULTS, {}, {}};
+            frame.results.reserve(last - first);
+            for (size_t i = first; i < last; i++) {
+                PendingOp& op = batch[i];
+                if (byLabel) {
+                    appendWire<uint8_t>(wire, op.opcode);
+                    appendWire<uint8_t>(wire, 0);
+                    appendWire<uint16_t>(wire, (uint16_t)op.label.size());
+                    appendWire<int32_t>(wire, op.userID);
+                    wire.append(op.label);
+                } else {
+                    BatchRecord record = {op.opcode, {0, 0, 0}, op.nodeIndex, op.userID};
+                    wire.append((const char *)&record, sizeof(record));
+                }
+                frame.results.push_back(std::move(op.result));
+            }
+            uint32_t length = (uint32_t)(wire.size() - frameStart - sizeof(FrameHeader));
+            memcpy(&wire[frameStart], &length, sizeof(length));
+            frames.push_back(std::move(frame));
+            first = last;
+        }
+
+        // Register the frames before sending: the reader may see the answer first.
+        {
+            std::lock_guard<std::mutex> guard(connection->inFlightMutex);
+            if (connection->failed) {
+                for (InFlight& frame : frames) failAll(frame.results, "lock server connection failed");
+                return;
+            }
+            for (InFlight& frame : frames) connection->inFlight.push_back(std::move(frame));
+            connection->outstanding += batch.size();
+        }
+        if (!sendAll(connection->fd, wire.data(), wire.size())) {
+            failConnection(*connection, "lock server connection failed");
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+    }
+
+    /**
+     * @brief Batching thread: waits for a first call, lets others join it for
+     * one window, then sends everything queued.
+     */
+    void batchLoop() {
+        std::vector<PendingOp> batch;
+        std::string wire;
+        std::vector<InFlight> frames;
+        std::unique_lock<std::mutex> guard(queueMutex);
+        while (true) {
+            queueReady.wait(guard, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            queueReady.wait_for(guard, window, [&] { return stopping || queue.size() >= maxBatch; });
+
+            batch.swap(queue);
+            guard.unlock();
+            sendBatch(batch, wire, frames);
+            batch.clear();
+            guard.lock();
+        }
+    }
+
+    std::future<bool> submit(uint8_t opcode, uint32_t nodeIndex, const std::string& label, int32_t userID) {
+        PendingOp op{opcode, nodeIndex, userID, label, std::promise<bool>()};
+        std::future<bool> result = op.result.get_future();
+        bool wake;
+        {
+            std::lock_guard<std::mutex> guard(queueMutex);
+            wake = queue.empty() || queue.size() + 1 == maxBatch;
+            queue.push_back(std::move(op));
+        }
+        if (wake) queueReady.notify_one();
+        return result;
+    }
+
+public:
+    /**
+     * @param batchWindow How long the first call of a batch waits for others to join it.
+     * @param batchLimit  A batch is sent as soon as it holds this many calls.
+     */
+    explicit LockClient(std::chrono::microseconds batchWindow = std::chrono::microseconds(50),
+                        size_t batchLimit = DEFAULT_MAX_BATCH)
+        : window(batchWindow), maxBatch(batchLimit) {}
+
+    /**
+     * @brief Sends every queued call, waits for all answers and disconnects.
+     */
+    ~LockClient() {
+        if (batcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(queueMutex);
+                stopping = true;
+            }
+            queueReady.notify_one();
+            batcher.join();
+        }
+        // The server answers everything it has read before it sees end of input.
+        for (std::unique_ptr<Connection>& connection : connections) shutdown(connection->fd, SHUT_WR);
+        for (std::unique_ptr<Connection>& connection : connections) {
+            if (connection->reader.joinable()) connection->reader.join();
+            close(connection->fd);
+        }
+    }
+
+    LockClient(const LockClient&) = delete;
+    LockClient& operator=(const LockClient&) = delete;
+
+    /**
+     * @brief Opens 'poolSize' connections to 'address' (a Unix socket path, or
+     * "[host:]port" for TCP) and starts the batching thread.
+     * @return false if any connection or handshake fails.
+     */
+    bool connect(const std::string& address, size_t poolSize = 4) {
+        if (batcher.joinable() || poolSize == 0) return false;
+        for (size_t i = 0; i < poolSize; i++) {
+            std::unique_ptr<Connection> connection(new Connection());
+            connection->fd = connectSocket(address);
+            if (connection->fd < 0) break;
+            if (!handshake(connection->fd)) {
+                close(connection->fd);
+                break;
+            }
+            connections.push_back(std::move(connection));
+        }
+        if (connections.size() != poolSize) {
+            for (std::unique_ptr<Connection>& connection : connections) close(connection->fd);
+            connections.clear();
+            return false;
+        }
+        for (std::unique_ptr<Connection>& connection : connections)
+            connection->reader = std::thread(&LockClient::readLoop, this, std::ref(*connection));
+        batcher = std::thread(&LockClient::batchLoop, this);
+        return true;
+    }
+
+    /**
+     * @brief Number of nodes in the server's tree, as announced in its HELLO.
+     */
+    uint32_t size() const { return numNodes; }
+
+    std::future<bool> lock(const std::string& label, int32_t userID) { return submit(1, NODE_UNKNOWN, label, userID); }
+    std::future<bool> unlock(const std::string& label, int32_t userID) { return submit(2, NODE_UNKNOWN, label, userID); }
+    std::future<bool> upgrade(const std::string& label, int32_t userID) { return submit(3, NODE_UNKNOWN, label, userID); }
+
+    /**
+     * @brief Index variants, for callers that already know the node index.
+     */
+    std::future<bool> lockIndex(uint32_t nodeIndex, int32_t userID) { return submit(1, nodeIndex, std::string(), userID); }
+    std::future<bool> unlockIndex(uint32_t nodeIndex, int32_t userID) { return submit(2, nodeIndex, std::string(), userID); }
+    std::future<bool> upgradeIndex(uint32_t nodeIndex, int32_t userID) { return submit(3, nodeIndex, std::string(), userID); }
+};
+
+#endif // LOCK_CLIENT_H
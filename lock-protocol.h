@@ -0,0 +1,274 @@
+/**
+ * @file lock-protocol.h
+ * @brief Framed binary wire protocol of the lock server, shared by server and clients.
+ *
+ * A binary connection starts with the 4-byte magic "LTB1"; the server answers
+ * with a HELLO frame. After that both sides exchange frames, each an 8-byte
+ * FrameHeader followed by 'length' payload bytes. All integers are little-endian.
+ *
+ * Client -> server
+ *   RESOLVE      u32 count, then count x { u16 length, label bytes }
+ *   BATCH        u32 count, then count x BatchRecord (12 bytes each)
+ *   LABEL_BATCH  u32 count, then count x { u8 opcode, u8 0, u16 length, i32 userID, label bytes }
+ *   WATCH        u8 subtree, u8 0, u16 length, label bytes
+ *   UNWATCH      u32 watch id
+ *   SESSION      u32 session id (0 opens a new session), u32 timeout in ms (for a new session)
+ *   HEARTBEAT    empty
+ *   END_SESSION  empty; releases every lock of the bound session
+ *   FOLLOW       u64 number of log records the follower already holds
+ *   PREPARE      u32 transaction id, then one LABEL_BATCH record (shards only)
+ *   COMMIT       u32 transaction id
+ *   ABORT        u32 transaction id
+ *   INQUIRE      empty; asks which transaction is prepared (shards only)
+ *
+ * Server -> client (one response frame per request frame, in order)
+ *   HELLO        u32 protocol version, u32 number of nodes
+ *   RESOLVED     u32 count, then count x u32 node index (NODE_UNKNOWN if absent)
+ *   RESULTS      u32 count, then ceil(count / 8) bytes; bit i (LSB first) is record i's result
+ *   WATCHING     u32 watch id (NODE_UNKNOWN if the label or id is unknown); answers WATCH and UNWATCH
+ *   SESSION_STATE u32 session id (NODE_UNKNOWN if none), u32 locks held (released, for END_SESSION);
+ *                answers SESSION, HEARTBEAT and END_SESSION
+ *   VOTE         u32 transaction id, u8 yes, u8 locked descendants here, 2 x u8 0;
+ *                answers PREPARE, COMMIT and ABORT (yes = acknowledged); answers
+ *                INQUIRE with the prepared transaction's id (0 and no if none)
+ *   ERROR        UTF-8 message; the server closes the connection afterwards
+ *
+ * Server -> client, unsolicited (may arrive between any two responses)
+ *   EVENT        u32 watch id, u32 node index, u8 WatchState, 3 x u8 0
+ *   LOG          u64 index of the first record, then BatchRecords (to followers only)
+ *
+ * A watch reports the state of one node, or with 'subtree' set the state of
+ * the whole subtree below it. The server sends an EVENT with the current state
+ * right after WATCHING, then one each time that state changes.
+ *
+ * Locks taken on a connection bound to a session belong to that session. Any
+ * request on the connection counts as a heartbeat; a session that hears nothing
+ * for its timeout has all its locks released. Sessions survive disconnects, so
+ * a client that reconnects in time resumes its session by id.
+ *
+ * A follower sends FOLLOW instead of requests. The server answers with LOG
+ * frames carrying every logged operation from that position on: first the
+ * backlog, then each group commit as soon as it is durable.
+ *
+ * PREPARE/COMMIT/ABORT are the two-phase commit a router runs on every shard
+ * for an operation on the replicated top of a sharded tree (see
+ * tree-partition.h). PREPARE checks the operation, votes, and on a yes vote
+ * reserves the node with its ancestors and descendants: other operations on
+ * them fail until COMMIT applies it or ABORT drops it. At most one transaction
+ * is prepared at a time. A yes vote is binding: the shard keeps the transaction
+ * prepared, across lost router connections, until a COMMIT or ABORT with its
+ * id arrives on any connection. A router that reconnects sends INQUIRE and
+ * decides what it finds. A repeated COMMIT of the last transaction committed
+ * is confirmed again.
+ *
+ * Labels are resolved once with RESOLVE so that steady-state BATCH frames carry
+ * only 32-bit node indices.
+ *
+ * The text protocol's operation lines are parsed by parseOperationLine().
+ * Servers, router and clients name sockets the same way: a Unix socket path
+ * (anything containing '/') or a TCP "[host:]port", on 127.0.0.1 by default
+ * (see parseSocketAddress()).
+ */
+#ifndef LOCK_PROTOCOL_H
+#define LOCK_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char PROTOCOL_MAGIC[4] = {'L', 'T', 'B', '1'};
+static const uint32_t PROTOCOL_VERSION = 1;
+static const uint32_t MAX_FRAME_LENGTH = 64u << 20;
+static const uint32_t NODE_UNKNOWN = 0xFFFFFFFFu;
+
+enum FrameType : uint8_t {
+    FRAME_RESOLVE = 0x01,
+    FRAME_BATCH = 0x02,
+    FRAME_LABEL_BATCH = 0x03,
+    FRAME_WATCH = 0x04,
+    FRAME_UNWATCH = 0x05,
+    FRAME_SESSION = 0x06,
+    FRAME_HEARTBEAT = 0x07,
+    FRAME_END_SESSION = 0x08,
+    FRAME_FOLLOW = 0x09,
+    FRAME_PREPARE = 0x0A,
+    FRAME_COMMIT = 0x0B,
+    FRAME_ABORT = 0x0C,
+    FRAME_INQUIRE = 0x0D,
+    FRAME_HELLO = 0x80,
+    FRAME_RESOLVED = 0x81,
+    FRAME_RESULTS = 0x82,
+    FRAME_WATCHING = 0x83,
+    FRAME_EVENT = 0x84,
+    FRAME_SESSION_STATE = 0x85,
+    FRAME_LOG = 0x86,
+    FRAME_VOTE = 0x87,
+    FRAME_ERROR = 0xFF,
+};
+
+struct FrameHeader {
+    uint32_t length; // Payload bytes following the header.
+    uint8_t type;    // FrameType.
+    uint8_t reserved[3];
+};
+
+/**
+ * @brief One operation of a BATCH frame.
+ */
+struct BatchRecord {
+    uint8_t opcode; // 1 = lock, 2 = unlock, 3 = upgrade.
+    uint8_t reserved[3];
+    uint32_t nodeIndex;
+    int32_t userID;
+};
+
+/**
+ * @brief State reported by a watch. For a node: LOCKED if it is locked, FREE if
+ * lockNode would succeed, BLOCKED otherwise. For a subtree: LOCKED if any node
+ * in it is locked, BLOCKED if an ancestor is locked, FREE otherwise.
+ */
+enum WatchState : uint8_t {
+    WATCH_FREE = 0,
+    WATCH_LOCKED = 1,
+    WATCH_BLOCKED = 2,
+};
+
+static const char *const watchStateNames[] = {"free", "locked", "blocked"};
+
+static_assert(sizeof(FrameHeader) == 8, "FrameHeader must be 8 bytes");
+static_assert(sizeof(BatchRecord) == 12, "BatchRecord must be 12 bytes");
+
+/**
+ * @brief Reads a little-endian integer from a possibly unaligned buffer.
+ */
+template <typename T>
+inline T readWire(const char *bytes) {
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+template <typename T>
+inline void appendWire(std::string& out, T value) {
+    out.append((const char *)&value, sizeof(T));
+}
+
+inline void appendFrameHeader(std::string& out, uint8_t type, uint32_t length) {
+    FrameHeader header = {length, type, {0, 0, 0}};
+    out.append((const char *)&header, sizeof(header));
+}
+
+/**
+ * @brief One "<opcode> <label> <userID>" line of the text protocol; 'label'
+ * points into the parsed line.
+ */
+struct TextOperation {
+    int opcode;
+    const char *label;
+    size_t labelLength;
+    int32_t userID;
+};
+
+/**
+ * @brief Parses a decimal integer that spans exactly [begin, end), with an
+ * optional sign, into the range [minimum, maximum].
+ */
+inline bool parseWholeInteger(const char *begin, const char *end, int64_t minimum, int64_t maximum, int64_t& value) {
+    bool negative = begin < end && *begin == '-';
+    if (begin < end && (*begin == '-' || *begin == '+')) begin++;
+    if (begin == end) return false;
+    int64_t limit = maximum > -minimum ? maximum : -minimum;
+    int64_t magnitude = 0;
+    for (; begin < end; begin++) {
+        if (*begin < '0' || *begin > '9') return false;
+        magnitude = magnitude * 10 + (*begin - '0');
+        if (magnitude > limit) return false; // Out of range long before it could overflow.
+    }
+    value = negative ? -magnitude : magnitude;
+    return value >= minimum && value <= maximum;
+}
+
+/**
+ * @brief Parses the request line [line, end) (without its newline) as exactly
+ * three space-separated tokens: an opcode 1-3, a label and a user id that fits
+ * an int32, each consumed whole. Nothing outside the line is read. Returns
+ * false for anything else; the caller answers "error".
+ */
+inline bool parseOperationLine(const char *line, const char *end, TextOperation& operation) {
+    const char *tokens[3][2];
+    int count = 0;
+    for (const char *cursor = line; cursor < end;) {
+        while (cursor < end && *cursor == ' ') cursor++;
+        if (cursor == end) break;
+        if (count == 3) return false;
+        tokens[count][0] = cursor;
+        while (cursor < end && *cursor != ' ') cursor++;
+        tokens[count++][1] = cursor;
+    }
+    int64_t opcode, userID;
+    if (count != 3 || !parseWholeInteger(tokens[0][0], tokens[0][1], 1, 3, opcode) ||
+        !parseWholeInteger(tokens[2][0], tokens[2][1], INT32_MIN, INT32_MAX, userID))
+        return false;
+    operation.opcode = (int)opcode;
+    operation.label = tokens[1][0];
+    operation.labelLength = tokens[1][1] - tokens[1][0];
+    operation.userID = (int32_t)userID;
+    return true;
+}
+
+/**
+ * @brief Fills in the socket address of a Unix socket path or "[host:]port".
+ * @return its length, or 0 if it is not a valid address.
+ */
+inline socklen_t parseSocketAddress(const std::string& address, sockaddr_storage& storage) {
+    memset(&storage, 0, sizeof(storage));
+    if (address.find('/') != std::string::npos) {
+        sockaddr_un *unixAddress = (sockaddr_un *)&storage;
+        if (address.size() >= sizeof(unixAddress->sun_path)) return 0;
+        unixAddress->sun_family = AF_UNIX;
+        memcpy(unixAddress->sun_path, address.data(), address.size());
+        return sizeof(sockaddr_un);
+    }
+    size_t colon = address.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    sockaddr_in *inetAddress = (sockaddr_in *)&storage;
+    inetAddress->sin_family = AF_INET;
+    inetAddress->sin_port = htons(atoi(address.c_str() + (colon == std::string::npos ? 0 : colon + 1)));
+    if (inet_pton(AF_INET, host.c_str(), &inetAddress->sin_addr) != 1) return 0;
+    return sizeof(sockaddr_in);
+}
+
+/**
+ * @brief Opens a blocking connection to 'address' (see parseSocketAddress()),
+ * with TCP_NODELAY on TCP. Returns -1 if it fails.
+ */
+inline int connectSocket(const std::string& address) {
+    sockaddr_storage socketAddress;
+    socklen_t length = parseSocketAddress(address, socketAddress);
+    if (length == 0) return -1;
+    int fd = socket(socketAddress.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr *)&socketAddress, length) < 0) {
+        close(fd);
+        return -1;
+    }
+    int noDelay = 1;
+    if (socketAddress.ss_family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return fd;
+}
+
+inline bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+#endif // LOCK_PROTOCOL_H
@@ -0,0 +1,1227 @@
+#include "locking-tree.h"
+#include "lock-protocol.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+/**
+ * Replicated lock service: a cluster of lock-raft processes keeps one
+ * LockingTree consistent through the Raft consensus protocol, so that lock
+ * decisions survive the failure of any minority of the nodes.
+ *
+ * Usage:
+ *   lock-raft --id I --node ADDRESS... --tree FILE --dir DIR [--election-ms T] [--snapshot-every N]
+ *
+ * Every member is started with the same --node list (Unix socket paths or
+ * "[host:]port"); the I-th one is its own address, where it accepts both
+ * clients and its peers. DIR holds the node's durable state: its current term
+ * and vote, its log and its latest snapshot.
+ *
+ * Clients speak the lock server's text protocol, "<opcode> <label> <userID>\n",
+ * to the leader. An operation is appended to the leader's log and answered
+ * "true\n" or "false\n" once a majority holds it and it has been applied; a
+ * node that is not the leader answers "redirect <address>\n" (or "redirect
+ * unknown\n" during an election), and an operation whose entry a new leader
+ * overwrote is answered "retry\n". A former leader that is sent a snapshot
+ * covering an operation it appended but had not applied answers "unknown\n":
+ * the operation may or may not have taken effect, so the client checks with
+ * a read before repeating it. Reads are served from the local state, so on a
+ * follower they may lag: "status <label>", "owner <label>" and "counts"
+ * ("counts <locked nodes> <commit index> <term> leader|follower|candidate").
+ *
+ * Throughput comes from batching and pipelining: all operations received in
+ * one loop iteration are appended with a single write + fdatasync, each
+ * follower is sent them in one APPEND_ENTRIES frame, and up to MAX_IN_FLIGHT
+ * frames per follower are outstanding without waiting for replies. Followers
+ * likewise sync once per iteration before answering everything they received.
+ *
+ * Every N applied entries (--snapshot-every, 100000 by default) a node writes
+ * LockingTree::snapshot() with its log position and drops the log before it; a
+ * follower too far behind is sent the snapshot instead of the entries.
+ *
+ * Only the text operations are replicated: sessions, watches and the binary
+ * and shared-memory transports of lock-server are not offered here.
+ */
+
+static uint64_t nowMs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// ----------------------------------------------------------------------
+// 1. PEER MESSAGES
+// ----------------------------------------------------------------------
+
+/**
+ * Peers open a connection with PROTOCOL_MAGIC and then exchange frames with
+ * the usual FrameHeader. Requests go out on a node's own connection to a peer
+ * and are answered on it; all integers are little-endian.
+ *
+ *   REQUEST_VOTE      u64 term, u32 candidate, u64 lastLogIndex, u64 lastLogTerm
+ *   APPEND_ENTRIES    u64 term, u32 leader, u64 prevLogIndex, u64 prevLogTerm,
+ *                     u64 leaderCommit, then per entry u64 term + BatchRecord
+ *   INSTALL_SNAPSHOT  u64 term, u32 leader, u64 lastIndex, u64 lastTerm, snapshot bytes
+ *   VOTE_REPLY        u64 term, u8 granted, 3 bytes padding
+ *   APPEND_REPLY      u64 term, u8 success, 3 bytes padding, u64 index
+ *
+ * APPEND_REPLY answers both APPEND_ENTRIES and INSTALL_SNAPSHOT. On success
+ * 'index' is the last entry known to match the leader's log; on failure it is
+ * where the leader should resume sending.
+ */
+enum RaftFrameType : uint8_t {
+    FRAME_REQUEST_VOTE = 0x20,
+    FRAME_APPEND_ENTRIES = 0x21,
+    FRAME_INSTALL_SNAPSHOT = 0x22,
+    FRAME_VOTE_REPLY = 0xA0,
+    FRAME_APPEND_REPLY = 0xA1,
+};
+
+static const size_t APPEND_HEADER_SIZE = 8 + 4 + 8 + 8 + 8;
+static const size_t ENTRY_SIZE = 8 + sizeof(BatchRecord);
+static const size_t SNAPSHOT_HEADER_SIZE = 8 + 4 + 8 + 8;
+
+static const int MAX_IN_FLIGHT = 8;                    // APPEND_ENTRIES frames outstanding per follower.
+static const uint64_t MAX_ENTRIES_PER_FRAME = 1 << 14;
+static const uint64_t RECONNECT_MS = 100;
+
+struct LogEntry {
+    uint64_t term;
+    BatchRecord record; // Opcode 0: the no-op a new leader appends.
+};
+
+static void appendEntry(string& out, const LogEntry& entry) {
+    appendWire<uint64_t>(out, entry.term);
+    appendWire<uint8_t>(out, entry.record.opcode);
+    out.append(3, '\0');
+    appendWire<uint32_t>(out, entry.record.nodeIndex);
+    appendWire<int32_t>(out, entry.record.userID);
+}
+
+static LogEntry readEntry(const char *bytes) {
+    LogEntry entry = {};
+    entry.term = readWire<uint64_t>(bytes);
+    entry.record.opcode = readWire<uint8_t>(bytes + 8 + offsetof(BatchRecord, opcode));
+    entry.record.nodeIndex = readWire<uint32_t>(bytes + 8 + offsetof(BatchRecord, nodeIndex));
+    entry.record.userID = readWire<int32_t>(bytes + 8 + offsetof(BatchRecord, userID));
+    return entry;
+}
+
+// ----------------------------------------------------------------------
+// 2. DURABLE STATE
+// ----------------------------------------------------------------------
+
+static const char LOG_MAGIC[4] = {'L', 'T', 'R', 'L'};
+static const char SNAPSHOT_MAGIC[4] = {'L', 'T', 'R', 'S'};
+static const size_t FILE_HEADER_SIZE = 4 + 4 + 8 + 8; // Magic, node count, base index, base term.
+
+static bool readFile(const string& path, string& contents) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return true;
+}
+
+/**
+ * @brief Replaces 'path' with 'contents' so that a crash leaves either the old
+ * or the new file: write a temporary, sync it, rename it over, sync the directory.
+ */
+static bool replaceFile(const string& directory, const string& path, const string& contents) {
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size() && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) < 0) return false;
+    int directoryFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd < 0) return false;
+    ok = fsync(directoryFd) == 0;
+    close(directoryFd);
+    return ok;
+}
+
+static string fileHeader(const char magic[4], uint32_t numNodes, uint64_t index, uint64_t term) {
+    string header(magic, 4);
+    appendWire<uint32_t>(header, numNodes);
+    appendWire<uint64_t>(header, index);
+    appendWire<uint64_t>(header, term);
+    return header;
+}
+
+/**
+ * @brief A node's persistent Raft state in its directory:
+ *   state     u64 currentTerm, i32 votedFor
+ *   snapshot  "LTRS", node count, last included index and term, LockingTree::snapshot()
+ *   log       "LTRL", node count, base index and term, then the entries after the base
+ * The log's base is the snapshot's position. Appended entries stay in memory
+ * until sync(), which writes them all with one fdatasync.
+ */
+class RaftStorage {
+private:
+    string directory;
+    uint32_t numNodes = 0;
+    int stateFd = -1;
+    int logFd = -1;
+    vector<LogEntry> entries; // entries[i] has index baseIndex + 1 + i.
+    size_t writtenEntries = 0;
+
+    string path(const char *name) const { return directory + "/" + name; }
+
+    /**
+     * @brief Rewrites the log file with the base and every entry, then reopens it.
+     */
+    bool rewriteLog() {
+        string contents = fileHeader(LOG_MAGIC, numNodes, baseIndex, baseTerm);
+        for (const LogEntry& entry : entries) appendEntry(contents, entry);
+        if (!replaceFile(directory, path("log"), contents)) return false;
+        if (logFd >= 0) close(logFd);
+        logFd = ::open(path("log").c_str(), O_WRONLY | O_CLOEXEC);
+        writtenEntries = entries.size();
+        return logFd >= 0;
+    }
+
+public:
+    uint64_t currentTerm = 0;
+    int votedFor = -1;
+    uint64_t baseIndex = 0;
+    uint64_t baseTerm = 0;
+    string snapshotData; // Tree state at baseIndex.
+
+    ~RaftStorage() {
+        if (stateFd >= 0) close(stateFd);
+        if (logFd >= 0) close(logFd);
+    }
+
+    /**
+     * @brief Loads (or creates) the state in 'dir' and restores the snapshot
+     * into 'tree'. Log entries are not applied: whether they are committed is
+     * only learnt from the leader. A torn trailing entry is dropped.
+     */
+    bool open(const string& dir, LockingTree& tree) {
+        directory = dir;
+        numNodes = (uint32_t)tree.size();
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return false;
+
+        stateFd = ::open(path("state").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (stateFd < 0) return false;
+        char state[12];
+        if (pread(stateFd, state, sizeof(state), 0) == (ssize_t)sizeof(state)) {
+            currentTerm = readWire<uint64_t>(state);
+            votedFor = readWire<int32_t>(state + 8);
+        }
+
+        string contents;
+        if (readFile(path("snapshot"), contents)) {
+            if (contents.size() < FILE_HEADER_SIZE || memcmp(contents.data(), SNAPSHOT_MAGIC, 4) != 0 ||
+                readWire<uint32_t>(contents.data() + 4) != numNodes) {
+                errno = EINVAL; // Not a snapshot of this tree.
+                return false;
+            }
+            baseIndex = readWire<uint64_t>(contents.data() + 8);
+            baseTerm = readWire<uint64_t>(contents.data() + 16);
+            snapshotData = contents.substr(FILE_HEADER_SIZE);
+            if (!tree.restore(snapshotData)) {
+                errno = EINVAL;
+                return false;
+            }
+        }
+
+        if (!readFile(path("log"), contents) || contents.size() < FILE_HEADER_SIZE) return rewriteLog();
+        if (memcmp(contents.data(), LOG_MAGIC, 4) != 0 || readWire<uint32_t>(contents.data() + 4) != numNodes ||
+            readWire<uint64_t>(contents.data() + 8) > baseIndex) {
+            errno = EINVAL; // Another tree's log, or entries missing before it.
+            return false;
+        }
+        uint64_t logBase = readWire<uint64_t>(contents.data() + 8);
+        size_t count = (contents.size() - FILE_HEADER_SIZE) / ENTRY_SIZE;
+        for (size_t i = 0; i < count; i++) {
+            // A crash between writing a snapshot and compacting leaves entries it already covers.
+            if (logBase + 1 + i <= baseIndex) continue;
+            entries.push_back(readEntry(contents.data() + FILE_HEADER_SIZE + i * ENTRY_SIZE));
+        }
+        if (logBase != baseIndex || FILE_HEADER_SIZE + count * ENTRY_SIZE != contents.size()) return rewriteLog();
+        logFd = ::open(path("log").c_str(), O_WRONLY | O_CLOEXEC);
+        writtenEntries = entries.size();
+        return logFd >= 0;
+    }
+
+    /**
+     * @brief Makes currentTerm and votedFor durable; must precede any message carrying them.
+     */
+    bool saveHardState() {
+        string state;
+        appendWire<uint64_t>(state, currentTerm);
+        appendWire<int32_t>(state, votedFor);
+        return pwrite(stateFd, state.data(), state.size(), 0) == (ssize_t)state.size() && fdatasync(stateFd) == 0;
+    }
+
+    uint64_t lastIndex() const { return baseIndex + entries.size(); }
+    uint64_t lastTerm() const { return entries.empty() ? baseTerm : entries.back().term; }
+
+    /**
+     * @brief Term of the entry at 'index', which must lie in [baseIndex, lastIndex()].
+     */
+    uint64_t termAt(uint64_t index) const { return index == baseIndex ? baseTerm : entries[index - baseIndex - 1].term; }
+
+    const LogEntry& at(uint64_t index) const { return entries[index - baseIndex - 1]; }
+
+    void append(const LogEntry& entry) { entries.push_back(entry); }
+
+    /**
+     * @brief Drops the entries from 'index' on (a conflict with the leader's log).
+     */
+    bool truncateFrom(uint64_t index) {
+        size_t keep = index - baseIndex - 1;
+        entries.resize(keep);
+        if (writtenEntries <= keep) return true;
+        writtenEntries = keep;
+        return ftruncate(logFd, FILE_HEADER_SIZE + keep * ENTRY_SIZE) == 0;
+    }
+
+    bool hasUnsynced() const { return writtenEntries < entries.size(); }
+
+    /**
+     * @brief Writes every entry appended since the last sync, with one fdatasync.
+     */
+    bool sync() {
+        if (!hasUnsynced()) return true;
+        string bytes;
+        for (size_t i = writtenEntries; i < entries.size(); i++) appendEntry(bytes, entries[i]);
+        off_t offset = FILE_HEADER_SIZE + writtenEntries * ENTRY_SIZE;
+        if (pwrite(logFd, bytes.data(), bytes.size(), offset) != (ssize_t)bytes.size() || fdatasync(logFd) < 0)
+            return false;
+        writtenEntries = entries.size();
+        return true;
+    }
+
+    /**
+     * @brief Stores the tree state at 'index' (which this log holds) and
+     * compacts the log to the entries after it.
+     */
+    bool saveSnapshot(uint64_t index, uint64_t term, string data) {
+        if (!replaceFile(directory, path("snapshot"), fileHeader(SNAPSHOT_MAGIC, numNodes, index, term) + data))
+            return false;
+        entries.erase(entries.begin(), entries.begin() + (index - baseIndex));
+        baseIndex = index;
+        baseTerm = term;
+        snapshotData.swap(data);
+        return rewriteLog();
+    }
+
+    /**
+     * @brief Whether this log holds the entry at 'index' with 'term', so a
+     * snapshot ending there leaves the entries after it valid.
+     */
+    bool holds(uint64_t index, uint64_t term) const {
+        return index >= baseIndex && index <= lastIndex() && termAt(index) == term;
+    }
+
+    /**
+     * @brief Installs a snapshot received from the leader. As in Raft, the
+     * entries after it are kept if the log holds its last entry; otherwise
+     * the whole log is replaced.
+     */
+    bool installSnapshot(uint64_t index, uint64_t term, string data) {
+        if (!holds(index, term)) {
+            entries.clear();
+            baseIndex = index;
+        }
+        return saveSnapshot(index, term, move(data));
+    }
+};
+
+// ----------------------------------------------------------------------
+// 3. CONSENSUS
+// ----------------------------------------------------------------------
+
+enum ConnectionMode { MODE_UNKNOWN, MODE_TEXT, MODE_PEER };
+
+/**
+ * @brief An accepted connection: a client, or a peer sending us requests.
+ */
+struct Connection {
+    uint64_t id;
+    int fd;
+    ConnectionMode mode = MODE_UNKNOWN;
+    string input;
+    string output;
+    bool peerClosed = false;
+    bool closeAfterFlush = false;
+    bool writable = true; // False while epoll waits for EPOLLOUT.
+
+    /**
+     * @brief Responses in request order; an operation's is filled in when its
+     * entry is applied (index != 0 until then).
+     */
+    struct Reply {
+        uint64_t index;
+        uint64_t term;
+        string text;
+    };
+    deque<Reply> replies;
+
+    Connection(uint64_t connectionID, int socketFd) : id(connectionID), fd(socketFd) {}
+};
+
+/**
+ * @brief This node's own connection to another member, carrying its requests.
+ */
+struct Peer {
+    int id;
+    string address;
+    int fd = -1;
+    bool connected = false;
+    bool writable = true;
+    uint64_t retryAt = 0;
+    string input;
+    string output;
+
+    // Leader only.
+    uint64_t nextIndex = 1;
+    uint64_t matchIndex = 0;
+    int inFlight = 0;
+    uint64_t lastSentMs = 0;
+};
+
+enum Role { FOLLOWER, CANDIDATE, LEADER };
+static const char *const roleNames[] = {"follower", "candidate", "leader"};
+
+class RaftNode {
+private:
+    static const size_t MAX_PENDING_REPLIES = 1 << 16; // Stop parsing a client's input past this.
+
+    LockingTree& tree;
+    RaftStorage& storage;
+    int selfID;
+    vector<string> addresses;
+    vector<unique_ptr<Peer>> peers; // One per other member.
+    uint64_t snapshotEvery;
+
+    Role role = FOLLOWER;
+    int leaderID = -1;
+    uint64_t commitIndex;
+    uint64_t lastApplied;
+    int votes = 0;
+
+    uint64_t electionMs;
+    uint64_t electionDeadline = 0;
+    mt19937_64 random;
+
+    unordered_map<uint64_t, unique_ptr<Connection>> connections;
+    uint64_t nextConnectionID = 1;
+    unordered_map<uint64_t, uint64_t> waiters; // Log index -> client connection awaiting it.
+    string labelScratch;
+
+    void resetElectionTimer() { electionDeadline = nowMs() + electionMs + random() % electionMs; }
+
+    int majority() const { return (int)(peers.size() + 1) / 2 + 1; }
+
+    bool saveHardState() {
+        if (storage.saveHardState()) return true;
+        perror("raft: cannot save term and vote");
+        exit(1); // Carrying on could vote twice in one term.
+    }
+
+    /**
+     * @brief Adopts a newer term seen in any message, reverting to follower.
+     */
+    void observeTerm(uint64_t term) {
+        if (term <= storage.currentTerm) return;
+        storage.currentTerm = term;
+        storage.votedFor = -1;
+        saveHardState();
+        if (role != FOLLOWER) resetElectionTimer();
+        role = FOLLOWER;
+        leaderID = -1;
+    }
+
+    void startElection() {
+        role = CANDIDATE;
+        leaderID = -1;
+        storage.currentTerm++;
+        storage.votedFor = selfID;
+        saveHardState();
+        votes = 1;
+        resetElectionTimer();
+        if (votes >= majority()) return becomeLeader();
+        for (auto& peer : peers) requestVote(*peer);
+    }
+
+    void requestVote(Peer& peer) {
+        if (!peer.connected) return;
+        appendFrameHeader(peer.output, FRAME_REQUEST_VOTE, 28);
+        appendWire<uint64_t>(peer.output, storage.currentTerm);
+        appendWire<uint32_t>(peer.output, (uint32_t)selfID);
+        appendWire<uint64_t>(peer.output, storage.lastIndex());
+        appendWire<uint64_t>(peer.output, storage.lastTerm());
+    }
+
+    /**
+     * @brief Takes over: followers are assumed to match up to the end of our
+     * log, and a no-op in the new term lets earlier entries commit.
+     */
+    void becomeLeader() {
+        role = LEADER;
+        leaderID = selfID;
+        for (auto& peer : peers) {
+            peer->nextIndex = storage.lastIndex() + 1;
+            peer->matchIndex = 0;
+            peer->inFlight = 0;
+            peer->lastSentMs = 0;
+        }
+        storage.append(LogEntry{storage.currentTerm, BatchRecord{0, {0, 0, 0}, 0, 0}});
+        cerr << "raft: node " << selfID << " leads term " << storage.currentTerm << "\n";
+    }
+
+    void sendSnapshot(Peer& peer) {
+        appendFrameHeader(peer.output, FRAME_INSTALL_SNAPSHOT, (uint32_t)(SNAPSHOT_HEADER_SIZE + storage.snapshotData.size()));
+        appendWire<uint64_t>(peer.output, storage.currentTerm);
+        appendWire<uint32_t>(peer.output, (uint32_t)selfID);
+        appendWire<uint64_t>(peer.output, storage.baseIndex);
+        appendWire<uint64_t>(peer.output, storage.baseTerm);
+        peer.output.append(storage.snapshotData);
+        peer.nextIndex = storage.baseIndex + 1;
+    }
+
+    void sendEntries(Peer& peer, uint64_t end) {
+        uint64_t prev = peer.nextIndex - 1;
+        appendFrameHeader(peer.output, FRAME_APPEND_ENTRIES, (uint32_t)(APPEND_HEADER_SIZE + (end - prev - 1) * ENTRY_SIZE));
+        appendWire<uint64_t>(peer.output, storage.currentTerm);
+        appendWire<uint32_t>(peer.output, (uint32_t)selfID);
+        appendWire<uint64_t>(peer.output, prev);
+        appendWire<uint64_t>(peer.output, storage.termAt(prev));
+        appendWire<uint64_t>(peer.output, commitIndex);
+        for (uint64_t index = peer.nextIndex; index < end; index++) appendEntry(peer.output, storage.at(index));
+        peer.nextIndex = end;
+    }
+
+    /**
+     * @brief Pipelines the durable entries a follower lacks, without waiting
+     * for earlier frames to be acknowledged; sends a heartbeat when idle.
+     * Heartbeats count against MAX_IN_FLIGHT like any other frame, and one
+     * that finds nextIndex behind the snapshot is the snapshot itself.
+     */
+    void replicate(Peer& peer, uint64_t now) {
+        if (!peer.connected) return;
+        uint64_t durableEnd = storage.lastIndex() + 1;
+        bool sent = false;
+        while (peer.inFlight < MAX_IN_FLIGHT) {
+            if (peer.nextIndex <= storage.baseIndex) {
+                sendSnapshot(peer);
+            } else if (peer.nextIndex < durableEnd) {
+                sendEntries(peer, min(durableEnd, peer.nextIndex + MAX_ENTRIES_PER_FRAME));
+            } else if (!sent && now - peer.lastSentMs >= electionMs / 6) {
+                sendEntries(peer, peer.nextIndex); // Heartbeat.
+            } else {
+                break;
+            }
+            peer.inFlight++;
+            sent = true;
+        }
+        if (sent) peer.lastSentMs = now;
+    }
+
+    /**
+     * @brief Commits the highest index held by a majority, if it is from the
+     * current term (entries of earlier terms commit along with it).
+     */
+    void advanceCommitIndex() {
+        vector<uint64_t> matched = {storage.lastIndex()};
+        for (auto& peer : peers) matched.push_back(peer->matchIndex);
+        sort(matched.begin(), matched.end(), greater<uint64_t>());
+        uint64_t candidate = matched[majority() - 1];
+        if (candidate > commitIndex && storage.termAt(candidate) == storage.currentTerm) commitIndex = candidate;
+    }
+
+    Connection::Reply *pendingReply(Connection& connection, uint64_t index) {
+        for (Connection::Reply& reply : connection.replies)
+            if (reply.index == index) return &reply;
+        return nullptr;
+    }
+
+    /**
+     * @brief Answers the client waiting on 'index', if any, with 'text'; with
+     * the term of the applied entry, "retry" if that is not the one it appended.
+     */
+    void resolve(uint64_t index, const char *text, uint64_t entryTerm = 0) {
+        auto it = waiters.find(index);
+        if (it == waiters.end()) return;
+        Connection *connection = find(it->second);
+        waiters.erase(it);
+        if (!connection) return;
+        Connection::Reply *reply = pendingReply(*connection, index);
+        if (!reply) return;
+        // Our entry was overwritten by another leader's: it never took effect.
+        reply->text = entryTerm != 0 && entryTerm != reply->term ? "retry\n" : text;
+        reply->index = 0;
+        drainReplies(*connection);
+    }
+
+    void drainReplies(Connection& connection) {
+        while (!connection.replies.empty() && connection.replies.front().index == 0) {
+            connection.output.append(connection.replies.front().text);
+            connection.replies.pop_front();
+        }
+    }
+
+    void applyCommitted() {
+        while (lastApplied < commitIndex) {
+            uint64_t index = ++lastApplied;
+            const LogEntry& entry = storage.at(index);
+            bool result = false;
+            switch (entry.record.opcode) {
+                case 1: result = tree.lockIndex((int)entry.record.nodeIndex, entry.record.userID); break;
+                case 2: result = tree.unlockIndex((int)entry.record.nodeIndex, entry.record.userID); break;
+                case 3: result = tree.upgradeIndex((int)entry.record.nodeIndex, entry.record.userID); break;
+            }
+            resolve(index, result ? "true\n" : "false\n", entry.term);
+        }
+        if (lastApplied - storage.baseIndex >= snapshotEvery &&
+            !storage.saveSnapshot(lastApplied, storage.termAt(lastApplied), tree.snapshot()))
+            perror("raft: cannot write snapshot");
+    }
+
+    void appendReply(Connection& connection, bool success, uint64_t index) {
+        appendFrameHeader(connection.output, FRAME_APPEND_REPLY, 20);
+        appendWire<uint64_t>(connection.output, storage.currentTerm);
+        appendWire<uint8_t>(connection.output, success);
+        connection.output.append(3, '\0');
+        appendWire<uint64_t>(connection.output, index);
+    }
+
+    /**
+     * @brief Accepts the sender of a current-term APPEND_ENTRIES or
+     * INSTALL_SNAPSHOT as leader.
+     */
+    bool acceptLeader(uint64_t term, uint32_t leader) {
+        observeTerm(term);
+        if (term < storage.currentTerm) return false;
+        role = FOLLOWER;
+        leaderID = (int)leader;
+        resetElectionTimer();
+        return true;
+    }
+
+    void handleRequestVote(Connection& connection, const char *payload, uint32_t length) {
+        if (length != 28) return protocolError(connection);
+        uint64_t term = readWire<uint64_t>(payload);
+        int candidate = (int)readWire<uint32_t>(payload + 8);
+        uint64_t lastIndex = readWire<uint64_t>(payload + 12);
+        uint64_t lastTerm = readWire<uint64_t>(payload + 20);
+        observeTerm(term);
+
+        bool upToDate = lastTerm > storage.lastTerm() || (lastTerm == storage.lastTerm() && lastIndex >= storage.lastIndex());
+        bool granted = term == storage.currentTerm && upToDate &&
+                       (storage.votedFor == -1 || storage.votedFor == candidate);
+        if (granted) {
+            storage.votedFor = candidate;
+            saveHardState();
+            resetElectionTimer();
+        }
+        appendFrameHeader(connection.output, FRAME_VOTE_REPLY, 12);
+        appendWire<uint64_t>(connection.output, storage.currentTerm);
+        appendWire<uint8_t>(connection.output, granted);
+        connection.output.append(3, '\0');
+    }
+
+    /**
+     * @brief APPEND_ENTRIES. The reply is sent after this iteration's sync(),
+     * so a success always covers durable entries.
+     */
+    void handleAppendEntries(Connection& connection, const char *payload, uint32_t length) {
+        if (length < APPEND_HEADER_SIZE || (length - APPEND_HEADER_SIZE) % ENTRY_SIZE != 0) return protocolError(connection);
+        uint64_t term = readWire<uint64_t>(payload);
+        uint32_t leader = readWire<uint32_t>(payload + 8);
+        uint64_t prevIndex = readWire<uint64_t>(payload + 12);
+        uint64_t prevTerm = readWire<uint64_t>(payload + 20);
+        uint64_t leaderCommit = readWire<uint64_t>(payload + 28);
+        uint64_t count = (length - APPEND_HEADER_SIZE) / ENTRY_SIZE;
+        if (!acceptLeader(term, leader)) return appendReply(connection, false, 0);
+
+        if (prevIndex > storage.lastIndex()) return appendReply(connection, false, storage.lastIndex() + 1);
+        if (prevIndex >= storage.baseIndex && storage.termAt(prevIndex) != prevTerm) {
+            // Skip back over the whole conflicting term in one round trip.
+            uint64_t conflictTerm = storage.termAt(prevIndex), hint = prevIndex;
+            while (hint - 1 > max(storage.baseIndex, commitIndex) && storage.termAt(hint - 1) == conflictTerm) hint--;
+            return appendReply(connection, false, hint);
+        }
+
+        const char *bytes = payload + APPEND_HEADER_SIZE;
+        for (uint64_t i = 0; i < count; i++, bytes += ENTRY_SIZE) {
+            uint64_t index = prevIndex + 1 + i;
+            if (index <= storage.baseIndex) continue; // Covered by our snapshot, so committed and equal.
+            LogEntry entry = readEntry(bytes);
+            if (index <= storage.lastIndex()) {
+                if (storage.termAt(index) == entry.term) continue;
+                for (uint64_t dropped = index; dropped <= storage.lastIndex(); dropped++) resolve(dropped, "retry\n");
+                if (!storage.truncateFrom(index)) {
+                    perror("raft: cannot truncate log");
+                    exit(1);
+                }
+            }
+            storage.append(entry);
+        }
+        uint64_t matched = prevIndex + count;
+        if (leaderCommit > commitIndex) commitIndex = max(commitIndex, min(leaderCommit, matched));
+        appendReply(connection, true, matched);
+    }
+
+    void handleInstallSnapshot(Connection& connection, const char *payload, uint32_t length) {
+        if (length < SNAPSHOT_HEADER_SIZE) return protocolError(connection);
+        uint64_t term = readWire<uint64_t>(payload);
+        uint32_t leader = readWire<uint32_t>(payload + 8);
+        uint64_t lastIndex = readWire<uint64_t>(payload + 12);
+        uint64_t lastTerm = readWire<uint64_t>(payload + 20);
+        if (!acceptLeader(term, leader)) return appendReply(connection, false, 0);
+        if (lastIndex <= commitIndex) return appendReply(connection, true, lastIndex); // Already have it all.
+
+        string data(payload + SNAPSHOT_HEADER_SIZE, length - SNAPSHOT_HEADER_SIZE);
+        if (!tree.restore(data)) return protocolError(connection);
+        // Whether the operations waiting on covered entries took effect is unknown here.
+        for (uint64_t index = lastApplied + 1; index <= lastIndex; index++) resolve(index, "unknown\n");
+        if (!storage.holds(lastIndex, lastTerm))
+            for (uint64_t index = lastIndex + 1; index <= storage.lastIndex(); index++) resolve(index, "retry\n");
+        if (!storage.installSnapshot(lastIndex, lastTerm, move(data))) {
+            perror("raft: cannot install snapshot");
+            exit(1);
+        }
+        commitIndex = lastApplied = lastIndex;
+        appendReply(connection, true, lastIndex);
+    }
+
+    void protocolError(Connection& connection) {
+        cerr << "raft: malformed frame from a peer\n";
+        connection.closeAfterFlush = true;
+    }
+
+    void processPeerInput(Connection& connection) {
+        string& input = connection.input;
+        size_t start = 0;
+        while (!connection.closeAfterFlush && input.size() - start >= sizeof(FrameHeader)) {
+            uint32_t length = readWire<uint32_t>(input.data() + start);
+            uint8_t type = readWire<uint8_t>(input.data() + start + offsetof(FrameHeader, type));
+            if (length > MAX_FRAME_LENGTH) {
+                protocolError(connection);
+                break;
+            }
+            if (input.size() - start < sizeof(FrameHeader) + length) break;
+            const char *payload = input.data() + start + sizeof(FrameHeader);
+            switch (type) {
+                case FRAME_REQUEST_VOTE: handleRequestVote(connection, payload, length); break;
+                case FRAME_APPEND_ENTRIES: handleAppendEntries(connection, payload, length); break;
+                case FRAME_INSTALL_SNAPSHOT: handleInstallSnapshot(connection, payload, length); break;
+                default: protocolError(connection); break;
+            }
+            start += sizeof(FrameHeader) + length;
+        }
+        input.erase(0, start);
+    }
+
+    void readyReply(Connection& connection, string text) {
+        connection.replies.push_back(Connection::Reply{0, 0, move(text)});
+    }
+
+    void handleCommandLine(Connection& connection, const vector<string>& words) {
+        int nodeIndex = words.size() == 2 ? tree.getIndex(words[1]) : -1;
+        if (words[0] == "status" && nodeIndex >= 0) {
+            uint8_t state = tree.isLocked(nodeIndex) ? WATCH_LOCKED
+                            : tree.hasLockedAncestor(nodeIndex) || tree.hasLockedDescendant(nodeIndex) ? WATCH_BLOCKED
+                            : WATCH_FREE;
+            return readyReply(connection, string("status ") + watchStateNames[state] + "\n");
+        }
+        if (words[0] == "owner" && nodeIndex >= 0)
+            return readyReply(connection, "owner " + (tree.isLocked(nodeIndex) ? to_string(tree.ownerOf(nodeIndex)) : "none") + "\n");
+        if (words[0] == "counts" && words.size() == 1) {
+            int locked = tree.lockCount();
+            return readyReply(connection, "counts " + to_string(locked) + " " + to_string(commitIndex) + " " +
+                                              to_string(storage.currentTerm) + " " + roleNames[role] + "\n");
+        }
+        readyReply(connection, "error\n");
+    }
+
+    /**
+     * @brief One text request: reads are answered in place, operations are
+     * appended to the log and answered once applied.
+     */
+    void handleLine(Connection& connection, const char *line, const char *end) {
+        vector<string> words;
+        for (const char *cursor = line; cursor < end;) {
+            while (cursor < end && *cursor == ' ') cursor++;
+            const char *wordBegin = cursor;
+            while (cursor < end && *cursor != ' ') cursor++;
+            if (cursor > wordBegin) words.emplace_back(wordBegin, cursor);
+        }
+        if (words.empty()) return;
+        if (isalpha((unsigned char)words[0][0])) return handleCommandLine(connection, words);
+
+        TextOperation operation;
+        if (!parseOperationLine(line, end, operation)) return readyReply(connection, "error\n");
+        if (role != LEADER)
+            return readyReply(connection, "redirect " + (leaderID >= 0 ? addresses[leaderID] : string("unknown")) + "\n");
+
+        int nodeIndex = tree.getIndex(words[1]);
+        if (nodeIndex < 0) return readyReply(connection, "false\n");
+        storage.append(LogEntry{storage.currentTerm, BatchRecord{(uint8_t)operation.opcode, {0, 0, 0}, (uint32_t)nodeIndex, operation.userID}});
+        waiters[storage.lastIndex()] = connection.id;
+        connection.replies.push_back(Connection::Reply{storage.lastIndex(), storage.currentTerm, string()});
+    }
+
+    void processTextInput(Connection& connection) {
+        string& input = connection.input;
+        size_t start = 0, newline;
+        while (connection.replies.size() < MAX_PENDING_REPLIES && (newline = input.find('\n', start)) != string::npos) {
+            const char *end = input.data() + newline;
+            if (end > input.data() + start && end[-1] == '\r') end--;
+            handleLine(connection, input.data() + start, end);
+            start = newline + 1;
+        }
+        input.erase(0, start);
+        drainReplies(connection);
+    }
+
+public:
+    RaftNode(LockingTree& lockingTree, RaftStorage& durable, int id, const vector<string>& nodeAddresses,
+             uint64_t electionTimeoutMs, uint64_t snapshotInterval)
+        : tree(lockingTree), storage(durable), selfID(id), addresses(nodeAddresses), snapshotEvery(snapshotInterval),
+          commitIndex(durable.baseIndex), lastApplied(durable.baseIndex), electionMs(electionTimeoutMs),
+          random(((uint64_t)getpid() << 20) ^ nowMs()) {
+        for (int i = 0; i < (int)addresses.size(); i++) {
+            if (i == selfID) continue;
+            peers.emplace_back(new Peer());
+            peers.back()->id = i;
+            peers.back()->address = addresses[i];
+        }
+        resetElectionTimer();
+    }
+
+    const vector<unique_ptr<Peer>>& peerLinks() { return peers; }
+
+    Connection& open(int fd) {
+        uint64_t id = nextConnectionID++;
+        unique_ptr<Connection>& slot = connections[id];
+        slot.reset(new Connection(id, fd));
+        return *slot;
+    }
+
+    Connection *find(uint64_t id) {
+        auto it = connections.find(id);
+        return it == connections.end() ? nullptr : it->second.get();
+    }
+
+    void erase(uint64_t id) { connections.erase(id); } // Its waiters resolve to nothing.
+
+    template <typename Visitor>
+    void forEachConnection(Visitor visit) {
+        for (auto& entry : connections) visit(*entry.second);
+    }
+
+    /**
+     * @brief Picks the protocol from the first bytes, then handles every complete request.
+     */
+    void processInput(Connection& connection) {
+        string& input = connection.input;
+        if (connection.mode == MODE_UNKNOWN && !input.empty()) {
+            if (input[0] != PROTOCOL_MAGIC[0]) {
+                connection.mode = MODE_TEXT;
+            } else if (input.size() >= sizeof(PROTOCOL_MAGIC)) {
+                connection.mode = MODE_PEER;
+                if (memcmp(input.data(), PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC)) != 0) connection.closeAfterFlush = true;
+                input.erase(0, sizeof(PROTOCOL_MAGIC));
+            }
+        }
+        if (connection.mode == MODE_TEXT) processTextInput(connection);
+        else if (connection.mode == MODE_PEER) processPeerInput(connection);
+    }
+
+    void peerConnected(Peer& peer) {
+        peer.connected = true;
+        peer.output.assign(PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC));
+        peer.inFlight = 0;
+        peer.lastSentMs = 0;
+        peer.nextIndex = max(peer.nextIndex, peer.matchIndex + 1);
+        if (role == CANDIDATE) requestVote(peer);
+    }
+
+    /**
+     * @brief Frames in flight on a lost connection are gone; resume from what is known to match.
+     */
+    void peerLost(Peer& peer) {
+        peer.connected = false;
+        peer.input.clear();
+        peer.output.clear();
+        peer.inFlight = 0;
+        peer.nextIndex = peer.matchIndex + 1;
+    }
+
+    /**
+     * @brief Handles the replies that came back on our connection to 'peer'.
+     * @return false on a malformed frame.
+     */
+    bool processPeerReplies(Peer& peer) {
+        string& input = peer.input;
+        size_t start = 0;
+        bool ok = true;
+        while (input.size() - start >= sizeof(FrameHeader)) {
+            uint32_t length = readWire<uint32_t>(input.data() + start);
+            uint8_t type = readWire<uint8_t>(input.data() + start + offsetof(FrameHeader, type));
+            if (length > MAX_FRAME_LENGTH) {
+                ok = false;
+                break;
+            }
+            if (input.size() - start < sizeof(FrameHeader) + length) break;
+            const char *payload = input.data() + start + sizeof(FrameHeader);
+            start += sizeof(FrameHeader) + length;
+
+            if (type == FRAME_VOTE_REPLY && length == 12) {
+                uint64_t term = readWire<uint64_t>(payload);
+                observeTerm(term);
+                if (role == CANDIDATE && term == storage.currentTerm && readWire<uint8_t>(payload + 8) && ++votes >= majority())
+                    becomeLeader();
+            } else if (type == FRAME_APPEND_REPLY && length == 20) {
+                uint64_t term = readWire<uint64_t>(payload);
+                bool success = readWire<uint8_t>(payload + 8) != 0;
+                uint64_t index = readWire<uint64_t>(payload + 12);
+                observeTerm(term);
+                // A reply in our own term answers a frame of this leadership.
+                if (role != LEADER || term != storage.currentTerm) continue;
+                if (peer.inFlight > 0) peer.inFlight--;
+                if (success) {
+                    peer.matchIndex = max(peer.matchIndex, index);
+                    peer.nextIndex = max(peer.nextIndex, peer.matchIndex + 1);
+                } else {
+                    peer.nextIndex = max(peer.matchIndex + 1, min(index, storage.lastIndex() + 1));
+                }
+            } else {
+                ok = false;
+                break;
+            }
+        }
+        input.erase(0, start);
+        return ok;
+    }
+
+    /**
+     * @brief Milliseconds until tick() has work: an election or a heartbeat.
+     */
+    int timeout(uint64_t now) const {
+        uint64_t deadline = electionDeadline;
+        if (role == LEADER) deadline = now + electionMs / 6;
+        for (auto& peer : peers)
+            if (!peer->connected) deadline = min(deadline, peer->retryAt);
+        return deadline <= now ? 0 : (int)min<uint64_t>(deadline - now, 1000);
+    }
+
+    void tick(uint64_t now) {
+        if (role != LEADER && now >= electionDeadline) startElection();
+    }
+
+    /**
+     * @brief Called after each round of I/O: makes everything appended in it
+     * durable with one sync, then replicates, commits and applies. Replies to
+     * peers and clients are only sent after this.
+     */
+    void endOfIteration() {
+        if (!storage.sync()) {
+            perror("raft: cannot write log");
+            exit(1);
+        }
+        if (role == LEADER) {
+            uint64_t now = nowMs();
+            for (auto& peer : peers) replicate(*peer, now);
+            advanceCommitIndex();
+        }
+        applyCommitted();
+        for (auto& entry : connections) {
+            Connection& connection = *entry.second;
+            if (connection.mode == MODE_TEXT && connection.replies.size() < MAX_PENDING_REPLIES &&
+                connection.input.find('\n') != string::npos)
+                processTextInput(connection); // Resumes a client paused on MAX_PENDING_REPLIES.
+        }
+    }
+};
+
+// ----------------------------------------------------------------------
+// 4. EVENT LOOP
+// ----------------------------------------------------------------------
+
+static int listenOn(const string& address) {
+    sockaddr_storage socketAddress;
+    socklen_t length = parseSocketAddress(address, socketAddress);
+    if (length == 0) return -1;
+    if (socketAddress.ss_family == AF_UNIX) unlink(address.c_str());
+    int fd = socket(socketAddress.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (fd >= 0 && socketAddress.ss_family == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (fd < 0 || bind(fd, (sockaddr *)&socketAddress, length) < 0 || listen(fd, SOMAXCONN) < 0 || !setNonBlocking(fd))
+        return -1;
+    return fd;
+}
+
+/**
+ * @brief Starts a non-blocking connect; completion shows up as EPOLLOUT.
+ */
+static int startConnect(const string& address) {
+    sockaddr_storage socketAddress;
+    socklen_t length = parseSocketAddress(address, socketAddress);
+    if (length == 0) return -1;
+    int fd = socket(socketAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr *)&socketAddress, length) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    int noDelay = 1;
+    if (socketAddress.ss_family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return fd;
+}
+
+/**
+ * @brief Reads everything available from 'fd' into 'input'.
+ * @return false once the other end has closed or the socket failed.
+ */
+static bool receiveAll(int fd, string& input) {
+    char chunk[64 * 1024];
+    while (true) {
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received > 0) {
+            input.append(chunk, received);
+            continue;
+        }
+        return received < 0 && (errno == EAGAIN || errno == EINTR);
+    }
+}
+
+/**
+ * @brief Sends as much of 'output' as the socket takes.
+ * @return false if the socket failed.
+ */
+static bool sendSome(int fd, string& output) {
+    size_t sent = 0;
+    while (sent < output.size()) {
+        ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    output.erase(0, sent);
+    return true;
+}
+
+// Epoll keys: descriptors are small, so the high bits tell the kinds apart.
+static const uint64_t PEER_TAG = 1ull << 62;
+static const uint64_t CONNECTION_TAG = 1ull << 61;
+
+/**
+ * @brief Level-triggered epoll loop. Every round of I/O ends with
+ * RaftNode::endOfIteration(), and only then are outputs sent.
+ */
+static int serve(RaftNode& node, int listenFd, int signalFd) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.u64 = (uint64_t)signalFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event);
+
+    const vector<unique_ptr<Peer>>& peers = node.peerLinks();
+    auto dropPeer = [&](Peer& peer) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, peer.fd, nullptr);
+        close(peer.fd);
+        peer.fd = -1;
+        peer.retryAt = nowMs() + RECONNECT_MS;
+        node.peerLost(peer);
+    };
+
+    epoll_event events[64];
+    vector<uint64_t> finished;
+    while (true) {
+        uint64_t now = nowMs();
+        for (size_t i = 0; i < peers.size(); i++) {
+            Peer& peer = *peers[i];
+            if (peer.fd >= 0 || now < peer.retryAt) continue;
+            peer.fd = startConnect(peer.address);
+            if (peer.fd < 0) {
+                peer.retryAt = now + RECONNECT_MS;
+                continue;
+            }
+            peer.writable = false;
+            event.events = EPOLLIN | EPOLLOUT;
+            event.data.u64 = PEER_TAG | i;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, peer.fd, &event);
+        }
+
+        int ready = epoll_wait(epollFd, events, 64, node.timeout(nowMs()));
+        if (ready < 0 && errno != EINTR) return 1;
+        for (int e = 0; e < ready; e++) {
+            uint64_t key = events[e].data.u64;
+            if (key == (uint64_t)signalFd) {
+                node.forEachConnection([](Connection& connection) { close(connection.fd); });
+                for (auto& peer : peers)
+                    if (peer->fd >= 0) close(peer->fd);
+                close(epollFd);
+                return 0;
+            }
+            if (key == (uint64_t)listenFd) {
+                int clientFd;
+                while ((clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Connection& connection = node.open(clientFd);
+                    event.events = EPOLLIN;
+                    event.data.u64 = CONNECTION_TAG | connection.id;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+                }
+                continue;
+            }
+            if (key & PEER_TAG) {
+                Peer& peer = *peers[key & ~PEER_TAG];
+                if (peer.fd < 0) continue; // Dropped earlier in this round.
+                if (!peer.connected) {
+                    int error = 0;
+                    socklen_t length = sizeof(error);
+                    if (getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                        dropPeer(peer);
+                        continue;
+                    }
+                    node.peerConnected(peer);
+                }
+                if (!receiveAll(peer.fd, peer.input) || !node.processPeerReplies(peer)) dropPeer(peer);
+                continue;
+            }
+
+            Connection *connection = node.find(key & ~CONNECTION_TAG);
+            if (!connection) continue;
+            if ((events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !connection->peerClosed) {
+                if (!receiveAll(connection->fd, connection->input)) connection->peerClosed = true;
+                node.processInput(*connection);
+            }
+        }
+
+        node.tick(nowMs());
+        node.endOfIteration();
+
+        for (size_t i = 0; i < peers.size(); i++) {
+            Peer& peer = *peers[i];
+            if (!peer.connected) continue;
+            if (!sendSome(peer.fd, peer.output)) {
+                dropPeer(peer);
+                continue;
+            }
+            if (peer.writable != peer.output.empty()) {
+                peer.writable = peer.output.empty();
+                event.events = EPOLLIN | (peer.writable ? 0u : (uint32_t)EPOLLOUT);
+                event.data.u64 = PEER_TAG | i;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, peer.fd, &event);
+            }
+        }
+        finished.clear();
+        node.forEachConnection([&](Connection& connection) {
+            if (!sendSome(connection.fd, connection.output)) {
+                finished.push_back(connection.id);
+                return;
+            }
+            bool drained = connection.output.empty();
+            if (drained && (connection.closeAfterFlush || (connection.peerClosed && connection.replies.empty()))) {
+                finished.push_back(connection.id);
+                return;
+            }
+            // Keep reading while output waits: a client may send everything before it reads.
+            if (connection.writable != drained || connection.peerClosed) {
+                connection.writable = drained;
+                event.events = (connection.peerClosed ? 0u : (uint32_t)EPOLLIN) | (drained ? 0u : (uint32_t)EPOLLOUT);
+                event.data.u64 = CONNECTION_TAG | connection.id;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+            }
+        });
+        for (uint64_t id : finished) {
+            Connection *connection = node.find(id);
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+            close(connection->fd);
+            node.erase(id);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------
+// 5. MAIN EXECUTION
+// ----------------------------------------------------------------------
+
+static int usage(const char *program) {
+    cerr << "usage: " << program << " --id I --node ADDRESS... --tree FILE --dir DIR [--election-ms T]"
+         << " [--snapshot-every N]\n";
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    ios_base::sync_with_stdio(false);
+
+    string treeFile, directory;
+    int selfID = -1;
+    uint64_t electionMs = 300, snapshotEvery = 100000;
+    vector<string> addresses;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return usage(argv[0]);
+        if (arg == "--id") selfID = atoi(argv[++i]);
+        else if (arg == "--node") addresses.push_back(argv[++i]);
+        else if (arg == "--tree") treeFile = argv[++i];
+        else if (arg == "--dir") directory = argv[++i];
+        else if (arg == "--election-ms") electionMs = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--snapshot-every") snapshotEvery = strtoull(argv[++i], nullptr, 10);
+        else return usage(argv[0]);
+    }
+    if (selfID < 0 || selfID >= (int)addresses.size() || treeFile.empty() || directory.empty() || electionMs < 6 ||
+        snapshotEvery == 0)
+        return usage(argv[0]);
+
+    ifstream in(treeFile);
+    int numNodes, numChildren;
+    if (!(in >> numNodes >> numChildren) || numNodes <= 0 || numChildren <= 0) {
+        cerr << "expected \"numNodes numChildren\" followed by node labels in " << treeFile << "\n";
+        return 1;
+    }
+    vector<string> labels(numNodes);
+    for (int i = 0; i < numNodes; i++) in >> labels[i];
+    LockingTree tree(numNodes, numChildren, labels);
+
+    RaftStorage storage;
+    if (!storage.open(directory, tree)) {
+        perror(directory.c_str());
+        return 1;
+    }
+    RaftNode node(tree, storage, selfID, addresses, electionMs, snapshotEvery);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    int signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int listenFd = listenOn(addresses[selfID]);
+    if (listenFd < 0) {
+        perror(addresses[selfID].c_str());
+        return 1;
+    }
+    int status = serve(node, listenFd, signalFd);
+    close(listenFd);
+    if (addresses[selfID].find('/') != string::npos) unlink(addresses[selfID].c_str());
+    return status;
+}
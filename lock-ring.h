@@ -0,0 +1,263 @@
+/**
+ * @file lock-ring.h
+ * @brief Shared-memory ring transport of the lock server for co-located clients.
+ *
+ * Started with "--shm NAME", the server creates a POSIX shared-memory segment
+ * holding the node labels and a fixed number of client slots. Each slot is a
+ * single-producer/single-consumer ring pair:
+ *
+ *   submissions  BatchRecord[RING_ENTRIES], written by the client
+ *   results      uint8_t[RING_ENTRIES], written by the server; results[i] answers submissions[i]
+ *
+ * Positions are free-running uint32_t counters, each written by one side only:
+ * submitTail and completeHead by the client, submitHead and completeTail by
+ * the server. A client never has more than RING_ENTRIES requests outstanding
+ * (submitTail - completeHead), which bounds both rings at once.
+ *
+ * Nobody sleeps while there is work. The server sets 'serverIdle' just before
+ * it blocks; a client that publishes submissions and sees it set bumps the
+ * 'doorbell' futex. A client that runs out of spinning sets 'clientWaiting' and
+ * sleeps on its slot's completeTail; the server only wakes it if that flag is
+ * set. Both sides re-check after raising their flag, so no wakeup is lost.
+ *
+ * Requests run exactly as a BATCH frame would, including the write-ahead log:
+ * with --wal, completeTail only moves once the records are durable.
+ *
+ *   RingClient client;
+ *   if (!client.attach("/tree-of-space-ring")) ...
+ *   bool locked = client.lock(client.getIndex("node7"), 42);
+ *
+ * A RingClient owns one slot and must be used by one thread at a time.
+ */
+#ifndef LOCK_RING_H
+#define LOCK_RING_H
+
+#include "lock-protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char RING_MAGIC[4] = {'L', 'T', 'R', '1'};
+static const uint32_t RING_VERSION = 1;
+static const uint32_t RING_ENTRIES = 1024; // Per slot; a power of two.
+
+struct RingSlot {
+    alignas(64) uint32_t ownerPid;     // 0 while free; claimed with a compare-and-swap.
+    alignas(64) uint32_t submitTail;   // Client: records published.
+    alignas(64) uint32_t submitHead;   // Server: records run.
+    alignas(64) uint32_t completeTail; // Server: results published (futex word).
+    uint32_t clientWaiting;            // Client is, or is about to be, asleep on completeTail.
+    alignas(64) uint32_t completeHead; // Client: results consumed.
+    alignas(64) BatchRecord submissions[RING_ENTRIES];
+    uint8_t results[RING_ENTRIES];
+};
+
+struct RingSegmentHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numNodes;
+    uint32_t numSlots;
+    uint32_t serverPid;
+    uint64_t segmentSize;
+    uint64_t slotsOffset;      // RingSlot[numSlots]
+    uint64_t labelStartOffset; // uint32_t[numNodes + 1], offsets into the label bytes
+    uint64_t labelBytesOffset;
+    alignas(64) uint32_t doorbell; // Server sleeps on this futex word.
+    uint32_t serverIdle;           // Server is, or is about to be, asleep on the doorbell.
+};
+
+/**
+ * @brief Plain (not process-private) futex call, as the words live in shared memory.
+ */
+inline long ringFutex(uint32_t *word, int op, uint32_t value, const timespec *timeout = nullptr) {
+    return syscall(SYS_futex, word, op, value, timeout, nullptr, 0);
+}
+
+class RingClient {
+private:
+    static const int SPIN_LIMIT = 2000; // Polls of completeTail before going to sleep.
+
+    char *base = nullptr;
+    size_t mappedSize = 0;
+    RingSegmentHeader *header = nullptr;
+    RingSlot *slot = nullptr;
+    std::unordered_map<std::string, uint32_t> labelToID;
+
+    bool serverAlive() const { return kill((pid_t)header->serverPid, 0) == 0 || errno != ESRCH; }
+
+    void ringDoorbell() {
+        // Pairs with the server's fence between raising serverIdle and its final check.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->serverIdle, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&header->serverIdle, 0, __ATOMIC_ACQ_REL)) {
+            __atomic_fetch_add(&header->doorbell, 1, __ATOMIC_RELEASE);
+            ringFutex(&header->doorbell, FUTEX_WAKE, 1);
+        }
+    }
+
+    /**
+     * @brief Waits until completeTail moves past 'seen'.
+     * @return the new completeTail, or 'seen' if the server has gone away.
+     */
+    uint32_t waitForResults(uint32_t seen) {
+        for (int spin = 0; spin < SPIN_LIMIT; spin++) {
+            uint32_t tail = __atomic_load_n(&slot->completeTail, __ATOMIC_ACQUIRE);
+            if (tail != seen) return tail;
+            __builtin_ia32_pause();
+        }
+        while (true) {
+            __atomic_store_n(&slot->clientWaiting, 1, __ATOMIC_SEQ_CST);
+            uint32_t tail = __atomic_load_n(&slot->completeTail, __ATOMIC_SEQ_CST);
+            if (tail != seen) {
+                __atomic_store_n(&slot->clientWaiting, 0, __ATOMIC_RELAXED);
+                return tail;
+            }
+            timespec timeout = {1, 0};
+            if (ringFutex(&slot->completeTail, FUTEX_WAIT, seen, &timeout) < 0 && errno == ETIMEDOUT &&
+                !serverAlive())
+                return seen;
+        }
+    }
+
+public:
+    RingClient() = default;
+    RingClient(const RingClient&) = delete;
+    RingClient& operator=(const RingClient&) = delete;
+
+    ~RingClient() { detach(); }
+
+    /**
+     * @brief Maps the server's segment and claims a free slot.
+     * @return false if the segment is missing or invalid, or every slot is taken.
+     */
+    bool attach(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(RingSegmentHeader)) {
+            close(fd);
+            return false;
+        }
+        mappedSize = info.st_size;
+        void *mapping = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return false;
+        base = (char *)mapping;
+        header = (RingSegmentHeader *)base;
+        if (memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 || header->version != RING_VERSION ||
+            header->segmentSize != mappedSize) {
+            detach();
+            return false;
+        }
+
+        RingSlot *slots = (RingSlot *)(base + header->slotsOffset);
+        uint32_t pid = (uint32_t)getpid();
+        for (uint32_t i = 0; i < header->numSlots && !slot; i++) {
+            uint32_t free = 0;
+            if (__atomic_compare_exchange_n(&slots[i].ownerPid, &free, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                slot = &slots[i];
+        }
+        if (!slot) {
+            detach();
+            return false;
+        }
+
+        const uint32_t *labelStart = (const uint32_t *)(base + header->labelStartOffset);
+        const char *labelBytes = base + header->labelBytesOffset;
+        labelToID.reserve(header->numNodes);
+        for (uint32_t i = 0; i < header->numNodes; i++)
+            labelToID.emplace(std::string(labelBytes + labelStart[i], labelStart[i + 1] - labelStart[i]), i);
+        return true;
+    }
+
+    /**
+     * @brief Waits for outstanding requests, then gives the slot back.
+     */
+    void detach() {
+        if (slot) {
+            uint32_t tail = slot->submitTail;
+            for (uint32_t seen = __atomic_load_n(&slot->completeTail, __ATOMIC_ACQUIRE); seen != tail;) {
+                uint32_t next = waitForResults(seen);
+                if (next == seen) break;
+                seen = next;
+            }
+            __atomic_store_n(&slot->completeHead, __atomic_load_n(&slot->completeTail, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+            __atomic_store_n(&slot->ownerPid, 0, __ATOMIC_RELEASE);
+            slot = nullptr;
+        }
+        if (base) munmap(base, mappedSize);
+        base = nullptr;
+        header = nullptr;
+        labelToID.clear();
+    }
+
+    uint32_t size() const { return header ? header->numNodes : 0; }
+
+    /**
+     * @brief Node index of 'label', or NODE_UNKNOWN.
+     */
+    uint32_t getIndex(const std::string& label) const {
+        auto it = labelToID.find(label);
+        return it == labelToID.end() ? NODE_UNKNOWN : it->second;
+    }
+
+    /**
+     * @brief Runs 'count' records in order, writing each outcome to results[i].
+     * Records are copied straight into the submission ring as space frees up.
+     * @return false if the server went away before answering everything.
+     */
+    bool execute(const BatchRecord *records, size_t count, bool *results) {
+        const uint32_t mask = RING_ENTRIES - 1;
+        uint32_t tail = slot->submitTail;
+        uint32_t head = slot->completeHead;
+        uint32_t published = __atomic_load_n(&slot->completeTail, __ATOMIC_ACQUIRE);
+        size_t submitted = 0, completed = 0;
+        while (completed < count) {
+            size_t room = RING_ENTRIES - (tail - head);
+            if (submitted < count && room > 0) {
+                size_t n = std::min(room, count - submitted);
+                for (size_t i = 0; i < n; i++) slot->submissions[(tail + i) & mask] = records[submitted + i];
+                tail += n;
+                submitted += n;
+                __atomic_store_n(&slot->submitTail, tail, __ATOMIC_RELEASE);
+                ringDoorbell();
+            }
+            if (published == head) {
+                uint32_t next = waitForResults(published);
+                if (next == published) return false;
+                published = next;
+            }
+            for (; head != published; head++) results[completed++] = slot->results[head & mask] != 0;
+            __atomic_store_n(&slot->completeHead, head, __ATOMIC_RELEASE);
+            published = __atomic_load_n(&slot->completeTail, __ATOMIC_ACQUIRE);
+        }
+        return true;
+    }
+
+    bool lock(uint32_t nodeIndex, int32_t userID) { return executeOne(1, nodeIndex, userID); }
+    bool unlock(uint32_t nodeIndex, int32_t userID) { return executeOne(2, nodeIndex, userID); }
+    bool upgrade(uint32_t nodeIndex, int32_t userID) { return executeOne(3, nodeIndex, userID); }
+
+private:
+    bool executeOne(uint8_t opcode, uint32_t nodeIndex, int32_t userID) {
+        BatchRecord record = {opcode, {0, 0, 0}, nodeIndex, userID};
+        bool result = false;
+        return execute(&record, 1, &result) && result;
+    }
+};
+
+#endif // LOCK_RING_H
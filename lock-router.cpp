@@ -0,0 +1,715 @@
+#include "lock-protocol.h"
+#include "tree-partition.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+/**
+ * Router of a sharded lock cluster: clients speak the lock server's text
+ * protocol to it, and it forwards every operation to the shard that owns the
+ * node (see tree-partition.h).
+ *
+ * Usage:
+ *   lock-router [--unix PATH] [--tcp PORT] --tree FILE [--cut-depth D] --log FILE
+ *               [--resolved S]... --shard ADDRESS...
+ *
+ * The shards are lock servers started with "--shard I/N --cut-depth D" on the
+ * same tree file; the i-th --shard ADDRESS (a Unix socket path or
+ * "[host:]port") must be shard i.
+ *
+ * Below the cut, a subtree lives wholly on one shard together with a replica of
+ * every ancestor above the cut, so each of its operations runs on that shard
+ * alone. An operation on the top of the tree has to agree with every shard: a
+ * lock needs no locked descendant on any of them, an upgrade needs all of
+ * them to hold only the user's locks. The router runs those as a two-phase
+ * commit: PREPARE on all shards (each checks the operation, reserves the
+ * node's lineage and votes), then COMMIT if all voted yes, otherwise ABORT on
+ * those that voted yes.
+ *
+ * The router serialises: a client's pipelined requests are batched per shard
+ * up to the next top-of-tree operation, which first drains every batch. So
+ * each shard sees its operations in request order and nothing runs while a
+ * transaction is prepared.
+ *
+ * A shard's yes vote is binding: it keeps the transaction prepared, and the
+ * node's lineage reserved, until it hears the decision. The router writes a
+ * COMMIT decision to its --log file (see DecisionLog) before sending it, and
+ * every transaction the log does not name as committed was aborted. Whenever
+ * the router connects to a shard, at start or after losing it, it first asks
+ * which transaction the shard holds prepared and decides it from the log. So a
+ * slow or lost shard, or a restarted router, delays a decision but never
+ * splits it.
+ *
+ * A lost shard does not stop the router. Requests it would run, and every
+ * top-of-tree operation, answer "error" while it is down, and the router
+ * reconnects to it before the next run of requests. A shard that does not
+ * answer within RECEIVE_TIMEOUT_MS counts as lost. One that restarted and so
+ * forgot a committed transaction it had not yet confirmed is kept out of
+ * service, across router restarts too, until an operator has checked its
+ * replica of the top and restarted the router with --resolved S.
+ */
+
+// ----------------------------------------------------------------------
+// 1. SHARD LINKS
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Blocking binary-protocol connection to one shard. Requests are
+ * buffered and sent together by flush(), so the batches and votes of all
+ * shards are in flight at the same time.
+ */
+class ShardLink {
+private:
+    string address;
+    int fd = -1;
+    string output;
+    string input;
+    size_t inputStart = 0;
+
+    bool fill() {
+        char chunk[64 * 1024];
+        while (true) {
+            ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            input.append(chunk, received);
+            return true;
+        }
+    }
+
+public:
+    static const int RECEIVE_TIMEOUT_MS = 5000;
+
+    ~ShardLink() {
+        if (fd >= 0) close(fd);
+    }
+
+    explicit ShardLink(const string& shardAddress) : address(shardAddress) {}
+
+    const string& name() const { return address; }
+
+    bool connected() const { return fd >= 0; }
+
+    /**
+     * @brief (Re)connects and waits for the shard's HELLO; false leaves it disconnected.
+     */
+    bool connect() {
+        disconnect();
+        fd = connectSocket(address);
+        if (fd < 0) return false;
+        timeval timeout = {RECEIVE_TIMEOUT_MS / 1000, (RECEIVE_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); // A shard that stops answering is lost.
+        output.assign(PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC));
+        string payload;
+        if (flush() && readFrame(FRAME_HELLO, payload)) return true;
+        disconnect();
+        return false;
+    }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        output.clear();
+        input.clear();
+        inputStart = 0;
+    }
+
+    string& out() { return output; }
+
+    bool flush() {
+        for (size_t sent = 0; sent < output.size();) {
+            ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+        output.clear();
+        return true;
+    }
+
+    /**
+     * @brief Waits for the next frame, which must be of type 'expected'.
+     */
+    bool readFrame(uint8_t expected, string& payload) {
+        while (input.size() - inputStart < sizeof(FrameHeader) ||
+               input.size() - inputStart < sizeof(FrameHeader) + readWire<uint32_t>(input.data() + inputStart)) {
+            if (inputStart > 0) {
+                input.erase(0, inputStart);
+                inputStart = 0;
+            }
+            if (!fill()) return false;
+        }
+        const char *frame = input.data() + inputStart;
+        uint32_t length = readWire<uint32_t>(frame);
+        uint8_t type = readWire<uint8_t>(frame + offsetof(FrameHeader, type));
+        payload.assign(frame + sizeof(FrameHeader), length);
+        inputStart += sizeof(FrameHeader) + length;
+        if (type == FRAME_ERROR) cerr << "shard: " << payload << "\n";
+        return type == expected;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 2. DECISION LOG
+// ----------------------------------------------------------------------
+
+/**
+ * @brief The router's durable record of its COMMIT decisions, a text file of
+ *
+ *   commit ID S...   transaction ID committed; shards S... have yet to confirm it
+ *   done ID S        shard S confirmed it
+ *   in-doubt S       shard S lost a committed transaction it had not confirmed
+ *
+ * A commit line is synced before any COMMIT is sent (presumed abort: a
+ * transaction the log does not name was aborted). The log is replayed and
+ * compacted to what is still open when the router starts.
+ */
+class DecisionLog {
+private:
+    int fd = -1;
+
+    bool append(const string& line, bool durable) {
+        if (fd < 0) return false;
+        for (size_t written = 0; written < line.size();) {
+            ssize_t n = write(fd, line.data() + written, line.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            written += n;
+        }
+        return !durable || fdatasync(fd) == 0;
+    }
+
+public:
+    vector<uint32_t> pending; // Per shard: the committed transaction it has yet to confirm, or 0.
+    vector<bool> inDoubt;     // Per shard: kept out of service.
+
+    ~DecisionLog() {
+        if (fd >= 0) close(fd);
+    }
+
+    /**
+     * @brief Replays 'path' (missing: empty), forgets the shards an operator
+     * has resolved, and replaces the file with what is still open: write a
+     * temporary, sync it, rename it over, sync the directory.
+     */
+    bool open(const string& path, size_t numShards, const vector<size_t>& resolved) {
+        pending.assign(numShards, 0);
+        inDoubt.assign(numShards, false);
+        ifstream in(path);
+        string line, kind;
+        while (getline(in, line)) {
+            istringstream words(line);
+            uint32_t id;
+            size_t s;
+            if (!(words >> kind)) continue;
+            if (kind == "commit" && words >> id) {
+                while (words >> s) if (s < numShards) pending[s] = id;
+            } else if (kind == "done" && words >> id >> s) {
+                if (s < numShards && pending[s] == id) pending[s] = 0;
+            } else if (kind == "in-doubt" && words >> s) {
+                if (s < numShards) inDoubt[s] = true;
+            }
+        }
+        for (size_t s : resolved) {
+            if (s >= numShards) continue;
+            pending[s] = 0;
+            inDoubt[s] = false;
+        }
+
+        string contents;
+        for (size_t s = 0; s < numShards; s++) {
+            if (pending[s]) contents += "commit " + to_string(pending[s]) + " " + to_string(s) + "\n";
+            if (inDoubt[s]) contents += "in-doubt " + to_string(s) + "\n";
+        }
+        string temporary = path + ".tmp";
+        fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (!append(contents, true) || rename(temporary.c_str(), path.c_str()) < 0) return false;
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        bool synced = directoryFd >= 0 && fsync(directoryFd) == 0;
+        if (directoryFd >= 0) close(directoryFd);
+        return synced;
+    }
+
+    /**
+     * @brief Records that transaction 'id' commits on every shard; false if it
+     * is not durable, and the transaction must then be aborted.
+     */
+    bool commit(uint32_t id) {
+        string line = "commit " + to_string(id);
+        for (size_t s = 0; s < pending.size(); s++) line += " " + to_string(s);
+        if (!append(line + "\n", true)) return false;
+        for (uint32_t& shardPending : pending) shardPending = id;
+        return true;
+    }
+
+    /**
+     * @brief Shard s confirmed its pending transaction. Not synced: replayed
+     * without it, the COMMIT is only sent again, and confirmed again.
+     */
+    void done(size_t s) {
+        append("done " + to_string(pending[s]) + " " + to_string(s) + "\n", false);
+        pending[s] = 0;
+    }
+
+    void markInDoubt(size_t s) {
+        inDoubt[s] = true;
+        append("in-doubt " + to_string(s) + "\n", true);
+    }
+};
+
+// ----------------------------------------------------------------------
+// 3. ROUTING AND TWO-PHASE COMMIT
+// ----------------------------------------------------------------------
+
+class Router {
+private:
+    TreePartition partition;
+    unordered_map<string, uint32_t> labelToID;
+    vector<unique_ptr<ShardLink>> shards;
+    DecisionLog& decisions;
+    uint32_t transactionEpoch; // Upper 16 bits of every transaction id of this run.
+    uint16_t transactionCount = 0;
+
+    /**
+     * @brief A fresh transaction id. The random epoch keeps a restarted
+     * router from reusing the ids of its previous run; 0 is never used.
+     */
+    uint32_t nextTransaction() {
+        if (++transactionCount == 0) transactionCount = 1;
+        return transactionEpoch | transactionCount;
+    }
+
+    void lose(size_t s) {
+        if (!shards[s]->connected()) return;
+        cerr << "router: lost shard " << s << " (" << shards[s]->name() << ")\n";
+        shards[s]->disconnect();
+    }
+
+    /**
+     * @brief Sends COMMIT or ABORT of 'id' to shard s and waits for its vote.
+     */
+    bool decide(size_t s, uint32_t id, bool commit) {
+        string& out = shards[s]->out();
+        appendFrameHeader(out, commit ? FRAME_COMMIT : FRAME_ABORT, 4);
+        appendWire<uint32_t>(out, id);
+        string payload;
+        if (!shards[s]->flush() || !shards[s]->readFrame(FRAME_VOTE, payload)) {
+            lose(s);
+            return false;
+        }
+        return payload[4] != 0;
+    }
+
+    /**
+     * @brief Connects to shard s and settles what an earlier connection (or
+     * router) left open there: the transaction it holds prepared is committed
+     * if the log says so and aborted otherwise, and a COMMIT it has yet to
+     * confirm is sent again. A shard that no longer knows that COMMIT is put
+     * in doubt.
+     */
+    bool connectShard(size_t s) {
+        if (!shards[s]->connect()) return false;
+        string& out = shards[s]->out();
+        appendFrameHeader(out, FRAME_INQUIRE, 0);
+        string payload;
+        if (!shards[s]->flush() || !shards[s]->readFrame(FRAME_VOTE, payload)) {
+            lose(s);
+            return false;
+        }
+        uint32_t prepared = readWire<uint32_t>(payload.data());
+        uint32_t committed = decisions.pending[s];
+        if (prepared != 0 && prepared != committed) {
+            cerr << "router: aborting transaction " << prepared << " left prepared on shard " << s << "\n";
+            decide(s, prepared, false);
+        }
+        if (committed != 0 && shards[s]->connected()) {
+            if (decide(s, committed, true)) {
+                decisions.done(s);
+            } else if (shards[s]->connected()) {
+                cerr << "router: shard " << s << " no longer knows committed transaction " << committed
+                     << "; keeping it out of service\n";
+                decisions.markInDoubt(s);
+                shards[s]->disconnect();
+            }
+        }
+        return shards[s]->connected();
+    }
+
+    /**
+     * @brief Operations queued for one shard since its last flush.
+     */
+    struct Batch {
+        string records;        // LABEL_BATCH records.
+        vector<size_t> slots;  // Where each result goes in the caller's results.
+    };
+    vector<Batch> batches;
+
+    static void appendLabelRecord(string& out, int opcode, const string& label, int userID) {
+        appendWire<uint8_t>(out, (uint8_t)opcode);
+        appendWire<uint8_t>(out, 0);
+        appendWire<uint16_t>(out, (uint16_t)label.size());
+        appendWire<int32_t>(out, userID);
+        out.append(label);
+    }
+
+    /**
+     * @brief Sends every queued batch, then collects all results. The requests
+     * of a shard that is down, or is lost meanwhile, answer "error".
+     */
+    void flushBatches(vector<char>& results) {
+        for (size_t s = 0; s < shards.size(); s++) {
+            Batch& batch = batches[s];
+            if (batch.slots.empty() || !shards[s]->connected()) continue;
+            string& out = shards[s]->out();
+            appendFrameHeader(out, FRAME_LABEL_BATCH, (uint32_t)(4 + batch.records.size()));
+            appendWire<uint32_t>(out, (uint32_t)batch.slots.size());
+            out.append(batch.records);
+            if (!shards[s]->flush()) lose(s);
+        }
+        string payload;
+        for (size_t s = 0; s < shards.size(); s++) {
+            Batch& batch = batches[s];
+            if (batch.slots.empty()) continue;
+            if (shards[s]->connected() && !shards[s]->readFrame(FRAME_RESULTS, payload)) lose(s);
+            bool answered = shards[s]->connected();
+            for (size_t i = 0; i < batch.slots.size(); i++)
+                results[batch.slots[i]] = answered ? (payload[4 + (i >> 3)] >> (i & 7)) & 1 : 2;
+            batch.records.clear();
+            batch.slots.clear();
+        }
+    }
+
+    /**
+     * @brief Runs an operation on the top of the tree on every shard.
+     * @return 1 if it committed, 0 if it was aborted, -1 if it needed a shard
+     * that is down or was lost before the decision (it is then aborted).
+     */
+    int runTransaction(int opcode, const string& label, int userID) {
+        for (auto& shard : shards)
+            if (!shard->connected()) return -1;
+
+        uint32_t id = nextTransaction();
+        for (size_t s = 0; s < shards.size(); s++) {
+            string& out = shards[s]->out();
+            appendFrameHeader(out, FRAME_PREPARE, (uint32_t)(4 + 8 + label.size()));
+            appendWire<uint32_t>(out, id);
+            appendLabelRecord(out, opcode, label, userID);
+            if (!shards[s]->flush()) lose(s);
+        }
+
+        vector<bool> prepared(shards.size());
+        bool commit = true, lockedBelow = false;
+        string payload;
+        bool answered = true;
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (shards[s]->connected() && !shards[s]->readFrame(FRAME_VOTE, payload)) lose(s);
+            answered = answered && shards[s]->connected();
+            prepared[s] = shards[s]->connected() && payload[4] != 0;
+            commit = commit && prepared[s];
+            lockedBelow = lockedBelow || (prepared[s] && payload[5] != 0);
+        }
+        if (opcode == 3 && !lockedBelow) commit = false; // Nothing to upgrade anywhere.
+        if (commit && !decisions.commit(id)) {
+            cerr << "router: cannot log the decision on transaction " << id << "; aborting it\n";
+            commit = false;
+        }
+
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!prepared[s]) continue;
+            string& out = shards[s]->out();
+            appendFrameHeader(out, commit ? FRAME_COMMIT : FRAME_ABORT, 4);
+            appendWire<uint32_t>(out, id);
+            if (!shards[s]->flush()) lose(s);
+        }
+        // A shard lost here keeps the transaction prepared; connectShard() decides it again.
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!prepared[s]) continue;
+            if (!shards[s]->connected() || !shards[s]->readFrame(FRAME_VOTE, payload)) {
+                lose(s);
+                continue;
+            }
+            if (!commit) continue;
+            if (payload[4] != 0) {
+                decisions.done(s);
+                continue;
+            }
+            cerr << "router: shard " << s << " could not apply committed transaction " << id
+                 << "; keeping it out of service\n";
+            decisions.markInDoubt(s);
+            shards[s]->disconnect();
+        }
+        return commit ? 1 : answered ? 0 : -1;
+    }
+
+public:
+    Router(long numNodes, long numChildren, int cutDepth, const vector<string>& labels, int numShards, DecisionLog& log)
+        : partition(numNodes, numChildren, cutDepth, numShards), decisions(log), batches(numShards) {
+        labelToID.reserve(labels.size());
+        for (size_t i = 0; i < labels.size(); i++) labelToID[labels[i]] = (uint32_t)i;
+        uint16_t epoch = 0;
+        while (epoch == 0) {
+            if (getrandom(&epoch, sizeof(epoch), 0) != sizeof(epoch)) epoch = (uint16_t)(time(nullptr) ^ getpid());
+        }
+        transactionEpoch = (uint32_t)epoch << 16;
+    }
+
+    /**
+     * @brief Adds the next shard and connects to it, unless it is in doubt.
+     */
+    bool addShard(const string& address) {
+        shards.emplace_back(new ShardLink(address));
+        size_t s = shards.size() - 1;
+        if (decisions.inDoubt[s]) {
+            cerr << "router: shard " << s << " is in doubt; start with --resolved " << s << " once checked\n";
+            return true;
+        }
+        return connectShard(s) || decisions.inDoubt[s];
+    }
+
+    /**
+     * @brief Tries once to reconnect every lost shard that is not in doubt.
+     */
+    void reconnectShards() {
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (shards[s]->connected() || decisions.inDoubt[s]) continue;
+            if (connectShard(s)) cerr << "router: reconnected shard " << s << "\n";
+        }
+    }
+
+    /**
+     * @brief Executes a run of request lines, appending one response per line.
+     */
+    void execute(const vector<pair<const char *, const char *>>& lines, string& out) {
+        reconnectShards();
+        vector<char> results(lines.size(), 0); // 0 false, 1 true, 2 error.
+        string label;
+        for (size_t i = 0; i < lines.size(); i++) {
+            TextOperation operation;
+            if (!parseOperationLine(lines[i].first, lines[i].second, operation)) {
+                results[i] = 2;
+                continue;
+            }
+            label.assign(operation.label, operation.labelLength);
+
+            auto it = labelToID.find(label);
+            if (it == labelToID.end()) continue; // Unknown label: false, as on a single server.
+            int shard = partition.shardOf(it->second);
+            if (shard != TreePartition::TOP) {
+                appendLabelRecord(batches[shard].records, operation.opcode, label, operation.userID);
+                batches[shard].slots.push_back(i);
+                continue;
+            }
+            flushBatches(results);
+            int committed = runTransaction(operation.opcode, label, operation.userID);
+            results[i] = committed < 0 ? 2 : (char)committed;
+        }
+        flushBatches(results);
+
+        for (char result : results) out.append(result == 2 ? "error\n" : result ? "true\n" : "false\n");
+    }
+};
+
+// ----------------------------------------------------------------------
+// 4. CLIENT LOOP
+// ----------------------------------------------------------------------
+
+struct Client {
+    int fd;
+    string input;
+    string output;
+    bool peerClosed = false;
+};
+
+static int listenOn(const string& unixPath, int tcpPort) {
+    int fd;
+    if (!unixPath.empty()) {
+        sockaddr_un address = {};
+        if (unixPath.size() >= sizeof(address.sun_path)) return -1;
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, unixPath.c_str());
+        unlink(unixPath.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0) return -1;
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(tcpPort);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0) return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0 || !setNonBlocking(fd)) return -1;
+    return fd;
+}
+
+/**
+ * @brief Level-triggered epoll loop over the clients. Each readable client has
+ * all its complete lines executed as one run, so pipelined requests batch.
+ */
+static int serve(Router& router, int listenFd, int signalFd) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.fd = signalFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event);
+
+    unordered_map<int, Client> clients;
+    vector<pair<const char *, const char *>> lines;
+    epoll_event events[64];
+    while (true) {
+        int ready = epoll_wait(epollFd, events, 64, -1);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return 1;
+        for (int e = 0; e < ready; e++) {
+            int fd = events[e].data.fd;
+            if (fd == signalFd) {
+                for (auto& entry : clients) close(entry.first);
+                close(epollFd);
+                return 0;
+            }
+            if (fd == listenFd) {
+                int clientFd;
+                while ((clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    clients[clientFd].fd = clientFd;
+                    event.events = EPOLLIN;
+                    event.data.fd = clientFd;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+                }
+                continue;
+            }
+
+            Client& client = clients[fd];
+            if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                char chunk[64 * 1024];
+                ssize_t received;
+                while ((received = recv(fd, chunk, sizeof(chunk), 0)) > 0) client.input.append(chunk, received);
+                if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) client.peerClosed = true;
+
+                lines.clear();
+                size_t start = 0, newline;
+                while ((newline = client.input.find('\n', start)) != string::npos) {
+                    const char *end = client.input.data() + newline;
+                    if (end > client.input.data() + start && end[-1] == '\r') end--;
+                    lines.emplace_back(client.input.data() + start, end);
+                    start = newline + 1;
+                }
+                if (!lines.empty()) router.execute(lines, client.output);
+                client.input.erase(0, start);
+            }
+
+            while (!client.output.empty()) {
+                ssize_t sent = send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+                if (sent <= 0) break;
+                client.output.erase(0, sent);
+            }
+            bool waiting = !client.output.empty();
+            if (client.peerClosed && !waiting) {
+                close(fd);
+                clients.erase(fd);
+                continue;
+            }
+            // Keep reading while output waits: a client may send everything before it reads.
+            event.events = (client.peerClosed ? 0u : (uint32_t)EPOLLIN) | (waiting ? (uint32_t)EPOLLOUT : 0u);
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------
+// 5. MAIN EXECUTION
+// ----------------------------------------------------------------------
+
+static int usage(const char *program) {
+    cerr << "usage: " << program << " [--unix PATH] [--tcp PORT] --tree FILE [--cut-depth D] --log FILE"
+                                    " [--resolved S]... --shard ADDRESS...\n";
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    ios_base::sync_with_stdio(false);
+
+    string unixPath, treeFile, logFile;
+    int tcpPort = 0, cutDepth = 1;
+    vector<string> shardAddresses;
+    vector<size_t> resolved;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return usage(argv[0]);
+        if (arg == "--unix") unixPath = argv[++i];
+        else if (arg == "--tcp") tcpPort = atoi(argv[++i]);
+        else if (arg == "--tree") treeFile = argv[++i];
+        else if (arg == "--cut-depth") cutDepth = atoi(argv[++i]);
+        else if (arg == "--shard") shardAddresses.push_back(argv[++i]);
+        else if (arg == "--log") logFile = argv[++i];
+        else if (arg == "--resolved") resolved.push_back(strtoul(argv[++i], nullptr, 10));
+        else return usage(argv[0]);
+    }
+    if ((unixPath.empty() && tcpPort == 0) || treeFile.empty() || logFile.empty() || shardAddresses.empty() || cutDepth < 0)
+        return usage(argv[0]);
+
+    ifstream in(treeFile);
+    long numNodes, numChildren;
+    if (!(in >> numNodes >> numChildren) || numNodes <= 0 || numChildren <= 0) {
+        cerr << "expected \"numNodes numChildren\" followed by node labels in " << treeFile << "\n";
+        return 1;
+    }
+    vector<string> labels(numNodes);
+    for (long i = 0; i < numNodes; i++) in >> labels[i];
+
+    DecisionLog decisions;
+    if (!decisions.open(logFile, shardAddresses.size(), resolved)) {
+        perror(logFile.c_str());
+        return 1;
+    }
+    Router router(numNodes, numChildren, cutDepth, labels, (int)shardAddresses.size(), decisions);
+    for (const string& address : shardAddresses) {
+        if (!router.addShard(address)) {
+            perror(address.c_str());
+            return 1;
+        }
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    int signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int listenFd = listenOn(unixPath, tcpPort);
+    if (listenFd < 0) {
+        perror("listen");
+        return 1;
+    }
+    int status = serve(router, listenFd, signalFd);
+    close(listenFd);
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+    return status;
+}
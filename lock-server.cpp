@@ -0,0 +1,2579 @@
+#include "locking-tree.h"
+#include "lock-protocol.h"
+#include "lock-ring.h"
+#include "tree-partition.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+
+/**
+ * Lock service: serves lockNode/unlockNode/upgradeNode on a LockingTree over
+ * Unix-domain and localhost TCP sockets.
+ *
+ * Usage:
+ *   lock-server [--unix PATH] [--tcp PORT] [--shm NAME [--shm-slots N]] [--tree FILE] [--wal FILE]
+ *               [--follow ADDRESS] [--shard I/N [--cut-depth D]] [--io auto|uring|epoll]
+ *
+ * The tree is read from FILE (or stdin) as "numNodes numChildren" followed by
+ * the node labels, i.e. the batch input format without the query section.
+ *
+ * Two protocols are accepted on every socket, chosen by the first bytes a
+ * client sends:
+ *
+ * Text: one request per line, in the same form as a batch query,
+ *   "<opcode> <label> <userID>\n"   (1 = lock, 2 = unlock, 3 = upgrade)
+ * answered by "true\n", "false\n" or "error\n" for a malformed line.
+ * "watch <label> [subtree]" subscribes to a node or subtree and is answered by
+ * "watching <id>\n"; "unwatch <id>" by "unwatched <id>\n". Subscribers get
+ * "event <id> <label> free|locked|blocked\n" lines with the current state and
+ * then on every change (see WatchState in lock-protocol.h).
+ * "session <timeoutMs>" opens a session for this connection ("session <id>\n");
+ * locks taken afterwards belong to it and are all released if no request
+ * arrives for timeoutMs. "resume <id>" rebinds a session after a reconnect,
+ * "heartbeat" answers "alive <id>\n" and "end" releases the session's locks
+ * ("released <count>\n").
+ *
+ * Binary: the framed batch protocol described in lock-protocol.h, opened by
+ * the magic "LTB1".
+ *
+ * Clients may pipeline any number of requests; responses come back in order.
+ *
+ * With --shm, co-located clients can skip the socket altogether: the server
+ * creates the shared-memory segment NAME with N ring pairs (16 by default)
+ * and runs index records straight out of them (see lock-ring.h).
+ *
+ * With --wal every successful operation is appended to a write-ahead log that
+ * is replayed on startup. Operations are group-committed: the responses of
+ * everything run in one loop iteration are held until a single write +
+ * fdatasync covering all of them has completed.
+ *
+ * Replication: a server started with --follow ADDRESS (a Unix socket path or
+ * "[host:]port") is a read-only follower of the primary there. It streams the
+ * primary's log (which needs --wal on the primary), applies it to its own tree
+ * and its own log if it has one, and answers reads; writes get "readonly".
+ * Reads, on any server: "status <label>" ("status free|locked|blocked"),
+ * "owner <label>" ("owner <userID>" or "owner none") and "counts" ("counts
+ * <locked nodes> <log position> primary|follower"). "promote" turns a follower
+ * into a primary ("promoted <log position>"); followers can follow followers.
+ *
+ * Sharding: with --shard I/N the server holds only shard I of N (see
+ * tree-partition.h; the cut depth defaults to 1): the top of the tree above
+ * depth D plus the subtrees below it assigned to shard I. lock-router fronts
+ * the shards and runs operations on the top as two-phase transactions.
+ *
+ * I/O runs either on io_uring (multishot accept, multishot recv into a
+ * kernel-provided buffer group, linked write + fsync for the log) or on an
+ * edge-triggered epoll loop. "--io auto", the default, uses io_uring when the
+ * kernel supports it (Linux 6.0 or later).
+ */
+
+// ----------------------------------------------------------------------
+// 1. CONNECTION STATE
+// ----------------------------------------------------------------------
+
+static const size_t READ_CHUNK = 64 * 1024;
+static const size_t MAX_PENDING_OUTPUT = 1 << 20; // Stop parsing a connection's input past this.
+
+enum ConnectionMode { MODE_UNKNOWN, MODE_TEXT, MODE_BINARY, MODE_UPSTREAM }; // UPSTREAM: a follower's link to its primary.
+
+/**
+ * @brief A client's recently failed operations, each with its node's version
+ * when it failed (see LockingTree::versionOf()). A poller that resends a
+ * failing request is answered "false" from here, in one probe, until the lock
+ * state in the node's lineage changes. Direct-mapped: a new failure evicts
+ * whatever shared its entry.
+ */
+struct FailureCache {
+    static const uint32_t ENTRIES = 64;
+
+    struct Entry {
+        int32_t nodeIndex = -1; // -1: empty.
+        int32_t userID = 0;
+        int32_t opcode = 0;
+        uint64_t version = 0;
+    };
+    Entry entries[ENTRIES];
+
+    static uint32_t entryOf(int opcode, int nodeIndex, int userID) {
+        uint32_t hash = (uint32_t)nodeIndex * 0x9E3779B1u ^ (uint32_t)userID * 0x85EBCA77u ^ (uint32_t)opcode;
+        return (hash ^ (hash >> 16)) & (ENTRIES - 1);
+    }
+
+    bool stillFails(int opcode, int nodeIndex, int userID, uint64_t version) const {
+        const Entry& entry = entries[entryOf(opcode, nodeIndex, userID)];
+        return entry.nodeIndex == nodeIndex && entry.userID == userID && entry.opcode == opcode && entry.version == version;
+    }
+
+    void remember(int opcode, int nodeIndex, int userID, uint64_t version) {
+        Entry& entry = entries[entryOf(opcode, nodeIndex, userID)];
+        entry.nodeIndex = nodeIndex;
+        entry.userID = userID;
+        entry.opcode = opcode;
+        entry.version = version;
+    }
+};
+
+/**
+ * @brief Per-connection buffers. Input is parsed in place; consumed bytes are
+ * dropped once per read burst, so a pipelined batch is never copied per request.
+ * Output positions are also tracked as absolute stream offsets so responses can
+ * be held back until the log records they depend on are durable.
+ */
+struct Connection {
+    uint64_t id;
+    int fd;
+    ConnectionMode mode = MODE_UNKNOWN;
+    string input;
+    size_t inputStart = 0;     // First unparsed byte of 'input'.
+    string output;
+    size_t outputStart = 0;    // First unsent byte of 'output'.
+    uint64_t outputOrigin = 0; // Stream offset of output[0].
+    uint64_t releasedUpTo = 0; // Stream offset up to which output may be sent.
+    uint64_t commitMark = 0;   // Released once the in-flight log commit is durable.
+    bool awaitingRelease = false;
+    bool peerClosed = false;
+    bool closeAfterFlush = false; // Set after a protocol error has been reported.
+    vector<uint32_t> watchIDs;    // Watches owned by this connection.
+    uint32_t sessionID = 0;       // Session that tags this connection's locks, 0 for none.
+    FailureCache failures;
+
+    // io_uring only: the kernel reads 'sending' while 'output' keeps growing,
+    // and the connection must outlive every request that refers to it.
+    string sending;
+    bool sendInFlight = false;
+    bool recvArmed = false;
+    bool closing = false;
+    int inflight = 0;
+
+    Connection(uint64_t connectionID, int socketFd) : id(connectionID), fd(socketFd) {}
+
+    size_t pendingOutput() const { return output.size() - outputStart; }
+
+    uint64_t outputEnd() const { return outputOrigin + output.size(); }
+
+    /**
+     * @brief Unsent output that is already released.
+     */
+    size_t sendableOutput() const {
+        uint64_t sent = outputOrigin + outputStart;
+        uint64_t limit = min(releasedUpTo, outputEnd());
+        return limit > sent ? (size_t)(limit - sent) : 0;
+    }
+
+    void consumeOutput(size_t bytes) {
+        outputStart += bytes;
+        if (outputStart == output.size()) {
+            outputOrigin += output.size();
+            output.clear();
+            outputStart = 0;
+        }
+    }
+
+    bool backpressured() const { return pendingOutput() >= MAX_PENDING_OUTPUT; }
+};
+
+// ----------------------------------------------------------------------
+// 2. WRITE-AHEAD LOG
+// ----------------------------------------------------------------------
+
+static const char WAL_MAGIC[4] = {'L', 'T', 'W', '1'};
+static const size_t WAL_HEADER_SIZE = sizeof(WAL_MAGIC) + sizeof(uint32_t);
+
+/**
+ * @brief Log of successful operations: the magic "LTW1", the node count, then
+ * one BatchRecord per operation. Records are staged in memory and handed to the
+ * I/O backend one group at a time; failed operations change nothing and are
+ * not logged.
+ */
+class WriteAheadLog {
+private:
+    int fd = -1;
+    uint64_t durableSize = 0;
+    string staged;
+    string committing; // Must stay untouched while the backend writes it.
+
+public:
+    ~WriteAheadLog() {
+        if (fd >= 0) close(fd);
+    }
+
+    /**
+     * @brief Opens or creates the log and replays it into 'tree'. A torn
+     * trailing record left by a crash is truncated away.
+     */
+    bool open(const string& path, LockingTree& tree) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        string contents;
+        char chunk[READ_CHUNK];
+        ssize_t received;
+        while ((received = read(fd, chunk, sizeof(chunk))) > 0) contents.append(chunk, received);
+        if (received < 0) return false;
+
+        if (contents.size() < WAL_HEADER_SIZE) {
+            string header(WAL_MAGIC, sizeof(WAL_MAGIC));
+            appendWire<uint32_t>(header, (uint32_t)tree.size());
+            if (ftruncate(fd, 0) < 0 || pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size() ||
+                fdatasync(fd) < 0)
+                return false;
+            durableSize = header.size();
+            return true;
+        }
+        if (memcmp(contents.data(), WAL_MAGIC, sizeof(WAL_MAGIC)) != 0 ||
+            readWire<uint32_t>(contents.data() + sizeof(WAL_MAGIC)) != (uint32_t)tree.size()) {
+            errno = EINVAL; // Not a log of this tree.
+            return false;
+        }
+
+        size_t records = (contents.size() - WAL_HEADER_SIZE) / sizeof(BatchRecord);
+        const char *record = contents.data() + WAL_HEADER_SIZE;
+        for (size_t i = 0; i < records; i++, record += sizeof(BatchRecord)) {
+            int nodeIndex = (int)readWire<uint32_t>(record + offsetof(BatchRecord, nodeIndex));
+            int userID = readWire<int32_t>(record + offsetof(BatchRecord, userID));
+            switch (readWire<uint8_t>(record + offsetof(BatchRecord, opcode))) {
+                case 1: tree.lockIndex(nodeIndex, userID); break;
+                case 2: tree.unlockIndex(nodeIndex, userID); break;
+                case 3: tree.upgradeIndex(nodeIndex, userID); break;
+            }
+        }
+        durableSize = WAL_HEADER_SIZE + records * sizeof(BatchRecord);
+        return durableSize == contents.size() || ftruncate(fd, durableSize) == 0;
+    }
+
+    int descriptor() const { return fd; }
+    uint64_t size() const { return durableSize; }
+
+    /**
+     * @brief Number of durable records.
+     */
+    uint64_t records() const { return (durableSize - WAL_HEADER_SIZE) / sizeof(BatchRecord); }
+
+    /**
+     * @brief Appends durable records [first, end) to 'out'.
+     */
+    bool readRecords(uint64_t first, uint64_t end, string& out) const {
+        size_t start = out.size();
+        size_t bytes = (end - first) * sizeof(BatchRecord);
+        out.resize(start + bytes);
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = pread(fd, &out[start + done], bytes - done, WAL_HEADER_SIZE + first * sizeof(BatchRecord) + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                out.resize(start);
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    /**
+     * @brief The records of the in-flight commit.
+     */
+    const string& inCommit() const { return committing; }
+
+    void append(int opcode, int nodeIndex, int userID) {
+        BatchRecord record = {(uint8_t)opcode, {0, 0, 0}, (uint32_t)nodeIndex, userID};
+        staged.append((const char *)&record, sizeof(record));
+    }
+
+    bool hasStaged() const { return !staged.empty(); }
+    bool isCommitting() const { return !committing.empty(); }
+
+    /**
+     * @brief Seals the staged records into the next group commit.
+     */
+    const string& beginCommit() {
+        committing.swap(staged);
+        staged.clear();
+        return committing;
+    }
+
+    void commitDone() {
+        durableSize += committing.size();
+        committing.clear();
+    }
+};
+
+// ----------------------------------------------------------------------
+// 3. WATCHES
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Subscriptions to the state of a node or a subtree (see WatchState in
+ * lock-protocol.h).
+ *
+ * An operation on node X can only change the state of X, of its ancestors
+ * and of nodes below it. notify() therefore walks X's root path, the same
+ * walk the engine does to maintain descendantLockedCount, and then descends
+ * from X only into subtrees that contain watches, guided by a per-node count
+ * of watches below it. Nothing else is scanned.
+ */
+class WatchIndex {
+public:
+    struct Watch {
+        uint64_t connectionID = 0;
+        int nodeIndex = -1; // -1 for a free slot.
+        bool subtree = false;
+        uint8_t lastState = 0; // Last state reported to the client.
+    };
+
+    /**
+     * @brief A state change to report; collected during an operation and
+     * delivered once the response being built is complete.
+     */
+    struct Event {
+        uint64_t connectionID;
+        uint32_t watchID;
+        int nodeIndex;
+        uint8_t state;
+    };
+
+private:
+    const LockingTree& tree;
+    vector<Watch> watches;
+    vector<uint32_t> freeIDs;
+    vector<vector<uint32_t>> watchesAt; // Watch ids registered on each node.
+    vector<int> watchesBelow;           // Watches registered strictly below each node.
+    size_t activeWatches = 0;
+    vector<int> descent;                // Scratch stack for notify().
+
+    void visit(int nodeIndex, vector<Event>& events) {
+        for (uint32_t id : watchesAt[nodeIndex]) {
+            Watch& watch = watches[id];
+            uint8_t state = stateOf(watch);
+            if (state == watch.lastState) continue;
+            watch.lastState = state;
+            events.push_back(Event{watch.connectionID, id, nodeIndex, state});
+        }
+    }
+
+    void adjustAncestors(int nodeIndex, int delta) {
+        for (int current = tree.parentOf(nodeIndex); current != -1; current = tree.parentOf(current))
+            watchesBelow[current] += delta;
+    }
+
+public:
+    explicit WatchIndex(const LockingTree& lockingTree)
+        : tree(lockingTree), watchesAt(lockingTree.size()), watchesBelow(lockingTree.size(), 0) {}
+
+    uint8_t stateOf(const Watch& watch) const {
+        int node = watch.nodeIndex;
+        if (tree.isLocked(node)) return WATCH_LOCKED;
+        if (watch.subtree) {
+            if (tree.hasLockedDescendant(node)) return WATCH_LOCKED;
+            return tree.hasLockedAncestor(node) ? WATCH_BLOCKED : WATCH_FREE;
+        }
+        return tree.hasLockedAncestor(node) || tree.hasLockedDescendant(node) ? WATCH_BLOCKED : WATCH_FREE;
+    }
+
+    const Watch *find(uint32_t id) const {
+        return id < watches.size() && watches[id].nodeIndex >= 0 ? &watches[id] : nullptr;
+    }
+
+    /**
+     * @brief Registers a watch and records its current state as already reported.
+     */
+    uint32_t add(uint64_t connectionID, int nodeIndex, bool subtree) {
+        uint32_t id;
+        if (freeIDs.empty()) {
+            id = (uint32_t)watches.size();
+            watches.emplace_back();
+        } else {
+            id = freeIDs.back();
+            freeIDs.pop_back();
+        }
+        Watch& watch = watches[id];
+        watch.connectionID = connectionID;
+        watch.nodeIndex = nodeIndex;
+        watch.subtree = subtree;
+        watch.lastState = stateOf(watch);
+
+        watchesAt[nodeIndex].push_back(id);
+        adjustAncestors(nodeIndex, 1);
+        activeWatches++;
+        return id;
+    }
+
+    void remove(uint32_t id) {
+        Watch& watch = watches[id];
+        vector<uint32_t>& atNode = watchesAt[watch.nodeIndex];
+        atNode.erase(find_if(atNode.begin(), atNode.end(), [id](uint32_t other) { return other == id; }));
+        adjustAncestors(watch.nodeIndex, -1);
+        watch.nodeIndex = -1;
+        freeIDs.push_back(id);
+        activeWatches--;
+    }
+
+    /**
+     * @brief Collects the state changes caused by a successful operation on nodeIndex.
+     */
+    void notify(int nodeIndex, vector<Event>& events) {
+        if (activeWatches == 0) return;
+        for (int current = nodeIndex; current != -1; current = tree.parentOf(current)) visit(current, events);
+
+        descent.clear();
+        if (watchesBelow[nodeIndex] > 0) descent.push_back(nodeIndex);
+        while (!descent.empty()) {
+            int current = descent.back();
+            descent.pop_back();
+            tree.forEachChild(current, [&](int child) {
+                if (!watchesAt[child].empty()) visit(child, events);
+                if (watchesBelow[child] > 0) descent.push_back(child);
+            });
+        }
+    }
+};
+
+// ----------------------------------------------------------------------
+// 4. SESSIONS
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Client sessions. Every lock taken through a session is tagged with
+ * it; a session that misses its heartbeat deadline has all its locks released.
+ *
+ * A session lists the locks it holds and each node remembers its slot in that
+ * list, so tagging and untagging are O(1) and releasing a session costs time
+ * proportional to the locks it holds. Deadlines sit in a min-heap with one
+ * entry per session: a heartbeat only moves the session's deadline, and an
+ * entry popped for a session that has heartbeated since is pushed back.
+ *
+ * Sessions live in memory only; locks replayed from the write-ahead log after
+ * a restart are untagged.
+ */
+class SessionTable {
+public:
+    struct HeldLock {
+        int nodeIndex;
+        int userID;
+    };
+
+    struct Session {
+        uint32_t id;
+        uint32_t timeoutMs;
+        uint64_t deadline;         // Monotonic clock, in milliseconds.
+        uint64_t connectionID = 0; // Bound connection, 0 for none.
+        vector<HeldLock> held;
+    };
+
+private:
+    unordered_map<uint32_t, Session> sessions;
+    uint32_t nextSessionID = 1;
+    vector<uint32_t> nodeSession; // Session tagging each node's lock, 0 for none.
+    vector<uint32_t> nodeSlot;    // Position of the node in its session's 'held'.
+    priority_queue<pair<uint64_t, uint32_t>, vector<pair<uint64_t, uint32_t>>, greater<pair<uint64_t, uint32_t>>> deadlines;
+
+public:
+    explicit SessionTable(int numNodes) : nodeSession(numNodes, 0), nodeSlot(numNodes, 0) {}
+
+    static uint64_t nowMs() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    Session& open(uint32_t timeoutMs) {
+        uint32_t id = nextSessionID++;
+        Session& session = sessions[id];
+        session.id = id;
+        session.timeoutMs = timeoutMs;
+        session.deadline = nowMs() + timeoutMs;
+        deadlines.emplace(session.deadline, id);
+        return session;
+    }
+
+    Session *find(uint32_t id) {
+        auto it = sessions.find(id);
+        return it == sessions.end() ? nullptr : &it->second;
+    }
+
+    void heartbeat(Session& session) { session.deadline = nowMs() + session.timeoutMs; }
+
+    void tag(Session& session, int nodeIndex, int userID) {
+        nodeSession[nodeIndex] = session.id;
+        nodeSlot[nodeIndex] = (uint32_t)session.held.size();
+        session.held.push_back(HeldLock{nodeIndex, userID});
+    }
+
+    /**
+     * @brief Forgets the session tag of a node that has been unlocked.
+     */
+    void untag(int nodeIndex) {
+        uint32_t id = nodeSession[nodeIndex];
+        if (id == 0) return;
+        nodeSession[nodeIndex] = 0;
+        vector<HeldLock>& held = find(id)->held;
+        uint32_t slot = nodeSlot[nodeIndex];
+        held[slot] = held.back();
+        nodeSlot[held[slot].nodeIndex] = slot;
+        held.pop_back();
+    }
+
+    /**
+     * @brief Removes a session and returns the locks it still held, untagged.
+     */
+    vector<HeldLock> close(uint32_t id) {
+        vector<HeldLock> held;
+        held.swap(find(id)->held);
+        for (const HeldLock& lock : held) nodeSession[lock.nodeIndex] = 0;
+        sessions.erase(id);
+        return held;
+    }
+
+    /**
+     * @brief Returns the id of a session whose deadline has passed, or 0.
+     */
+    uint32_t nextExpired(uint64_t now) {
+        while (!deadlines.empty() && deadlines.top().first <= now) {
+            uint32_t id = deadlines.top().second;
+            deadlines.pop();
+            Session *session = find(id);
+            if (!session) continue; // Already closed.
+            if (session->deadline > now) {
+                deadlines.emplace(session->deadline, id);
+                continue;
+            }
+            return id;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Earliest deadline that may need attention, or 0 if there is none.
+     */
+    uint64_t nextDeadline() const { return deadlines.empty() ? 0 : deadlines.top().first; }
+};
+
+// ----------------------------------------------------------------------
+// 5. SHARED-MEMORY RINGS (see lock-ring.h)
+// ----------------------------------------------------------------------
+
+/**
+ * @brief The server side of the ring transport: owns the segment and a waker
+ * thread. The event loop cannot block on a futex, so the waker sleeps on the
+ * doorbell on its behalf and turns each ring into an eventfd event. It also
+ * fires once a second so slots of clients that died can be reclaimed.
+ */
+class RingTransport {
+private:
+    static const uint64_t RECLAIM_INTERVAL_MS = 1000;
+
+    string name;
+    char *base = nullptr;
+    size_t mappedSize = 0;
+    RingSegmentHeader *header = nullptr;
+    RingSlot *slots = nullptr;
+    int wakeFd = -1;
+    pthread_t waker;
+    bool wakerRunning = false;
+    volatile bool stopping = false;
+    uint64_t lastReclaim = 0;
+
+    static void *wakerLoop(void *arg) {
+        RingTransport *rings = (RingTransport *)arg;
+        uint32_t seen = __atomic_load_n(&rings->header->doorbell, __ATOMIC_ACQUIRE);
+        while (!rings->stopping) {
+            timespec timeout = {(time_t)(RECLAIM_INTERVAL_MS / 1000), 0};
+            bool timedOut = ringFutex(&rings->header->doorbell, FUTEX_WAIT, seen, &timeout) < 0 && errno == ETIMEDOUT;
+            uint32_t now = __atomic_load_n(&rings->header->doorbell, __ATOMIC_ACQUIRE);
+            if (now == seen && !timedOut) continue; // Spurious.
+            seen = now;
+            uint64_t one = 1;
+            if (write(rings->wakeFd, &one, sizeof(one)) < 0) {} // Already readable is just as good.
+        }
+        return nullptr;
+    }
+
+public:
+    ~RingTransport() {
+        if (wakerRunning) {
+            stopping = true;
+            __atomic_fetch_add(&header->doorbell, 1, __ATOMIC_RELEASE);
+            ringFutex(&header->doorbell, FUTEX_WAKE, 1);
+            pthread_join(waker, nullptr);
+        }
+        if (wakeFd >= 0) close(wakeFd);
+        if (base) {
+            munmap(base, mappedSize);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    /**
+     * @brief Creates the segment 'segmentName' (replacing a stale one) with
+     * 'numSlots' client slots and the labels of 'tree', and starts the waker.
+     */
+    bool create(const string& segmentName, const LockingTree& tree, uint32_t numSlots) {
+        name = segmentName;
+        uint32_t numNodes = tree.size();
+        uint64_t labelBytes = 0;
+        for (uint32_t i = 0; i < numNodes; i++) labelBytes += tree.labelOf(i).size();
+
+        auto alignUp = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+        uint64_t slotsOffset = alignUp(sizeof(RingSegmentHeader));
+        uint64_t labelStartOffset = slotsOffset + (uint64_t)numSlots * sizeof(RingSlot);
+        uint64_t labelBytesOffset = labelStartOffset + (numNodes + 1) * sizeof(uint32_t);
+        mappedSize = alignUp(labelBytesOffset + labelBytes);
+
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) return false;
+        if (ftruncate(fd, mappedSize) < 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+        void *mapping = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return false;
+        }
+        base = (char *)mapping;
+        header = (RingSegmentHeader *)base;
+        slots = (RingSlot *)(base + slotsOffset);
+
+        header->version = RING_VERSION;
+        header->numNodes = numNodes;
+        header->numSlots = numSlots;
+        header->serverPid = (uint32_t)getpid();
+        header->segmentSize = mappedSize;
+        header->slotsOffset = slotsOffset;
+        header->labelStartOffset = labelStartOffset;
+        header->labelBytesOffset = labelBytesOffset;
+        uint32_t *labelStart = (uint32_t *)(base + labelStartOffset);
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < numNodes; i++) {
+            const string& label = tree.labelOf(i);
+            labelStart[i] = offset;
+            memcpy(base + labelBytesOffset + offset, label.data(), label.size());
+            offset += label.size();
+        }
+        labelStart[numNodes] = offset;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC)); // Last: clients check it.
+
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd < 0) return false;
+        wakerRunning = pthread_create(&waker, nullptr, wakerLoop, this) == 0;
+        return wakerRunning;
+    }
+
+    /**
+     * @brief Descriptor that becomes readable when a client rang the doorbell.
+     */
+    int wakeDescriptor() const { return wakeFd; }
+
+    uint32_t numSlots() const { return header->numSlots; }
+
+    RingSlot& slot(uint32_t index) { return slots[index]; }
+
+    /**
+     * @brief Drains the wake descriptor; every RECLAIM_INTERVAL_MS also frees
+     * the slots of dead clients that have nothing left in flight.
+     */
+    void woken() {
+        uint64_t count;
+        while (read(wakeFd, &count, sizeof(count)) > 0) {}
+
+        uint64_t now = SessionTable::nowMs();
+        if (now - lastReclaim < RECLAIM_INTERVAL_MS) return;
+        lastReclaim = now;
+        for (uint32_t i = 0; i < header->numSlots; i++) {
+            RingSlot& ring = slots[i];
+            uint32_t owner = __atomic_load_n(&ring.ownerPid, __ATOMIC_ACQUIRE);
+            if (owner == 0 || kill((pid_t)owner, 0) == 0 || errno != ESRCH) continue;
+            uint32_t head = ring.submitHead;
+            if (__atomic_load_n(&ring.submitTail, __ATOMIC_ACQUIRE) != head || ring.completeTail != head) continue;
+            ring.completeHead = head;
+            ring.clientWaiting = 0;
+            __atomic_store_n(&ring.ownerPid, 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    /**
+     * @brief Called right before the event loop blocks. Raises serverIdle, then
+     * looks at the rings once more.
+     * @return false if a submission arrived meanwhile, so the loop must not block.
+     */
+    bool prepareToSleep() {
+        __atomic_store_n(&header->serverIdle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (uint32_t i = 0; i < header->numSlots; i++) {
+            if (__atomic_load_n(&slots[i].submitTail, __ATOMIC_ACQUIRE) != slots[i].submitHead) {
+                __atomic_store_n(&header->serverIdle, 0, __ATOMIC_RELAXED);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void awake() { __atomic_store_n(&header->serverIdle, 0, __ATOMIC_RELAXED); }
+
+    /**
+     * @brief Makes results up to 'upTo' visible, waking the client if it sleeps.
+     */
+    void publish(RingSlot& ring, uint32_t upTo) {
+        if (ring.completeTail == upTo) return;
+        __atomic_store_n(&ring.completeTail, upTo, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.clientWaiting, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&ring.clientWaiting, 0, __ATOMIC_RELAXED);
+            ringFutex(&ring.completeTail, FUTEX_WAKE, 1);
+        }
+    }
+};
+
+// ----------------------------------------------------------------------
+// 6. LOCK SERVICE (protocols and group commit, shared by both backends)
+// ----------------------------------------------------------------------
+
+class LockService {
+private:
+    LockingTree& tree;
+    WriteAheadLog *wal;
+    unordered_map<uint64_t, unique_ptr<Connection>> connections;
+    uint64_t nextConnectionID = 1;
+    string labelScratch; // Reused for every request so parsing does not allocate.
+
+    vector<uint64_t> unreleased;     // Connections with output not yet assigned to a commit.
+    vector<uint64_t> awaitingCommit; // Connections whose commitMark waits on the in-flight commit.
+    vector<uint64_t> released;       // Connections with newly sendable output.
+
+    WatchIndex watchIndex;
+    vector<WatchIndex::Event> events; // Delivered after the current burst of requests.
+
+    SessionTable sessions;
+    int sessionTimerFd;
+    uint64_t armedDeadline = 0;
+    vector<int> upgradeScratch;
+
+    // Ring slots go through the same release steps as connections, keyed by slot.
+    RingTransport *rings;
+    vector<uint32_t> ringsUnreleased;
+    vector<uint32_t> ringsAwaitingCommit;
+    vector<uint32_t> ringCommitMark;
+    vector<bool> ringAwaitingRelease;
+    vector<FailureCache> ringFailures;
+
+    // Replication: the log position is the number of operations that succeeded.
+    uint64_t logPosition;
+    vector<uint64_t> followers; // Connections that sent FOLLOW.
+    uint64_t upstreamID = 0;    // Follower only: connection to the primary.
+    bool readOnly = false;      // A follower until promoted.
+
+    /**
+     * @brief Shard mode: the operation of the prepared two-phase transaction.
+     * PREPARE only checks it; COMMIT applies it. Until then its node, ancestors
+     * and descendants are reserved, so nothing can change the outcome it voted on.
+     * A yes vote is binding: the transaction stays prepared, whatever happens
+     * to the router's connection, until the router (or its successor) decides it.
+     */
+    struct PreparedTransaction {
+        uint32_t id = 0; // 0: none prepared.
+        int opcode;      // As run here: an upgrade with no locked descendants on this shard is a lock.
+        int nodeIndex;
+        int userID;
+        vector<SessionTable::HeldLock> deferredUnlocks; // Expired session locks in the reserved lineage.
+    } prepared;
+    uint32_t lastCommitted = 0; // So that a repeated COMMIT, whose confirmation was lost, is confirmed again.
+
+    /**
+     * @brief Whether nodeIndex is the prepared node or one of its ancestors or descendants.
+     */
+    bool reservedByPrepared(int nodeIndex) const {
+        if (prepared.id == 0 || !tree.validIndex(nodeIndex)) return false;
+        for (int node = prepared.nodeIndex; node != -1; node = tree.parentOf(node))
+            if (node == nodeIndex) return true;
+        for (int node = tree.parentOf(nodeIndex); node != -1; node = tree.parentOf(node))
+            if (node == prepared.nodeIndex) return true;
+        return false;
+    }
+
+    /**
+     * @brief Ends the decided transaction and runs the session unlocks that
+     * waited for it.
+     */
+    void endPrepared() {
+        prepared.id = 0;
+        vector<SessionTable::HeldLock> deferred;
+        deferred.swap(prepared.deferredUnlocks);
+        for (const SessionTable::HeldLock& lock : deferred) executeRecord(2, lock.nodeIndex, lock.userID, nullptr);
+    }
+
+    /**
+     * @brief Runs one operation and, if it succeeds, logs it, keeps session
+     * tags in step and collects watch events. A client's request that failed
+     * before, with nothing changed in its node's lineage since, is answered
+     * from its FailureCache without running.
+     */
+    bool executeRecord(int opcode, int nodeIndex, int userID, SessionTable::Session *session,
+                       FailureCache *failures = nullptr) {
+        // Refused without caching: the reservation ends without touching any version.
+        if (prepared.id != 0 && reservedByPrepared(nodeIndex)) return false;
+        bool cacheable = failures && tree.validIndex(nodeIndex);
+        if (cacheable && failures->stillFails(opcode, nodeIndex, userID, tree.versionOf(nodeIndex))) return false;
+        bool result = false;
+        switch (opcode) {
+            case 1: result = tree.lockIndex(nodeIndex, userID); break;
+            case 2: result = tree.unlockIndex(nodeIndex, userID); break;
+            case 3: result = tree.upgradeIndex(nodeIndex, userID, &upgradeScratch); break;
+        }
+        if (!result) {
+            if (cacheable) failures->remember(opcode, nodeIndex, userID, tree.versionOf(nodeIndex));
+            return false;
+        }
+        logPosition++;
+        if (wal) wal->append(opcode, nodeIndex, userID);
+
+        if (opcode == 2) sessions.untag(nodeIndex);
+        if (opcode == 3)
+            for (int unlockedIndex : upgradeScratch) sessions.untag(unlockedIndex);
+        if (opcode != 2 && session) sessions.tag(*session, nodeIndex, userID);
+
+        watchIndex.notify(nodeIndex, events);
+        return true;
+    }
+
+    SessionTable::Session *sessionOf(const Connection& connection) {
+        return connection.sessionID ? sessions.find(connection.sessionID) : nullptr;
+    }
+
+    void bindSession(Connection& connection, SessionTable::Session& session) {
+        if (Connection *previous = session.connectionID ? find(session.connectionID) : nullptr)
+            previous->sessionID = 0;
+        connection.sessionID = session.id;
+        session.connectionID = connection.id;
+    }
+
+    /**
+     * @brief Ends a session, unlocking everything it holds.
+     * @return the number of locks released.
+     */
+    size_t releaseSession(uint32_t id) {
+        SessionTable::Session *session = sessions.find(id);
+        if (Connection *connection = session->connectionID ? find(session->connectionID) : nullptr)
+            connection->sessionID = 0;
+        vector<SessionTable::HeldLock> held = sessions.close(id);
+        for (const SessionTable::HeldLock& lock : held) {
+            if (reservedByPrepared(lock.nodeIndex)) prepared.deferredUnlocks.push_back(lock);
+            else executeRecord(2, lock.nodeIndex, lock.userID, nullptr);
+        }
+        return held.size();
+    }
+
+    /**
+     * @brief Queues output for release (see endOfIteration()).
+     */
+    void noteOutput(Connection& connection) {
+        if (connection.awaitingRelease) return;
+        connection.awaitingRelease = true;
+        unreleased.push_back(connection.id);
+    }
+
+    void appendEvent(Connection& connection, uint32_t watchID, int nodeIndex, uint8_t state) {
+        if (connection.mode == MODE_BINARY) {
+            appendFrameHeader(connection.output, FRAME_EVENT, 12);
+            appendWire<uint32_t>(connection.output, watchID);
+            appendWire<uint32_t>(connection.output, (uint32_t)nodeIndex);
+            appendWire<uint32_t>(connection.output, state);
+        } else {
+            connection.output.append("event ").append(to_string(watchID)).append(" ");
+            connection.output.append(tree.labelOf(nodeIndex)).append(" ").append(watchStateNames[state]).append("\n");
+        }
+    }
+
+    void deliverEvents() {
+        for (const WatchIndex::Event& event : events) {
+            Connection *connection = find(event.connectionID);
+            if (!connection || connection->closeAfterFlush) continue;
+            appendEvent(*connection, event.watchID, event.nodeIndex, event.state);
+            noteOutput(*connection);
+        }
+        events.clear();
+    }
+
+    /**
+     * @brief Subscribes 'connection' to nodeIndex and queues the current state
+     * as its first event.
+     * @return the watch id, or NODE_UNKNOWN for an unknown node.
+     */
+    uint32_t addWatch(Connection& connection, int nodeIndex, bool subtree) {
+        if (!tree.validIndex(nodeIndex)) return NODE_UNKNOWN;
+        uint32_t id = watchIndex.add(connection.id, nodeIndex, subtree);
+        connection.watchIDs.push_back(id);
+        events.push_back(WatchIndex::Event{connection.id, id, nodeIndex, watchIndex.find(id)->lastState});
+        return id;
+    }
+
+    /**
+     * @return false if 'id' is not one of this connection's watches.
+     */
+    bool removeWatch(Connection& connection, uint32_t id) {
+        auto it = std::find(connection.watchIDs.begin(), connection.watchIDs.end(), id);
+        if (it == connection.watchIDs.end()) return false;
+        connection.watchIDs.erase(it);
+        watchIndex.remove(id);
+        return true;
+    }
+
+    /**
+     * @brief Text commands other than operations:
+     *   watch <label> [subtree]   unwatch <id>
+     *   session <timeoutMs>       resume <id>       heartbeat       end
+     * session opens a session and binds it to this connection; resume binds an
+     * existing one (after a reconnect); end releases the bound session's locks.
+     */
+    void handleCommandLine(Connection& connection, const char *line, const char *end) {
+        vector<string> words;
+        for (const char *cursor = line; cursor < end;) {
+            while (cursor < end && *cursor == ' ') cursor++;
+            const char *wordBegin = cursor;
+            while (cursor < end && *cursor != ' ') cursor++;
+            if (cursor > wordBegin) words.emplace_back(wordBegin, cursor);
+        }
+        const string& command = words[0];
+        int nodeIndex = words.size() == 2 ? tree.getIndex(words[1]) : -1;
+        char *parsedEnd = nullptr;
+        unsigned long number = words.size() == 2 ? strtoul(words[1].c_str(), &parsedEnd, 10) : 0;
+        bool numeric = parsedEnd && parsedEnd != words[1].c_str() && *parsedEnd == '\0';
+        string& out = connection.output;
+
+        if (command == "watch" && (words.size() == 2 || (words.size() == 3 && words[2] == "subtree"))) {
+            uint32_t id = addWatch(connection, tree.getIndex(words[1]), words.size() == 3);
+            if (id != NODE_UNKNOWN) {
+                out.append("watching ").append(to_string(id)).append("\n");
+                return;
+            }
+        } else if (command == "unwatch" && numeric && removeWatch(connection, (uint32_t)number)) {
+            out.append("unwatched ").append(words[1]).append("\n");
+            return;
+        } else if ((command == "session" || command == "resume") && readOnly) {
+            out.append("readonly\n");
+            return;
+        } else if (command == "session" && numeric && number > 0 && number <= UINT32_MAX) {
+            SessionTable::Session& session = sessions.open((uint32_t)number);
+            bindSession(connection, session);
+            out.append("session ").append(to_string(session.id)).append("\n");
+            return;
+        } else if (command == "resume" && numeric && sessions.find((uint32_t)number)) {
+            SessionTable::Session& session = *sessions.find((uint32_t)number);
+            bindSession(connection, session);
+            out.append("session ").append(to_string(session.id)).append("\n");
+            return;
+        } else if (command == "heartbeat" && words.size() == 1 && connection.sessionID) {
+            out.append("alive ").append(to_string(connection.sessionID)).append("\n");
+            return;
+        } else if (command == "end" && words.size() == 1 && connection.sessionID) {
+            out.append("released ").append(to_string(releaseSession(connection.sessionID))).append("\n");
+            return;
+        } else if (command == "status" && nodeIndex >= 0) {
+            uint8_t state = tree.isLocked(nodeIndex) ? WATCH_LOCKED
+                            : tree.hasLockedAncestor(nodeIndex) || tree.hasLockedDescendant(nodeIndex) ? WATCH_BLOCKED
+                            : WATCH_FREE;
+            out.append("status ").append(watchStateNames[state]).append("\n");
+            return;
+        } else if (command == "owner" && nodeIndex >= 0) {
+            out.append("owner ").append(tree.isLocked(nodeIndex) ? to_string(tree.ownerOf(nodeIndex)) : "none").append("\n");
+            return;
+        } else if (command == "counts" && words.size() == 1) {
+            int locked = tree.lockCount();
+            out.append("counts ").append(to_string(locked)).append(" ").append(to_string(logPosition));
+            out.append(readOnly ? " follower\n" : " primary\n");
+            return;
+        } else if (command == "promote" && words.size() == 1 && readOnly) {
+            promote();
+            out.append("promoted ").append(to_string(logPosition)).append("\n");
+            return;
+        }
+        out.append("error\n");
+    }
+
+    /**
+     * @brief Executes one request line and appends its response.
+     */
+    void handleLine(Connection& connection, const char *line, const char *end) {
+        const char *cursor = line;
+        while (cursor < end && *cursor == ' ') cursor++;
+        if (cursor < end && isalpha((unsigned char)*cursor)) return handleCommandLine(connection, cursor, end);
+        TextOperation operation;
+        if (!parseOperationLine(cursor, end, operation)) {
+            connection.output.append("error\n");
+            return;
+        }
+        if (readOnly) {
+            connection.output.append("readonly\n");
+            return;
+        }
+
+        labelScratch.assign(operation.label, operation.labelLength);
+        bool result = executeRecord(operation.opcode, tree.getIndex(labelScratch), operation.userID, sessionOf(connection),
+                                    &connection.failures);
+        connection.output.append(result ? "true\n" : "false\n");
+    }
+
+    /**
+     * @brief Executes every complete request line, pausing when the client is
+     * not reading its responses.
+     */
+    void processTextInput(Connection& connection) {
+        string& input = connection.input;
+        while (!connection.backpressured()) {
+            size_t newline = input.find('\n', connection.inputStart);
+            if (newline == string::npos) break;
+
+            size_t lineEnd = newline;
+            if (lineEnd > connection.inputStart && input[lineEnd - 1] == '\r') lineEnd--;
+            if (lineEnd > connection.inputStart)
+                handleLine(connection, input.data() + connection.inputStart, input.data() + lineEnd);
+            connection.inputStart = newline + 1;
+        }
+    }
+
+    /**
+     * @brief Replaces any partial response with an ERROR frame and closes once it is sent.
+     */
+    void protocolError(Connection& connection, size_t responseStart, const char *message) {
+        connection.output.resize(responseStart);
+        appendFrameHeader(connection.output, FRAME_ERROR, strlen(message));
+        connection.output.append(message);
+        connection.closeAfterFlush = true;
+    }
+
+    /**
+     * @brief RESOLVE: maps labels to node indices.
+     */
+    void handleResolve(Connection& connection, const char *payload, uint32_t length) {
+        size_t responseStart = connection.output.size();
+        if (length < 4) return protocolError(connection, responseStart, "short RESOLVE frame");
+        uint32_t count = readWire<uint32_t>(payload);
+
+        appendFrameHeader(connection.output, FRAME_RESOLVED, 4 + 4ull * count);
+        appendWire<uint32_t>(connection.output, count);
+
+        size_t offset = 4;
+        for (uint32_t i = 0; i < count; i++) {
+            if (offset + 2 > length) return protocolError(connection, responseStart, "truncated RESOLVE frame");
+            uint16_t labelLength = readWire<uint16_t>(payload + offset);
+            offset += 2;
+            if (offset + labelLength > length) return protocolError(connection, responseStart, "truncated RESOLVE frame");
+
+            labelScratch.assign(payload + offset, labelLength);
+            offset += labelLength;
+            int nodeIndex = tree.getIndex(labelScratch);
+            appendWire<uint32_t>(connection.output, nodeIndex < 0 ? NODE_UNKNOWN : (uint32_t)nodeIndex);
+        }
+    }
+
+    /**
+     * @brief Appends a RESULTS frame for 'count' records and returns the offset of its bit vector.
+     */
+    size_t appendResults(Connection& connection, uint32_t count) {
+        uint32_t bitBytes = (count + 7) / 8;
+        appendFrameHeader(connection.output, FRAME_RESULTS, 4 + bitBytes);
+        appendWire<uint32_t>(connection.output, count);
+        size_t bitsStart = connection.output.size();
+        connection.output.resize(bitsStart + bitBytes, '\0');
+        return bitsStart;
+    }
+
+    /**
+     * @brief BATCH: executes fixed-size records read straight from the receive buffer.
+     */
+    void handleBatch(Connection& connection, const char *payload, uint32_t length) {
+        size_t responseStart = connection.output.size();
+        if (length < 4) return protocolError(connection, responseStart, "short BATCH frame");
+        uint32_t count = readWire<uint32_t>(payload);
+        if (length != 4 + (uint64_t)count * sizeof(BatchRecord))
+            return protocolError(connection, responseStart, "BATCH length does not match record count");
+
+        unsigned char *bits = (unsigned char *)&connection.output[appendResults(connection, count)];
+        SessionTable::Session *session = sessionOf(connection);
+        const char *record = payload + 4;
+        for (uint32_t i = 0; i < count; i++, record += sizeof(BatchRecord)) {
+            uint8_t opcode = readWire<uint8_t>(record + offsetof(BatchRecord, opcode));
+            uint32_t nodeIndex = readWire<uint32_t>(record + offsetof(BatchRecord, nodeIndex));
+            int32_t userID = readWire<int32_t>(record + offsetof(BatchRecord, userID));
+            if (nodeIndex != NODE_UNKNOWN && executeRecord(opcode, (int)nodeIndex, userID, session, &connection.failures))
+                bits[i >> 3] |= (unsigned char)(1u << (i & 7));
+        }
+    }
+
+    /**
+     * @brief LABEL_BATCH: like BATCH, with each record naming its node by label.
+     */
+    void handleLabelBatch(Connection& connection, const char *payload, uint32_t length) {
+        size_t responseStart = connection.output.size();
+        if (length < 4) return protocolError(connection, responseStart, "short LABEL_BATCH frame");
+        uint32_t count = readWire<uint32_t>(payload);
+
+        // Validate the whole frame first so no operation runs from a malformed batch.
+        size_t offset = 4;
+        for (uint32_t i = 0; i < count; i++) {
+            if (offset + 8 > length) return protocolError(connection, responseStart, "truncated LABEL_BATCH frame");
+            offset += 8 + readWire<uint16_t>(payload + offset + 2);
+        }
+        if (offset != length) return protocolError(connection, responseStart, "LABEL_BATCH length does not match records");
+
+        unsigned char *bits = (unsigned char *)&connection.output[appendResults(connection, count)];
+        SessionTable::Session *session = sessionOf(connection);
+        offset = 4;
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t opcode = readWire<uint8_t>(payload + offset);
+            uint16_t labelLength = readWire<uint16_t>(payload + offset + 2);
+            int32_t userID = readWire<int32_t>(payload + offset + 4);
+            labelScratch.assign(payload + offset + 8, labelLength);
+            offset += 8 + labelLength;
+            if (executeRecord(opcode, tree.getIndex(labelScratch), userID, session, &connection.failures))
+                bits[i >> 3] |= (unsigned char)(1u << (i & 7));
+        }
+    }
+
+    /**
+     * @brief WATCH: subscribes to a node or subtree by label.
+     */
+    void handleWatch(Connection& connection, const char *payload, uint32_t length) {
+        if (length < 4 || length != 4u + readWire<uint16_t>(payload + 2))
+            return protocolError(connection, connection.output.size(), "malformed WATCH frame");
+        labelScratch.assign(payload + 4, length - 4);
+        uint32_t id = addWatch(connection, tree.getIndex(labelScratch), readWire<uint8_t>(payload) != 0);
+        appendFrameHeader(connection.output, FRAME_WATCHING, 4);
+        appendWire<uint32_t>(connection.output, id);
+    }
+
+    /**
+     * @brief UNWATCH: cancels one of this connection's watches.
+     */
+    void handleUnwatch(Connection& connection, const char *payload, uint32_t length) {
+        if (length != 4) return protocolError(connection, connection.output.size(), "malformed UNWATCH frame");
+        uint32_t id = readWire<uint32_t>(payload);
+        appendFrameHeader(connection.output, FRAME_WATCHING, 4);
+        appendWire<uint32_t>(connection.output, removeWatch(connection, id) ? id : NODE_UNKNOWN);
+    }
+
+    void appendSessionState(Connection& connection, uint32_t id, size_t locks) {
+        appendFrameHeader(connection.output, FRAME_SESSION_STATE, 8);
+        appendWire<uint32_t>(connection.output, id);
+        appendWire<uint32_t>(connection.output, (uint32_t)locks);
+    }
+
+    /**
+     * @brief SESSION: opens a session (id 0) or resumes one, binding it to this connection.
+     */
+    void handleSession(Connection& connection, const char *payload, uint32_t length) {
+        if (length != 8) return protocolError(connection, connection.output.size(), "malformed SESSION frame");
+        uint32_t id = readWire<uint32_t>(payload);
+        uint32_t timeoutMs = readWire<uint32_t>(payload + 4);
+
+        SessionTable::Session *session = id ? sessions.find(id) : timeoutMs ? &sessions.open(timeoutMs) : nullptr;
+        if (!session) return appendSessionState(connection, NODE_UNKNOWN, 0);
+        bindSession(connection, *session);
+        appendSessionState(connection, session->id, session->held.size());
+    }
+
+    /**
+     * @brief HEARTBEAT / END_SESSION on the bound session; END_SESSION reports the locks released.
+     */
+    void handleSessionControl(Connection& connection, uint8_t type, uint32_t length) {
+        if (length != 0) return protocolError(connection, connection.output.size(), "malformed session frame");
+        SessionTable::Session *session = sessionOf(connection);
+        if (!session) return appendSessionState(connection, NODE_UNKNOWN, 0);
+        uint32_t id = session->id;
+        appendSessionState(connection, id, type == FRAME_END_SESSION ? releaseSession(id) : session->held.size());
+    }
+
+    void appendLog(Connection& connection, uint64_t first, const char *records, size_t bytes) {
+        appendFrameHeader(connection.output, FRAME_LOG, (uint32_t)(8 + bytes));
+        appendWire<uint64_t>(connection.output, first);
+        connection.output.append(records, bytes);
+    }
+
+    /**
+     * @brief FOLLOW: ships the durable backlog from the follower's position;
+     * later group commits are shipped by commitDone().
+     */
+    void handleFollow(Connection& connection, const char *payload, uint32_t length) {
+        size_t responseStart = connection.output.size();
+        if (length != 8) return protocolError(connection, responseStart, "malformed FOLLOW frame");
+        if (!wal) return protocolError(connection, responseStart, "replication needs --wal");
+        uint64_t first = readWire<uint64_t>(payload);
+        uint64_t durable = wal->records();
+        if (first > durable) return protocolError(connection, responseStart, "follower is ahead of this log");
+
+        static const uint64_t RECORDS_PER_FRAME = 64 * 1024;
+        string records;
+        for (; first < durable; first += RECORDS_PER_FRAME) {
+            uint64_t end = min(durable, first + RECORDS_PER_FRAME);
+            records.clear();
+            if (!wal->readRecords(first, end, records)) return protocolError(connection, responseStart, "cannot read log");
+            appendLog(connection, first, records.data(), records.size());
+        }
+        followers.push_back(connection.id);
+    }
+
+    void appendVote(Connection& connection, uint32_t id, bool yes, bool lockedBelow) {
+        appendFrameHeader(connection.output, FRAME_VOTE, 8);
+        appendWire<uint32_t>(connection.output, id);
+        appendWire<uint8_t>(connection.output, yes);
+        appendWire<uint8_t>(connection.output, lockedBelow);
+        appendWire<uint16_t>(connection.output, 0);
+    }
+
+    /**
+     * @brief PREPARE: checks the operation, reserves its lineage and votes. For
+     * an upgrade, a shard with no locked descendants of the node takes a plain
+     * lock; the router only commits if some shard had descendants to upgrade.
+     */
+    void handlePrepare(Connection& connection, const char *payload, uint32_t length) {
+        size_t responseStart = connection.output.size();
+        if (length < 12 || length != 12 + (uint32_t)readWire<uint16_t>(payload + 6))
+            return protocolError(connection, responseStart, "malformed PREPARE frame");
+        uint32_t id = readWire<uint32_t>(payload);
+        uint8_t opcode = readWire<uint8_t>(payload + 4);
+        int32_t userID = readWire<int32_t>(payload + 8);
+        labelScratch.assign(payload + 12, length - 12);
+        int nodeIndex = tree.getIndex(labelScratch);
+
+        bool yes = false;
+        bool lockedBelow = false;
+        if (id != 0 && prepared.id == 0 && nodeIndex >= 0 && !readOnly) {
+            int applied = opcode;
+            if (opcode == 3) {
+                lockedBelow = tree.hasLockedDescendant(nodeIndex);
+                if (!lockedBelow) applied = 1;
+            }
+            yes = (applied >= 1 && applied <= 3) && tree.wouldSucceed(applied, nodeIndex, userID);
+            if (yes) {
+                prepared.id = id;
+                prepared.opcode = applied;
+                prepared.nodeIndex = nodeIndex;
+                prepared.userID = userID;
+            }
+        }
+        appendVote(connection, id, yes, lockedBelow);
+    }
+
+    /**
+     * @brief INQUIRE: a router that (re)connects asks which transaction is
+     * prepared here, to decide it.
+     */
+    void handleInquire(Connection& connection, uint32_t length) {
+        if (length != 0) return protocolError(connection, connection.output.size(), "malformed INQUIRE frame");
+        appendVote(connection, prepared.id, prepared.id != 0, false);
+    }
+
+    /**
+     * @brief COMMIT / ABORT of the prepared transaction, from whichever
+     * connection the router now uses. COMMIT applies the operation; ABORT only
+     * drops the reservation, since nothing was applied.
+     */
+    void handleDecision(Connection& connection, uint8_t type, const char *payload, uint32_t length) {
+        if (length != 4) return protocolError(connection, connection.output.size(), "malformed COMMIT/ABORT frame");
+        uint32_t id = readWire<uint32_t>(payload);
+        if (id != 0 && type == FRAME_COMMIT && id == lastCommitted) return appendVote(connection, id, true, false);
+        if (id == 0 || id != prepared.id) {
+            if (type == FRAME_COMMIT) cerr << "shard: COMMIT of transaction " << id << ", which is not prepared here\n";
+            return appendVote(connection, id, false, false);
+        }
+
+        int opcode = prepared.opcode, nodeIndex = prepared.nodeIndex, userID = prepared.userID;
+        prepared.id = 0; // Lifts the reservation for the operation itself.
+        bool applied = type == FRAME_ABORT || executeRecord(opcode, nodeIndex, userID, nullptr);
+        if (!applied) {
+            // The reservation kept the lineage as it was when the yes vote was cast.
+            cerr << "shard: prepared transaction " << id << " no longer applies; its top-of-tree replica is now out of step\n";
+        }
+        if (applied && type == FRAME_COMMIT) lastCommitted = id;
+        endPrepared();
+        appendVote(connection, id, applied, false);
+    }
+
+    /**
+     * @brief Follower side: applies the primary's HELLO and LOG frames.
+     */
+    void processUpstreamInput(Connection& connection) {
+        const string& input = connection.input;
+        while (!connection.closeAfterFlush) {
+            size_t available = input.size() - connection.inputStart;
+            if (available < sizeof(FrameHeader)) break;
+            const char *frame = input.data() + connection.inputStart;
+            uint32_t length = readWire<uint32_t>(frame + offsetof(FrameHeader, length));
+            uint8_t type = readWire<uint8_t>(frame + offsetof(FrameHeader, type));
+            if (available < sizeof(FrameHeader) + length) break;
+            const char *payload = frame + sizeof(FrameHeader);
+            connection.inputStart += sizeof(FrameHeader) + length;
+
+            const char *problem = nullptr;
+            if (!readOnly) {
+                continue; // Promoted: the rest of the stream no longer applies.
+            } else if (type == FRAME_HELLO) {
+                if (length != 8 || readWire<uint32_t>(payload + 4) != (uint32_t)tree.size()) problem = "the primary serves a different tree";
+            } else if (type == FRAME_LOG && length >= 8 && (length - 8) % sizeof(BatchRecord) == 0) {
+                uint64_t index = readWire<uint64_t>(payload);
+                for (const char *record = payload + 8; record < payload + length; record += sizeof(BatchRecord), index++) {
+                    if (index < logPosition) continue; // Already held.
+                    if (index > logPosition) {
+                        problem = "gap in the primary's log";
+                        break;
+                    }
+                    uint8_t opcode = readWire<uint8_t>(record + offsetof(BatchRecord, opcode));
+                    uint32_t nodeIndex = readWire<uint32_t>(record + offsetof(BatchRecord, nodeIndex));
+                    int32_t userID = readWire<int32_t>(record + offsetof(BatchRecord, userID));
+                    if (!executeRecord(opcode, (int)nodeIndex, userID, nullptr)) {
+                        problem = "log record does not apply; diverged from the primary";
+                        break;
+                    }
+                }
+            } else if (type == FRAME_ERROR) {
+                cerr << "follower: primary reported: " << string(payload, length) << "\n";
+                problem = "";
+            } else {
+                problem = "unexpected frame from the primary";
+            }
+            if (problem) {
+                if (*problem) cerr << "follower: " << problem << "\n";
+                connection.closeAfterFlush = true;
+            }
+        }
+    }
+
+    /**
+     * @brief Turns a follower into a primary: it stops applying the primary's
+     * log and starts accepting writes. Its own clients keep their connections.
+     */
+    void promote() {
+        readOnly = false;
+        if (Connection *upstream = upstreamID ? find(upstreamID) : nullptr)
+            shutdown(upstream->fd, SHUT_RDWR); // The backend closes it on the resulting EOF.
+    }
+
+    /**
+     * @brief Executes every complete frame, pausing when the client is not
+     * reading its responses.
+     */
+    void processBinaryInput(Connection& connection) {
+        const string& input = connection.input;
+        while (!connection.closeAfterFlush && !connection.backpressured()) {
+            size_t available = input.size() - connection.inputStart;
+            if (available < sizeof(FrameHeader)) break;
+
+            const char *frame = input.data() + connection.inputStart;
+            uint32_t length = readWire<uint32_t>(frame + offsetof(FrameHeader, length));
+            uint8_t type = readWire<uint8_t>(frame + offsetof(FrameHeader, type));
+            if (length > MAX_FRAME_LENGTH) {
+                protocolError(connection, connection.output.size(), "frame too large");
+                break;
+            }
+            if (available < sizeof(FrameHeader) + length) break;
+
+            const char *payload = frame + sizeof(FrameHeader);
+            if (readOnly && (type == FRAME_BATCH || type == FRAME_LABEL_BATCH || type == FRAME_SESSION || type == FRAME_PREPARE)) {
+                protocolError(connection, connection.output.size(), "read-only follower");
+                break;
+            }
+            switch (type) {
+                case FRAME_RESOLVE: handleResolve(connection, payload, length); break;
+                case FRAME_BATCH: handleBatch(connection, payload, length); break;
+                case FRAME_LABEL_BATCH: handleLabelBatch(connection, payload, length); break;
+                case FRAME_WATCH: handleWatch(connection, payload, length); break;
+                case FRAME_UNWATCH: handleUnwatch(connection, payload, length); break;
+                case FRAME_SESSION: handleSession(connection, payload, length); break;
+                case FRAME_HEARTBEAT:
+                case FRAME_END_SESSION: handleSessionControl(connection, type, length); break;
+                case FRAME_FOLLOW: handleFollow(connection, payload, length); break;
+                case FRAME_PREPARE: handlePrepare(connection, payload, length); break;
+                case FRAME_COMMIT:
+                case FRAME_ABORT: handleDecision(connection, type, payload, length); break;
+                case FRAME_INQUIRE: handleInquire(connection, length); break;
+                default: protocolError(connection, connection.output.size(), "unknown frame type"); break;
+            }
+            connection.inputStart += sizeof(FrameHeader) + length;
+        }
+    }
+
+    void release(Connection& connection, uint64_t upTo) {
+        if (upTo <= connection.releasedUpTo) return;
+        connection.releasedUpTo = upTo;
+        released.push_back(connection.id);
+    }
+
+public:
+    LockService(LockingTree& lockingTree, WriteAheadLog *log, RingTransport *ringTransport)
+        : tree(lockingTree), wal(log), watchIndex(lockingTree), sessions(lockingTree.size()),
+          sessionTimerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)), rings(ringTransport),
+          logPosition(log ? log->records() : 0) {
+        if (rings) {
+            ringCommitMark.assign(rings->numSlots(), 0);
+            ringAwaitingRelease.assign(rings->numSlots(), false);
+            ringFailures.assign(rings->numSlots(), FailureCache());
+        }
+    }
+
+    ~LockService() {
+        if (sessionTimerFd >= 0) close(sessionTimerFd);
+    }
+
+    Connection& open(int fd) {
+        uint64_t id = nextConnectionID++;
+        unique_ptr<Connection>& slot = connections[id];
+        slot.reset(new Connection(id, fd));
+        return *slot;
+    }
+
+    /**
+     * @brief Makes this server a read-only follower of the primary at the other
+     * end of 'fd', asking for the log from the position it already holds.
+     */
+    Connection& followPrimary(int fd) {
+        Connection& connection = open(fd);
+        connection.mode = MODE_UPSTREAM;
+        upstreamID = connection.id;
+        readOnly = true;
+        connection.output.append(PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC));
+        appendFrameHeader(connection.output, FRAME_FOLLOW, 8);
+        appendWire<uint64_t>(connection.output, logPosition);
+        noteOutput(connection);
+        return connection;
+    }
+
+    Connection *find(uint64_t id) {
+        auto it = connections.find(id);
+        return it == connections.end() ? nullptr : it->second.get();
+    }
+
+    void erase(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        for (uint32_t watchID : it->second->watchIDs) watchIndex.remove(watchID);
+        // The session outlives the connection: it expires unless resumed in time.
+        if (SessionTable::Session *session = sessionOf(*it->second)) session->connectionID = 0;
+        if (id == upstreamID) {
+            upstreamID = 0;
+            if (readOnly) cerr << "follower: lost the primary; serving reads until promoted\n";
+        }
+        connections.erase(it);
+    }
+
+    template <typename Visitor>
+    void forEachConnection(Visitor visit) {
+        for (auto& entry : connections) visit(*entry.second);
+    }
+
+    /**
+     * @brief Picks the connection's protocol from its first bytes, then runs
+     * every complete request and drops the consumed input.
+     */
+    void processInput(Connection& connection) {
+        string& input = connection.input;
+        uint64_t outputBefore = connection.outputEnd();
+        if (SessionTable::Session *session = sessionOf(connection)) sessions.heartbeat(*session); // Any request counts.
+
+        if (connection.mode == MODE_UNKNOWN && !input.empty()) {
+            if (input[0] != PROTOCOL_MAGIC[0]) {
+                connection.mode = MODE_TEXT;
+            } else if (input.size() >= sizeof(PROTOCOL_MAGIC)) {
+                if (memcmp(input.data(), PROTOCOL_MAGIC, sizeof(PROTOCOL_MAGIC)) != 0) {
+                    protocolError(connection, connection.output.size(), "bad protocol magic");
+                    input.clear();
+                } else {
+                    connection.mode = MODE_BINARY;
+                    connection.inputStart = sizeof(PROTOCOL_MAGIC);
+                    appendFrameHeader(connection.output, FRAME_HELLO, 8);
+                    appendWire<uint32_t>(connection.output, PROTOCOL_VERSION);
+                    appendWire<uint32_t>(connection.output, (uint32_t)tree.size());
+                }
+            }
+        }
+
+        if (connection.mode == MODE_TEXT) processTextInput(connection);
+        else if (connection.mode == MODE_BINARY) processBinaryInput(connection);
+        else if (connection.mode == MODE_UPSTREAM) processUpstreamInput(connection);
+
+        input.erase(0, connection.inputStart);
+        connection.inputStart = 0;
+
+        if (connection.outputEnd() != outputBefore) noteOutput(connection);
+        deliverEvents();
+    }
+
+    bool hasCompleteRequest(const Connection& connection) const {
+        const string& input = connection.input;
+        if (connection.mode == MODE_UPSTREAM) return false; // Applied as it arrives.
+        if (connection.mode != MODE_BINARY) return input.find('\n') != string::npos;
+        return input.size() >= sizeof(FrameHeader) &&
+               input.size() >= sizeof(FrameHeader) + readWire<uint32_t>(input.data());
+    }
+
+    /**
+     * @brief True once everything owed to the client has been handed to the
+     * socket and no further request can arrive or run.
+     */
+    bool finished(const Connection& connection) const {
+        return connection.pendingOutput() == 0 && connection.sending.empty() &&
+               (connection.closeAfterFlush || (connection.peerClosed && !hasCompleteRequest(connection)));
+    }
+
+    /**
+     * @brief True if endOfIteration() has output to release or commit right now.
+     */
+    bool hasUnreleased() const {
+        return (!unreleased.empty() || !ringsUnreleased.empty()) && !(wal && wal->isCommitting());
+    }
+
+    /**
+     * @brief Runs every request waiting in the shared-memory submission rings.
+     * Results are written in place and published by endOfIteration().
+     */
+    void serviceRings() {
+        if (!rings) return;
+        rings->awake();
+        const uint32_t mask = RING_ENTRIES - 1;
+        for (uint32_t i = 0; i < rings->numSlots(); i++) {
+            RingSlot& ring = rings->slot(i);
+            uint32_t head = ring.submitHead;
+            uint32_t tail = __atomic_load_n(&ring.submitTail, __ATOMIC_ACQUIRE);
+            if (head == tail) continue;
+            if (tail - head > RING_ENTRIES) tail = head + RING_ENTRIES; // Misbehaving client.
+            for (; head != tail; head++) {
+                const BatchRecord& record = ring.submissions[head & mask];
+                bool valid = !readOnly && record.nodeIndex < (uint32_t)tree.size() && record.opcode >= 1 && record.opcode <= 3;
+                ring.results[head & mask] =
+                    valid && executeRecord(record.opcode, record.nodeIndex, record.userID, nullptr, &ringFailures[i]);
+            }
+            __atomic_store_n(&ring.submitHead, head, __ATOMIC_RELEASE);
+            if (!ringAwaitingRelease[i]) {
+                ringAwaitingRelease[i] = true;
+                ringsUnreleased.push_back(i);
+            }
+        }
+        deliverEvents();
+    }
+
+    /**
+     * @brief Called right before a backend blocks.
+     * @return false if ring submissions are waiting, so it must not block.
+     */
+    bool readyToSleep() { return !rings || rings->prepareToSleep(); }
+
+    /**
+     * @brief Descriptor that becomes readable when a ring client needs the server, or -1.
+     */
+    int ringWakeDescriptor() const { return rings ? rings->wakeDescriptor() : -1; }
+
+    void ringWoken() { rings->woken(); }
+
+    /**
+     * @brief Called by a backend after each round of I/O. Without a log, new
+     * output is released at once. With one, output produced since the last
+     * commit waits for the next group commit; only one is in flight at a time.
+     * @return true if the backend must now write and sync beginCommit().
+     */
+    bool endOfIteration() {
+        if (wal && wal->isCommitting()) return false;
+
+        bool commit = wal && wal->hasStaged();
+        for (uint64_t id : unreleased) {
+            Connection *connection = find(id);
+            if (!connection) continue;
+            connection->awaitingRelease = false;
+            if (commit) {
+                connection->commitMark = connection->outputEnd();
+                awaitingCommit.push_back(id);
+            } else {
+                release(*connection, connection->outputEnd());
+            }
+        }
+        unreleased.clear();
+        for (uint32_t index : ringsUnreleased) {
+            ringAwaitingRelease[index] = false;
+            RingSlot& ring = rings->slot(index);
+            if (commit) {
+                ringCommitMark[index] = ring.submitHead;
+                ringsAwaitingCommit.push_back(index);
+            } else {
+                rings->publish(ring, ring.submitHead);
+            }
+        }
+        ringsUnreleased.clear();
+        return commit;
+    }
+
+    /**
+     * @brief Timer descriptor that becomes readable when a session may have expired.
+     */
+    int sessionTimer() const { return sessionTimerFd; }
+
+    /**
+     * @brief Points the session timer at the earliest deadline; called by the
+     * backends after each round of I/O. Only touches the timer when it changed.
+     */
+    void armSessionTimer() {
+        uint64_t deadline = sessions.nextDeadline();
+        if (deadline == armedDeadline) return;
+        armedDeadline = deadline;
+        itimerspec timer = {};
+        timer.it_value.tv_sec = deadline / 1000;
+        timer.it_value.tv_nsec = (deadline % 1000) * 1000000;
+        timerfd_settime(sessionTimerFd, TFD_TIMER_ABSTIME, &timer, nullptr); // Zero disarms.
+    }
+
+    /**
+     * @brief Releases the locks of every session past its deadline.
+     */
+    void expireSessions() {
+        uint64_t expirations;
+        while (read(sessionTimerFd, &expirations, sizeof(expirations)) > 0) {}
+        armedDeadline = 0; // The timer fired; re-arm even for the same deadline.
+
+        uint64_t now = SessionTable::nowMs();
+        while (uint32_t id = sessions.nextExpired(now)) releaseSession(id);
+        deliverEvents();
+    }
+
+    bool hasLog() const { return wal != nullptr; }
+
+    WriteAheadLog& log() { return *wal; }
+
+    const string& beginCommit() { return wal->beginCommit(); }
+
+    /**
+     * @brief Sends a durable group of records to every follower, released at once.
+     */
+    void shipToFollowers(uint64_t first, const string& records) {
+        if (records.empty()) return;
+        size_t kept = 0;
+        for (uint64_t id : followers) {
+            Connection *connection = find(id);
+            if (!connection) continue;
+            followers[kept++] = id;
+            appendLog(*connection, first, records.data(), records.size());
+            release(*connection, connection->outputEnd());
+        }
+        followers.resize(kept);
+    }
+
+    /**
+     * @brief The group commit is durable: release every response it covered.
+     */
+    void commitDone() {
+        shipToFollowers(wal->records(), wal->inCommit());
+        wal->commitDone();
+        for (uint64_t id : awaitingCommit) {
+            Connection *connection = find(id);
+            if (connection) release(*connection, connection->commitMark);
+        }
+        awaitingCommit.clear();
+        for (uint32_t index : ringsAwaitingCommit) rings->publish(rings->slot(index), ringCommitMark[index]);
+        ringsAwaitingCommit.clear();
+    }
+
+    /**
+     * @brief Connections that gained sendable output since the last call.
+     */
+    vector<uint64_t> takeReleased() {
+        vector<uint64_t> result;
+        result.swap(released);
+        return result;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 7. SOCKETS
+// ----------------------------------------------------------------------
+
+static void configureClient(int fd) {
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)); // Fails harmlessly on Unix sockets.
+}
+
+/**
+ * @brief Listening sockets and the shutdown signalfd, shared by both backends.
+ */
+struct ServerSockets {
+    vector<int> listenFds;
+    vector<string> unixPaths; // Unlinked on shutdown.
+    int signalFd = -1;
+    int upstreamFd = -1;      // Follower only: connection to the primary.
+
+    ServerSockets() {
+        // SIGINT/SIGTERM arrive through the event loop for a clean shutdown.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigprocmask(SIG_BLOCK, &signals, nullptr);
+        signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+
+    ~ServerSockets() {
+        for (int fd : listenFds) close(fd);
+        for (const string& path : unixPaths) unlink(path.c_str());
+        if (signalFd >= 0) close(signalFd);
+    }
+
+    bool addListener(int fd) {
+        if (listen(fd, SOMAXCONN) < 0 || !setNonBlocking(fd)) {
+            close(fd);
+            return false;
+        }
+        listenFds.push_back(fd);
+        return true;
+    }
+
+    /**
+     * @brief Listens on a Unix-domain stream socket, replacing a stale socket file.
+     */
+    bool listenUnix(const string& path) {
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path)) return false;
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path.c_str());
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            return false;
+        }
+        unixPaths.push_back(path);
+        return addListener(fd);
+    }
+
+    /**
+     * @brief Listens on 127.0.0.1:port.
+     */
+    bool listenTcp(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            close(fd);
+            return false;
+        }
+        return addListener(fd);
+    }
+
+    /**
+     * @brief Connects to a primary, given like a client address: a Unix socket
+     * path (anything with a '/') or "[host:]port". The connection is adopted by
+     * the backend, which also closes it.
+     */
+    bool connectUpstream(const string& address) {
+        int fd = connectSocket(address);
+        if (fd < 0) return false;
+        if (!setNonBlocking(fd)) {
+            close(fd);
+            return false;
+        }
+        upstreamFd = fd;
+        return true;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 8. EPOLL BACKEND
+// ----------------------------------------------------------------------
+
+class EpollServer {
+private:
+    static const uint64_t SIGNAL_TAG = 0;               // Connection ids start at 1.
+    static const uint64_t LISTENER_TAG = 1ull << 63;    // Low bits: listening fd.
+    static const uint64_t TIMER_TAG = 1ull << 62;
+    static const uint64_t RING_TAG = 1ull << 61;
+
+    LockService& service;
+    ServerSockets& sockets;
+    int epollFd;
+    vector<uint64_t> touched; // Connections to check for completion after this round.
+
+    /**
+     * @brief Accepts every pending connection on an edge-triggered listener.
+     */
+    void acceptAll(int listenFd) {
+        while (true) {
+            int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientFd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return; // EAGAIN: drained; anything else: try again on the next edge.
+            }
+            configureClient(clientFd);
+            watchConnection(service.open(clientFd));
+        }
+    }
+
+    void watchConnection(Connection& connection) {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = connection.id;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection.fd, &event) < 0) {
+            close(connection.fd);
+            service.erase(connection.id);
+        }
+    }
+
+    void closeConnection(Connection& connection) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.fd, nullptr);
+        close(connection.fd);
+        service.erase(connection.id);
+    }
+
+    /**
+     * @brief Writes as much released output as the socket accepts.
+     * @return false if the connection failed.
+     */
+    bool flushOutput(Connection& connection) {
+        while (size_t sendable = connection.sendableOutput()) {
+            ssize_t written = send(connection.fd, connection.output.data() + connection.outputStart, sendable,
+                                   MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            connection.consumeOutput(written);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads until EAGAIN (required with edge triggering) and runs requests.
+     * Stops early while the client is not reading responses; draining the
+     * output resumes it.
+     * @return false if the connection failed.
+     */
+    bool readInput(Connection& connection) {
+        while (!connection.peerClosed && !connection.closeAfterFlush && !connection.backpressured()) {
+            size_t used = connection.input.size();
+            connection.input.resize(used + READ_CHUNK);
+            ssize_t received = read(connection.fd, &connection.input[used], READ_CHUNK);
+            connection.input.resize(used + (received > 0 ? received : 0));
+
+            if (received > 0) {
+                service.processInput(connection);
+                continue;
+            }
+            if (received == 0) connection.peerClosed = true;
+            else if (errno == EINTR) continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            else return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sends what it can, then runs input held back by backpressure and
+     * reads more (the EPOLLIN edge was not drained while backpressured).
+     */
+    bool serviceConnection(Connection& connection) {
+        if (!flushOutput(connection)) return false;
+        if (connection.backpressured()) return true;
+        if (!connection.input.empty()) service.processInput(connection);
+        return readInput(connection);
+    }
+
+    /**
+     * @brief Group commit for this backend: a blocking write + fdatasync.
+     */
+    void commitLog() {
+        WriteAheadLog& wal = service.log();
+        const string& records = service.beginCommit();
+        for (size_t written = 0; written < records.size();) {
+            ssize_t n = pwrite(wal.descriptor(), records.data() + written, records.size() - written,
+                               wal.size() + written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                perror("write-ahead log");
+                exit(1);
+            }
+            written += n;
+        }
+        if (fdatasync(wal.descriptor()) < 0) {
+            perror("write-ahead log");
+            exit(1);
+        }
+        service.commitDone();
+    }
+
+public:
+    EpollServer(LockService& lockService, ServerSockets& serverSockets)
+        : service(lockService), sockets(serverSockets), epollFd(epoll_create1(EPOLL_CLOEXEC)) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = SIGNAL_TAG;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, sockets.signalFd, &event);
+        event.data.u64 = TIMER_TAG;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, service.sessionTimer(), &event);
+        if (service.ringWakeDescriptor() >= 0) {
+            event.data.u64 = RING_TAG;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, service.ringWakeDescriptor(), &event);
+        }
+
+        for (int fd : sockets.listenFds) {
+            event.events = EPOLLIN | EPOLLET;
+            event.data.u64 = LISTENER_TAG | (uint64_t)fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+        if (sockets.upstreamFd >= 0) watchConnection(service.followPrimary(sockets.upstreamFd));
+    }
+
+    ~EpollServer() {
+        service.forEachConnection([](Connection& connection) { close(connection.fd); });
+        close(epollFd);
+    }
+
+    /**
+     * @brief Runs the event loop until SIGINT or SIGTERM.
+     */
+    int run() {
+        epoll_event events[256];
+        while (true) {
+            service.armSessionTimer();
+            // Output produced by a previous round still needs its commit, or a ring
+            // has submissions: don't block.
+            bool block = !service.hasUnreleased() && service.readyToSleep();
+            int ready = epoll_wait(epollFd, events, 256, block ? -1 : 0);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return 1;
+            }
+
+            touched.clear();
+            for (int i = 0; i < ready; i++) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == SIGNAL_TAG) return 0;
+                if (tag == TIMER_TAG) {
+                    service.expireSessions();
+                    continue;
+                }
+                if (tag == RING_TAG) {
+                    service.ringWoken();
+                    continue;
+                }
+                if (tag & LISTENER_TAG) {
+                    acceptAll((int)(tag & ~LISTENER_TAG));
+                    continue;
+                }
+                Connection *connection = service.find(tag);
+                if (!connection) continue;
+                if ((events[i].events & EPOLLERR) || !serviceConnection(*connection)) closeConnection(*connection);
+                else touched.push_back(tag);
+            }
+
+            service.serviceRings();
+            if (service.endOfIteration()) commitLog();
+            for (uint64_t id : service.takeReleased()) {
+                Connection *connection = service.find(id);
+                if (!connection) continue;
+                if (serviceConnection(*connection)) touched.push_back(id);
+                else closeConnection(*connection);
+            }
+
+            // A client that half-closed still receives every response before we close.
+            for (uint64_t id : touched) {
+                Connection *connection = service.find(id);
+                if (connection && service.finished(*connection)) closeConnection(*connection);
+            }
+        }
+    }
+};
+
+// ----------------------------------------------------------------------
+// 9. IO_URING BACKEND
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Minimal io_uring over the raw system calls (liburing is not required).
+ */
+class IoUring {
+private:
+    int ringFd = -1;
+    void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries = 0;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+    unsigned queuedTail = 0;
+
+public:
+    ~IoUring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+    bool init(unsigned entries, unsigned completionEntries) {
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = completionEntries;
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+        const int protection = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+        sqRing = mmap(nullptr, sqRingSize, protection, flags, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, protection, flags, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, protection, flags, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = (char *)sqRing, *cq = (char *)cqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        queuedTail = *sqTail;
+        return true;
+    }
+
+    int descriptor() const { return ringFd; }
+
+    /**
+     * @brief True if the kernel implements 'opcode'.
+     */
+    bool supports(unsigned opcode) const {
+        const unsigned maxOps = 256;
+        vector<char> storage(sizeof(io_uring_probe) + maxOps * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = (io_uring_probe *)storage.data();
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, maxOps) < 0) return false;
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    /**
+     * @brief Registers 'data' as fixed buffer 0, for IORING_OP_WRITE_FIXED.
+     */
+    bool registerBuffer(void *data, size_t size) {
+        iovec buffer = {data, size};
+        return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &buffer, 1) == 0;
+    }
+
+    /**
+     * @brief Returns a zeroed submission entry, submitting first if the queue is full.
+     */
+    io_uring_sqe *getSqe() {
+        if (queuedTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) submit(false);
+        unsigned index = queuedTail & *sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        queuedTail++;
+        return sqe;
+    }
+
+    /**
+     * @brief Submits every queued entry, optionally waiting for one completion.
+     */
+    int submit(bool wait) {
+        unsigned toSubmit = queuedTail - *sqTail;
+        __atomic_store_n(sqTail, queuedTail, __ATOMIC_RELEASE);
+        return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    }
+
+    template <typename Handler>
+    void drainCompletions(Handler handle) {
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & *cqMask];
+            __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+};
+
+class UringServer {
+private:
+    enum Operation : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_CANCEL, OP_PROVIDE, OP_LOG_WRITE, OP_LOG_SYNC, OP_SIGNAL, OP_TIMER, OP_RING };
+    static const unsigned BUFFER_COUNT = 256;
+    static const unsigned BUFFER_SIZE = 16 * 1024;
+    static const unsigned BUFFER_GROUP = 0;
+    static const size_t LOG_BUFFER_SIZE = 1 << 20; // Larger groups are written from the log's own string.
+
+    static uint64_t userData(Operation operation, uint64_t id) { return ((uint64_t)operation << 56) | id; }
+
+    LockService& service;
+    ServerSockets& sockets;
+    IoUring ring;
+    vector<char> buffers;
+    vector<char> logBuffer; // Registered with the ring when there is a log; empty otherwise.
+    signalfd_siginfo signalInfo;
+    uint64_t timerExpirations;
+    uint64_t ringWakeups;
+    bool stopping = false;
+    const char *logError = nullptr;
+    vector<uint64_t> touched; // Connections to check for completion after this round.
+
+    /**
+     * @brief Hands 'count' receive buffers starting at 'firstID' to the kernel's
+     * buffer group, from which multishot receives pick one per completion.
+     * Receives use this group rather than registered buffers: a fixed-buffer
+     * read is single-shot and needs a buffer reserved per connection, while
+     * the group is shared by every connection's multishot recv.
+     */
+    void provideBuffers(unsigned firstID, unsigned count) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = (uint64_t)(uintptr_t)&buffers[(size_t)firstID * BUFFER_SIZE];
+        sqe->len = BUFFER_SIZE;
+        sqe->off = firstID;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = userData(OP_PROVIDE, 0);
+    }
+
+    void armAccept(size_t listener) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = sockets.listenFds[listener];
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = userData(OP_ACCEPT, listener);
+    }
+
+    void armRecv(Connection& connection) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = connection.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = userData(OP_RECV, connection.id);
+        connection.recvArmed = true;
+        connection.inflight++;
+    }
+
+    void cancelRecv(Connection& connection) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = userData(OP_RECV, connection.id);
+        sqe->user_data = userData(OP_CANCEL, connection.id);
+    }
+
+    void armSignal() {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = sockets.signalFd;
+        sqe->addr = (uint64_t)(uintptr_t)&signalInfo;
+        sqe->len = sizeof(signalInfo);
+        sqe->user_data = userData(OP_SIGNAL, 0);
+    }
+
+    void armTimer() {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = service.sessionTimer();
+        sqe->addr = (uint64_t)(uintptr_t)&timerExpirations;
+        sqe->len = sizeof(timerExpirations);
+        sqe->user_data = userData(OP_TIMER, 0);
+    }
+
+    void armRingWake() {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = service.ringWakeDescriptor();
+        sqe->addr = (uint64_t)(uintptr_t)&ringWakeups;
+        sqe->len = sizeof(ringWakeups);
+        sqe->user_data = userData(OP_RING, 0);
+    }
+
+    /**
+     * @brief Sends released output unless a send is already in flight. The
+     * bytes are moved out of 'output' first because it may reallocate meanwhile.
+     */
+    void startSend(Connection& connection) {
+        if (connection.sendInFlight || connection.closing) return;
+        if (connection.sending.empty()) {
+            size_t sendable = connection.sendableOutput();
+            if (sendable == 0) return;
+            connection.sending.assign(connection.output, connection.outputStart, sendable);
+            connection.consumeOutput(sendable);
+        }
+
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = connection.fd;
+        sqe->addr = (uint64_t)(uintptr_t)connection.sending.data();
+        sqe->len = (unsigned)connection.sending.size();
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData(OP_SEND, connection.id);
+        connection.sendInFlight = true;
+        connection.inflight++;
+    }
+
+    /**
+     * @brief Shuts the socket down to end its outstanding requests; the
+     * connection is freed once the last of them has completed.
+     */
+    void closeConnection(Connection& connection) {
+        if (!connection.closing) {
+            connection.closing = true;
+            shutdown(connection.fd, SHUT_RDWR);
+            if (connection.recvArmed) cancelRecv(connection);
+        }
+        if (connection.inflight == 0) {
+            close(connection.fd);
+            service.erase(connection.id);
+        }
+    }
+
+    /**
+     * @brief Keeps one multishot recv armed while the connection can accept input.
+     */
+    void resumeReading(Connection& connection) {
+        if (connection.recvArmed || connection.peerClosed || connection.closeAfterFlush || connection.backpressured())
+            return;
+        armRecv(connection);
+    }
+
+    void onAccept(const io_uring_cqe& cqe, size_t listener) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) armAccept(listener);
+        if (cqe.res < 0) return;
+        configureClient(cqe.res);
+        armRecv(service.open(cqe.res));
+    }
+
+    void onRecv(const io_uring_cqe& cqe, Connection *connection) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            unsigned bufferID = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (connection && cqe.res > 0) connection->input.append(&buffers[(size_t)bufferID * BUFFER_SIZE], cqe.res);
+            provideBuffers(bufferID, 1);
+        }
+        if (!connection) return;
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            connection->recvArmed = false;
+            connection->inflight--;
+        }
+        if (connection->closing) return closeConnection(*connection);
+
+        if (cqe.res > 0) {
+            service.processInput(*connection);
+            if (connection->backpressured() && connection->recvArmed) cancelRecv(*connection);
+        } else if (cqe.res == 0) {
+            connection->peerClosed = true;
+        } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            return closeConnection(*connection);
+        }
+        resumeReading(*connection);
+        touched.push_back(connection->id);
+    }
+
+    void onSend(const io_uring_cqe& cqe, Connection *connection) {
+        if (!connection) return;
+        connection->sendInFlight = false;
+        connection->inflight--;
+        if (connection->closing || cqe.res < 0) return closeConnection(*connection);
+
+        connection->sending.erase(0, cqe.res);
+        if (!connection->backpressured() && !connection->input.empty()) service.processInput(*connection);
+        resumeReading(*connection);
+        startSend(*connection);
+        touched.push_back(connection->id);
+    }
+
+    /**
+     * @brief Queues the group commit as a write linked to an fdatasync, so the
+     * sync completion alone says the whole group is durable.
+     */
+    void startCommit() {
+        WriteAheadLog& wal = service.log();
+        const string& records = service.beginCommit();
+
+        io_uring_sqe *write = ring.getSqe();
+        write->fd = wal.descriptor();
+        if (!logBuffer.empty() && records.size() <= logBuffer.size()) {
+            // Only one commit is in flight, so the registered buffer is free to refill.
+            memcpy(logBuffer.data(), records.data(), records.size());
+            write->opcode = IORING_OP_WRITE_FIXED;
+            write->addr = (uint64_t)(uintptr_t)logBuffer.data();
+            write->buf_index = 0;
+        } else {
+            write->opcode = IORING_OP_WRITE;
+            write->addr = (uint64_t)(uintptr_t)records.data();
+        }
+        write->len = (unsigned)records.size();
+        write->off = wal.size();
+        write->flags = IOSQE_IO_LINK;
+        write->user_data = userData(OP_LOG_WRITE, records.size());
+
+        io_uring_sqe *sync = ring.getSqe();
+        sync->opcode = IORING_OP_FSYNC;
+        sync->fd = wal.descriptor();
+        sync->fsync_flags = IORING_FSYNC_DATASYNC;
+        sync->user_data = userData(OP_LOG_SYNC, 0);
+    }
+
+    void handleCompletion(const io_uring_cqe& cqe) {
+        uint64_t id = cqe.user_data & ((1ull << 56) - 1);
+        switch ((Operation)(cqe.user_data >> 56)) {
+            case OP_ACCEPT: onAccept(cqe, id); break;
+            case OP_RECV: onRecv(cqe, service.find(id)); break;
+            case OP_SEND: onSend(cqe, service.find(id)); break;
+            case OP_CANCEL:
+            case OP_PROVIDE: break;
+            case OP_LOG_WRITE:
+                // A short write also cancels the linked sync.
+                if (cqe.res < 0 || (uint64_t)cqe.res != id) logError = cqe.res < 0 ? strerror(-cqe.res) : "short write";
+                break;
+            case OP_LOG_SYNC:
+                if (cqe.res < 0 && !logError) logError = strerror(-cqe.res);
+                if (!logError) service.commitDone();
+                break;
+            case OP_SIGNAL: stopping = true; break;
+            case OP_TIMER:
+                service.expireSessions();
+                armTimer();
+                break;
+            case OP_RING:
+                service.ringWoken();
+                armRingWake();
+                break;
+        }
+    }
+
+public:
+    UringServer(LockService& lockService, ServerSockets& serverSockets)
+        : service(lockService), sockets(serverSockets) {}
+
+    ~UringServer() {
+        service.forEachConnection([](Connection& connection) { close(connection.fd); });
+    }
+
+    /**
+     * @brief Sets up the ring and receive buffers and arms the listeners.
+     * @return false if the kernel lacks what this backend needs.
+     */
+    bool init() {
+        // Multishot recv arrived in the same release (6.0) as SEND_ZC, which the probe can see.
+        if (!ring.init(1024, 8192) || !ring.supports(IORING_OP_SEND_ZC)) return false;
+        buffers.resize((size_t)BUFFER_COUNT * BUFFER_SIZE);
+        provideBuffers(0, BUFFER_COUNT);
+        if (service.hasLog()) {
+            // Group commits are written from a registered buffer, so the kernel
+            // does not map and pin the pages for every write. Without it
+            // (e.g. a low RLIMIT_MEMLOCK), they are written from the log's string.
+            logBuffer.resize(LOG_BUFFER_SIZE);
+            if (!ring.registerBuffer(logBuffer.data(), logBuffer.size())) vector<char>().swap(logBuffer);
+        }
+        for (size_t i = 0; i < sockets.listenFds.size(); i++) armAccept(i);
+        armSignal();
+        armTimer();
+        if (service.ringWakeDescriptor() >= 0) armRingWake();
+        if (ring.submit(false) < 0) return false;
+        // Registered only once nothing can fail: the epoll fallback registers it
+        // itself, and this backend's destructor closes every connection it knows.
+        if (sockets.upstreamFd >= 0) armRecv(service.followPrimary(sockets.upstreamFd));
+        return true;
+    }
+
+    /**
+     * @brief Runs the completion loop until SIGINT or SIGTERM.
+     */
+    int run() {
+        while (!stopping) {
+            service.armSessionTimer();
+            bool block = !service.hasUnreleased() && service.readyToSleep();
+            if (ring.submit(block) < 0 && errno != EINTR && errno != EBUSY) {
+                perror("io_uring_enter");
+                return 1;
+            }
+
+            touched.clear();
+            ring.drainCompletions([this](const io_uring_cqe& cqe) { handleCompletion(cqe); });
+            if (logError) {
+                cerr << "write-ahead log: " << logError << "\n";
+                return 1;
+            }
+
+            service.serviceRings();
+            if (service.endOfIteration()) startCommit();
+            for (uint64_t id : service.takeReleased()) {
+                Connection *connection = service.find(id);
+                if (connection) startSend(*connection);
+            }
+
+            // A client that half-closed still receives every response before we close.
+            for (uint64_t id : touched) {
+                Connection *connection = service.find(id);
+                if (connection && !connection->closing && !connection->sendInFlight && service.finished(*connection))
+                    closeConnection(*connection);
+            }
+        }
+        return 0;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 10. MAIN EXECUTION
+// ----------------------------------------------------------------------
+
+static int usage(const char *program) {
+    cerr << "usage: " << program << " [--unix PATH] [--tcp PORT] [--shm NAME [--shm-slots N]] [--tree FILE] [--wal FILE]"
+            " [--follow ADDRESS] [--shard I/N [--cut-depth D]] [--io auto|uring|epoll]\n";
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    ios_base::sync_with_stdio(false);
+
+    string unixPath, shmName, followAddress, treeFile, walFile, ioBackend = "auto";
+    int tcpPort = 0;
+    int shmSlots = 16;
+    int shardIndex = 0, shardCount = 0, cutDepth = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) return usage(argv[0]);
+        if (arg == "--unix") unixPath = argv[++i];
+        else if (arg == "--tcp") tcpPort = atoi(argv[++i]);
+        else if (arg == "--shm") shmName = argv[++i];
+        else if (arg == "--shm-slots") shmSlots = atoi(argv[++i]);
+        else if (arg == "--tree") treeFile = argv[++i];
+        else if (arg == "--wal") walFile = argv[++i];
+        else if (arg == "--follow") followAddress = argv[++i];
+        else if (arg == "--shard") {
+            if (sscanf(argv[++i], "%d/%d", &shardIndex, &shardCount) != 2) return usage(argv[0]);
+        }
+        else if (arg == "--cut-depth") cutDepth = atoi(argv[++i]);
+        else if (arg == "--io") ioBackend = argv[++i];
+        else return usage(argv[0]);
+    }
+    if (unixPath.empty() && tcpPort == 0 && shmName.empty()) return usage(argv[0]);
+    if (shmSlots <= 0) return usage(argv[0]);
+    if (shardCount < 0 || (shardCount > 0 && (shardIndex < 0 || shardIndex >= shardCount)) || cutDepth < 0)
+        return usage(argv[0]);
+    if (ioBackend != "auto" && ioBackend != "uring" && ioBackend != "epoll") return usage(argv[0]);
+
+    ifstream treeStream;
+    if (!treeFile.empty()) {
+        treeStream.open(treeFile);
+        if (!treeStream) {
+            cerr << "cannot open " << treeFile << "\n";
+            return 1;
+        }
+    }
+    istream& in = treeFile.empty() ? cin : treeStream;
+
+    int numNodes, numChildren;
+    if (!(in >> numNodes >> numChildren) || numNodes <= 0) {
+        cerr << "expected \"numNodes numChildren\" followed by node labels\n";
+        return 1;
+    }
+    vector<string> nodeLabels;
+    vector<int> parents;
+    if (shardCount > 0) {
+        TreePartition partition(numNodes, numChildren, cutDepth, shardCount);
+        if (!partition.project(shardIndex, in, nodeLabels, parents)) {
+            cerr << "expected " << numNodes << " node labels\n";
+            return 1;
+        }
+    } else {
+        nodeLabels.resize(numNodes);
+        for (int i = 0; i < numNodes; i++) in >> nodeLabels[i];
+    }
+
+    LockingTree lockingTree = shardCount > 0 ? LockingTree(nodeLabels, parents)
+                                             : LockingTree(numNodes, numChildren, nodeLabels);
+
+    unique_ptr<WriteAheadLog> wal;
+    if (!walFile.empty()) {
+        wal.reset(new WriteAheadLog());
+        if (!wal->open(walFile, lockingTree)) {
+            perror(walFile.c_str());
+            return 1;
+        }
+    }
+
+#ifdef FLIGHT_RECORDER
+    installFlightRecorder(("flight-recorder." + to_string(getpid()) + ".bin").c_str());
+#endif
+#ifdef METRICS_PORT
+    if (!startMetricsServer(METRICS_PORT))
+        cerr << "metrics: could not listen on 127.0.0.1:" << METRICS_PORT << "\n";
+#endif
+
+    ServerSockets sockets;
+    if (!unixPath.empty() && !sockets.listenUnix(unixPath)) {
+        perror(unixPath.c_str());
+        return 1;
+    }
+    if (tcpPort != 0 && !sockets.listenTcp(tcpPort)) {
+        perror("tcp listen");
+        return 1;
+    }
+    if (!followAddress.empty() && !sockets.connectUpstream(followAddress)) {
+        perror(followAddress.c_str());
+        return 1;
+    }
+
+    unique_ptr<RingTransport> rings;
+    if (!shmName.empty()) {
+        rings.reset(new RingTransport());
+        if (!rings->create(shmName, lockingTree, shmSlots)) {
+            perror(shmName.c_str());
+            return 1;
+        }
+    }
+
+    LockService service(lockingTree, wal.get(), rings.get());
+    int status = -1;
+    if (ioBackend != "epoll") {
+        UringServer uring(service, sockets);
+        if (uring.init()) status = uring.run();
+        else if (ioBackend == "uring") {
+            perror("io_uring");
+            return 1;
+        }
+    }
+    if (status < 0) {
+        EpollServer epoll(service, sockets);
+        status = epoll.run();
+    }
+
+#ifdef LOCK_HEATMAP
+    lockingTree.dumpHeatmap(cerr, 20);
+#endif
+    return status;
+}
@@ -0,0 +1,1044 @@
+/**
+ * @file locking-tree.h
+ * @brief Index-based LockingTree guarded by a custom spinlock, together with
+ * its optional instrumentation (USDT probes, heatmap, metrics, flight recorder).
+ * Shared by the batch program (custom-synchronisation.cpp), the lock server and
+ * the Raft replicas. The rules are those of policy::LockingTree; this header
+ * supplies the spinlock as its sync policy and the instrumentation as its
+ * observer policy.
+ */
+#ifndef LOCKING_TREE_H
+#define LOCKING_TREE_H
+
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include "policy-locking-tree.h"
+#ifdef LOCK_HEATMAP
+#include <chrono>
+#include <iomanip>
+#endif
+#ifdef METRICS_PORT
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+// The flight recorder is always on; build with -DNO_FLIGHT_RECORDER to leave it out.
+#if !defined(NO_FLIGHT_RECORDER) && !defined(FLIGHT_RECORDER)
+#define FLIGHT_RECORDER
+#endif
+#ifdef FLIGHT_RECORDER
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+// No standard concurrency headers included
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+// 1. STATIC TRACEPOINTS (USDT; disable with -DNO_USDT_PROBES)
+// ----------------------------------------------------------------------
+
+/**
+ * Probes (provider "lockingtree"), for use with bpftrace/perf/systemtap:
+ *   lock_entry, unlock_entry, upgrade_entry     (char *label, int user)
+ *   lock_return, unlock_return, upgrade_return  (char *label, int user, int result)
+ *   broadcast_start, broadcast_end              (int nodeIndex, int delta), around the
+ *                                               counter updates of a lock (+1) or unlock (-1)
+ *   spin_begin ()  spin_end (unsigned long long spins)
+ *
+ * Each probe site is a single nop plus an ELF note describing where its
+ * arguments live; nothing is executed unless a tracer attaches.
+ *   bpftrace -e 'usdt:./custom-synchronisation:lockingtree:lock_return { @[arg2] = count(); }'
+ */
+#if !defined(NO_USDT_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT0(name) DTRACE_PROBE(lockingtree, name)
+#define USDT1(name, f1, a1) DTRACE_PROBE1(lockingtree, name, a1)
+#define USDT2(name, f1, a1, f2, a2) DTRACE_PROBE2(lockingtree, name, a1, a2)
+#define USDT3(name, f1, a1, f2, a2, f3, a3) DTRACE_PROBE3(lockingtree, name, a1, a2, a3)
+#elif defined(__GNUC__) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+// Minimal version of the systemtap <sys/sdt.h> note layout (version 3, no semaphore).
+// Argument descriptors are "<size>@<operand>", negative size for signed values.
+#define USDT_NOTE(name, args)                                               \
+    "990: nop\n"                                                            \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+    ".balign 4\n"                                                           \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+    "991: .asciz \"stapsdt\"\n"                                             \
+    "992: .balign 4\n"                                                      \
+    "993: .8byte 990b\n"                                                    \
+    ".8byte _.stapsdt.base\n"                                               \
+    ".8byte 0\n"                                                            \
+    ".asciz \"lockingtree\"\n"                                              \
+    ".asciz \"" #name "\"\n"                                                 \
+    ".asciz \"" args "\"\n"                                                  \
+    "994: .balign 4\n"                                                      \
+    ".popsection\n"                                                         \
+    ".ifndef _.stapsdt.base\n"                                              \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                                \
+    ".hidden _.stapsdt.base\n"                                              \
+    "_.stapsdt.base: .space 1\n"                                            \
+    ".size _.stapsdt.base, 1\n"                                             \
+    ".popsection\n"                                                         \
+    ".endif\n"
+#define USDT0(name) __asm__ __volatile__(USDT_NOTE(name, ""))
+#define USDT1(name, f1, a1) __asm__ __volatile__(USDT_NOTE(name, f1 "@%0") :: "nor"(a1))
+#define USDT2(name, f1, a1, f2, a2) \
+    __asm__ __volatile__(USDT_NOTE(name, f1 "@%0 " f2 "@%1") :: "nor"(a1), "nor"(a2))
+#define USDT3(name, f1, a1, f2, a2, f3, a3) \
+    __asm__ __volatile__(USDT_NOTE(name, f1 "@%0 " f2 "@%1 " f3 "@%2") :: "nor"(a1), "nor"(a2), "nor"(a3))
+#endif
+#endif
+
+#ifdef USDT0
+#define PROBE_ENTRY(opcode, label, id)                                                        \
+    do {                                                                                      \
+        if ((opcode) == 1) USDT2(lock_entry, "8", (label).c_str(), "-4", (int)(id));          \
+        else if ((opcode) == 2) USDT2(unlock_entry, "8", (label).c_str(), "-4", (int)(id));   \
+        else USDT2(upgrade_entry, "8", (label).c_str(), "-4", (int)(id));                     \
+    } while (0)
+#define PROBE_BROADCAST_START(nodeIndex, delta) USDT2(broadcast_start, "-4", (int)(nodeIndex), "-4", (int)(delta))
+#define PROBE_BROADCAST_END(nodeIndex, delta) USDT2(broadcast_end, "-4", (int)(nodeIndex), "-4", (int)(delta))
+#define PROBE_SPIN_BEGIN() USDT0(spin_begin)
+#define PROBE_SPIN_END(spins) USDT1(spin_end, "8", (unsigned long long)(spins))
+
+/**
+ * @brief Fires the matching *_return probe when the operation's scope ends.
+ * The opcode is a template argument and the destructor is always inlined, so
+ * each return site gets just its own probe's nop.
+ */
+template <int OPCODE>
+class ProbeReturn {
+private:
+    const char *label;
+    int userID;
+    int result = 0;
+
+public:
+    ProbeReturn(const string& nodeLabel, int id) : label(nodeLabel.c_str()), userID(id) {}
+
+    void succeeded() { result = 1; }
+
+    __attribute__((always_inline)) ~ProbeReturn() {
+        if (OPCODE == 1) USDT3(lock_return, "8", label, "-4", userID, "-4", result);
+        else if (OPCODE == 2) USDT3(unlock_return, "8", label, "-4", userID, "-4", result);
+        else USDT3(upgrade_return, "8", label, "-4", userID, "-4", result);
+    }
+};
+
+#define PROBE_SUCCEEDED() probeReturn.succeeded()
+#else
+#define PROBE_ENTRY(opcode, label, id) ((void)0)
+#define PROBE_SUCCEEDED() ((void)0)
+#define PROBE_BROADCAST_START(nodeIndex, delta) ((void)0)
+#define PROBE_BROADCAST_END(nodeIndex, delta) ((void)0)
+#define PROBE_SPIN_BEGIN() ((void)0)
+#define PROBE_SPIN_END(spins) ((void)0)
+#endif
+
+#ifdef METRICS_PORT
+inline void recordSpinWait(unsigned long long spins); // Defined with the metrics below.
+#endif
+
+// ----------------------------------------------------------------------
+// 2. CUSTOM SYNCHRONIZATION IMPLEMENTATION (Spinlock)
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Custom SpinLock implementation using compiler intrinsics.
+ * * WARNING: This relies on compiler-specific built-in functions 
+ * (__sync_lock_test_and_set, __sync_lock_release) which provide atomic 
+ * guarantees similar to std::atomic, but are external to the standard C++ 
+ * synchronization headers. This code is NOT portable across all C++ compilers 
+ * without these specific built-ins.
+ */
+class CustomSpinLock {
+private:
+    // 0 = unlocked, 1 = locked. 'volatile' prevents caching/optimization.
+    volatile int lock_flag = 0; 
+
+public:
+    /**
+     * @brief Acquires the lock atomically using an intrinsic test-and-set.
+     */
+    void lock() {
+        unsigned long long spins = 0;
+        // __sync_lock_test_and_set atomically sets lock_flag to 1 and returns 
+        // the previous value. We loop while the previous value was 1 (locked).
+        while (__sync_lock_test_and_set(&lock_flag, 1)) {
+            // Spin: wait for the flag to be released
+            if (spins++ == 0) PROBE_SPIN_BEGIN();
+        }
+        if (spins) {
+            PROBE_SPIN_END(spins);
+#ifdef METRICS_PORT
+            recordSpinWait(spins);
+#endif
+        }
+    }
+
+    /**
+     * @brief Releases the lock atomically using an intrinsic release.
+     */
+    void unlock() {
+        // __sync_lock_release atomically sets lock_flag to 0.
+        __sync_lock_release(&lock_flag);
+    }
+};
+
+// ----------------------------------------------------------------------
+// 3. CONTENTION HEATMAP (build with -DLOCK_HEATMAP)
+// ----------------------------------------------------------------------
+
+// Why an attempt was rejected, as reported by policy::LockingTree to its observer.
+using policy::FailReason;
+using policy::NUM_FAIL_REASONS;
+using policy::failReasonNames;
+
+#ifdef LOCK_HEATMAP
+
+#ifndef LOCK_HEATMAP_HOLD_SAMPLE
+#define LOCK_HEATMAP_HOLD_SAMPLE 16 // Time one in every N successful locks.
+#endif
+
+/**
+ * @brief Per-node contention counters.
+ * All updates happen inside the tree's critical section, so plain
+ * increments are sufficient.
+ */
+struct NodeHeat {
+    unsigned long long attempts = 0;
+    unsigned long long failures[NUM_FAIL_REASONS] = {};
+    unsigned long long holdNanos = 0;   // Sum over sampled lock holds.
+    unsigned long long holdSamples = 0; // Number of sampled lock holds.
+    long long lockStamp = 0;            // Start of the current sampled hold, 0 if not sampled.
+};
+
+/**
+ * @brief Collects per-node lock attempts, failures by reason and sampled
+ * hold times, and renders them as a ranked list or a tree heatmap.
+ */
+class LockHeatmap {
+private:
+    vector<NodeHeat> heat;
+    unsigned long long lockCounter = 0;
+
+    static long long nowNanos() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static unsigned long long totalFailures(const NodeHeat& h) {
+        unsigned long long total = 0;
+        for (int r = 0; r < NUM_FAIL_REASONS; r++) total += h.failures[r];
+        return total;
+    }
+
+    /**
+     * @brief Sums attempts over the subtree of nodeIndex into subtreeAttempts.
+     */
+    unsigned long long aggregate(int nodeIndex, const vector<vector<int>>& childrenIDs,
+                                 vector<unsigned long long>& subtreeAttempts) const {
+        unsigned long long total = heat[nodeIndex].attempts;
+        for (int childIndex : childrenIDs[nodeIndex])
+            total += aggregate(childIndex, childrenIDs, subtreeAttempts);
+        return subtreeAttempts[nodeIndex] = total;
+    }
+
+    void printTree(ostream& out, int nodeIndex, int depth, unsigned long long threshold,
+                   unsigned long long rootTotal, const vector<vector<int>>& childrenIDs,
+                   const vector<string>& idToLabel,
+                   const vector<unsigned long long>& subtreeAttempts) const {
+        if (subtreeAttempts[nodeIndex] < threshold || subtreeAttempts[nodeIndex] == 0) return;
+
+        int barLength = (int)(40 * subtreeAttempts[nodeIndex] / rootTotal);
+        out << string(2 * depth, ' ') << idToLabel[nodeIndex]
+            << " [" << string(barLength, '#') << string(40 - barLength, '.') << "] "
+            << subtreeAttempts[nodeIndex] << " (self " << heat[nodeIndex].attempts
+            << ", failed " << totalFailures(heat[nodeIndex]) << ")\n";
+
+        for (int childIndex : childrenIDs[nodeIndex])
+            printTree(out, childIndex, depth + 1, threshold, rootTotal, childrenIDs,
+                      idToLabel, subtreeAttempts);
+    }
+
+public:
+    void resize(int numNodes) { heat.assign(numNodes, NodeHeat()); }
+
+    void attempt(int nodeIndex) { heat[nodeIndex].attempts++; }
+
+    void fail(int nodeIndex, FailReason reason) { heat[nodeIndex].failures[reason]++; }
+
+    /**
+     * @brief Called after a successful lock; starts a hold-time sample every N locks.
+     */
+    void locked(int nodeIndex) {
+        if (++lockCounter % LOCK_HEATMAP_HOLD_SAMPLE == 0)
+            heat[nodeIndex].lockStamp = nowNanos();
+    }
+
+    /**
+     * @brief Called after a lock is released; closes a pending hold-time sample.
+     */
+    void unlocked(int nodeIndex) {
+        NodeHeat& h = heat[nodeIndex];
+        if (h.lockStamp == 0) return;
+        h.holdNanos += nowNanos() - h.lockStamp;
+        h.holdSamples++;
+        h.lockStamp = 0;
+    }
+
+    /**
+     * @brief Prints the 'limit' most attempted nodes with failure breakdown and mean hold time.
+     */
+    void dumpRanked(ostream& out, const vector<string>& idToLabel, int limit) const {
+        vector<int> order;
+        for (int i = 0; i < (int)heat.size(); i++)
+            if (heat[i].attempts) order.push_back(i);
+
+        sort(order.begin(), order.end(), [&](int a, int b) {
+            return heat[a].attempts != heat[b].attempts ? heat[a].attempts > heat[b].attempts
+                                                         : totalFailures(heat[a]) > totalFailures(heat[b]);
+        });
+        if ((int)order.size() > limit) order.resize(limit);
+
+        out << left << setw(16) << "node" << right << setw(10) << "attempts";
+        for (int r = 0; r < NUM_FAIL_REASONS; r++) out << setw(11) << failReasonNames[r];
+        out << setw(14) << "hold_ns_avg" << "\n";
+
+        for (int nodeIndex : order) {
+            const NodeHeat& h = heat[nodeIndex];
+            out << left << setw(16) << idToLabel[nodeIndex] << right << setw(10) << h.attempts;
+            for (int r = 0; r < NUM_FAIL_REASONS; r++) out << setw(11) << h.failures[r];
+            out << setw(14) << (h.holdSamples ? h.holdNanos / h.holdSamples : 0) << "\n";
+        }
+    }
+
+    /**
+     * @brief Prints the tree with each node's share of subtree attempts as a bar.
+     * Subtrees with less than 1% of all attempts are pruned.
+     */
+    void dumpTree(ostream& out, int rootIndex, const vector<vector<int>>& childrenIDs,
+                  const vector<string>& idToLabel) const {
+        vector<unsigned long long> subtreeAttempts(heat.size(), 0);
+        unsigned long long rootTotal = aggregate(rootIndex, childrenIDs, subtreeAttempts);
+        if (rootTotal == 0) return;
+        printTree(out, rootIndex, 0, rootTotal / 100, rootTotal, childrenIDs, idToLabel,
+                  subtreeAttempts);
+    }
+};
+
+#define HEAT_ATTEMPT(nodeIndex) instruments.heatmap.attempt(nodeIndex)
+#define HEAT_FAIL(nodeIndex, reason) instruments.heatmap.fail(nodeIndex, reason)
+#define HEAT_LOCKED(nodeIndex) instruments.heatmap.locked(nodeIndex)
+#define HEAT_UNLOCKED(nodeIndex) instruments.heatmap.unlocked(nodeIndex)
+#else
+#define HEAT_ATTEMPT(nodeIndex) ((void)0)
+#define HEAT_FAIL(nodeIndex, reason) ((void)0)
+#define HEAT_LOCKED(nodeIndex) ((void)0)
+#define HEAT_UNLOCKED(nodeIndex) ((void)0)
+#endif
+
+// ----------------------------------------------------------------------
+// 4. PROMETHEUS METRICS (build with -DMETRICS_PORT=<port>)
+// ----------------------------------------------------------------------
+
+#ifdef METRICS_PORT
+
+enum { METRIC_OPCODES = 3, LATENCY_BUCKETS = 22 }; // Buckets: 64ns * 2^k, k = 0..20, then +Inf.
+
+/**
+ * @brief Counters owned and written by a single thread.
+ * The owner updates them with relaxed stores (no locked instructions);
+ * the scraper reads them with relaxed loads and sums across threads.
+ */
+struct ThreadMetrics {
+    unsigned long long operations[METRIC_OPCODES][2] = {};                   // [opcode][result]
+    unsigned long long failures[METRIC_OPCODES][NUM_FAIL_REASONS + 1] = {};  // Last slot: unknown label.
+    unsigned long long latencyBuckets[METRIC_OPCODES][LATENCY_BUCKETS] = {};
+    unsigned long long latencyNanos[METRIC_OPCODES] = {};
+    unsigned long long locksAcquired = 0;
+    unsigned long long locksReleased = 0;
+    unsigned long long contendedAcquisitions = 0;
+    unsigned long long spinIterations = 0;
+    ThreadMetrics *next = nullptr;
+};
+
+static ThreadMetrics *metricsHead = nullptr; // Lock-free list of every thread's counters.
+static thread_local ThreadMetrics *localMetrics = nullptr;
+
+/**
+ * @brief Returns the calling thread's counters, registering them on first use.
+ * Entries are never freed so counts from exited threads remain in the totals.
+ */
+static ThreadMetrics& threadMetrics() {
+    if (!localMetrics) {
+        ThreadMetrics *metrics = new ThreadMetrics();
+        metrics->next = __atomic_load_n(&metricsHead, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metricsHead, &metrics->next, metrics, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        localMetrics = metrics;
+    }
+    return *localMetrics;
+}
+
+static inline void bump(unsigned long long& counter, unsigned long long value = 1) {
+    __atomic_store_n(&counter, counter + value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long readCounter(const unsigned long long& counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+inline void recordSpinWait(unsigned long long spins) {
+    ThreadMetrics& metrics = threadMetrics();
+    bump(metrics.contendedAcquisitions);
+    bump(metrics.spinIterations, spins);
+}
+
+static long long metricsNowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Times one public operation and records its outcome when it goes out of scope.
+ */
+class OpMetrics {
+private:
+    int opcode;
+    long long start;
+    int failReason = NUM_FAIL_REASONS; // Stays "unknown" if neither succeeded() nor failed() is called.
+    bool success = false;
+
+public:
+    explicit OpMetrics(int op) : opcode(op - 1), start(metricsNowNanos()) {}
+
+    void succeeded() { success = true; }
+    void failed(FailReason reason) { failReason = reason; }
+
+    ~OpMetrics() {
+        unsigned long long elapsed = metricsNowNanos() - start;
+        int bucket = elapsed <= 64 ? 0 : 64 - __builtin_clzll(elapsed - 1) - 6;
+        if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+        ThreadMetrics& metrics = threadMetrics();
+        bump(metrics.operations[opcode][success]);
+        if (!success) bump(metrics.failures[opcode][failReason]);
+        bump(metrics.latencyBuckets[opcode][bucket]);
+        bump(metrics.latencyNanos[opcode], elapsed);
+    }
+};
+
+/**
+ * @brief Aggregates all threads' counters into Prometheus text exposition format.
+ */
+static string renderMetrics() {
+    static const char *opNames[METRIC_OPCODES] = {"lock", "unlock", "upgrade"};
+
+    ThreadMetrics total;
+    int threads = 0;
+    for (ThreadMetrics *m = __atomic_load_n(&metricsHead, __ATOMIC_ACQUIRE); m; m = m->next) {
+        threads++;
+        for (int op = 0; op < METRIC_OPCODES; op++) {
+            for (int r = 0; r < 2; r++) total.operations[op][r] += readCounter(m->operations[op][r]);
+            for (int r = 0; r <= NUM_FAIL_REASONS; r++) total.failures[op][r] += readCounter(m->failures[op][r]);
+            for (int b = 0; b < LATENCY_BUCKETS; b++) total.latencyBuckets[op][b] += readCounter(m->latencyBuckets[op][b]);
+            total.latencyNanos[op] += readCounter(m->latencyNanos[op]);
+        }
+        total.locksAcquired += readCounter(m->locksAcquired);
+        total.locksReleased += readCounter(m->locksReleased);
+        total.contendedAcquisitions += readCounter(m->contendedAcquisitions);
+        total.spinIterations += readCounter(m->spinIterations);
+    }
+
+    ostringstream out;
+    out << "# HELP lockingtree_operations_total Lock tree operations by opcode and result.\n"
+        << "# TYPE lockingtree_operations_total counter\n";
+    for (int op = 0; op < METRIC_OPCODES; op++)
+        for (int r = 0; r < 2; r++)
+            out << "lockingtree_operations_total{op=\"" << opNames[op] << "\",result=\""
+                << (r ? "true" : "false") << "\"} " << total.operations[op][r] << "\n";
+
+    out << "# HELP lockingtree_failures_total Failed operations by opcode and reason.\n"
+        << "# TYPE lockingtree_failures_total counter\n";
+    for (int op = 0; op < METRIC_OPCODES; op++)
+        for (int r = 0; r <= NUM_FAIL_REASONS; r++)
+            out << "lockingtree_failures_total{op=\"" << opNames[op] << "\",reason=\""
+                << (r < NUM_FAIL_REASONS ? failReasonNames[r] : "unknown") << "\"} "
+                << total.failures[op][r] << "\n";
+
+    out << "# HELP lockingtree_operation_duration_seconds Operation latency including lock wait.\n"
+        << "# TYPE lockingtree_operation_duration_seconds histogram\n";
+    for (int op = 0; op < METRIC_OPCODES; op++) {
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            cumulative += total.latencyBuckets[op][b];
+            out << "lockingtree_operation_duration_seconds_bucket{op=\"" << opNames[op] << "\",le=\"";
+            if (b == LATENCY_BUCKETS - 1) out << "+Inf";
+            else out << (64.0 * (1ULL << b)) * 1e-9;
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "lockingtree_operation_duration_seconds_sum{op=\"" << opNames[op] << "\"} "
+            << total.latencyNanos[op] * 1e-9 << "\n"
+            << "lockingtree_operation_duration_seconds_count{op=\"" << opNames[op] << "\"} "
+            << cumulative << "\n";
+    }
+
+    out << "# HELP lockingtree_locked_nodes Nodes currently holding a lock.\n"
+        << "# TYPE lockingtree_locked_nodes gauge\n"
+        << "lockingtree_locked_nodes " << (long long)(total.locksAcquired - total.locksReleased) << "\n"
+        << "# HELP lockingtree_spinlock_contended_total Tree spinlock acquisitions that had to spin.\n"
+        << "# TYPE lockingtree_spinlock_contended_total counter\n"
+        << "lockingtree_spinlock_contended_total " << total.contendedAcquisitions << "\n"
+        << "# HELP lockingtree_spinlock_spins_total Spin iterations waiting for the tree spinlock.\n"
+        << "# TYPE lockingtree_spinlock_spins_total counter\n"
+        << "lockingtree_spinlock_spins_total " << total.spinIterations << "\n"
+        << "# HELP lockingtree_metrics_threads Threads that have recorded metrics.\n"
+        << "# TYPE lockingtree_metrics_threads gauge\n"
+        << "lockingtree_metrics_threads " << threads << "\n";
+
+    long pages = 0, residentPages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &pages, &residentPages) != 2) pages = residentPages = 0;
+        fclose(statm);
+    }
+    long pageSize = sysconf(_SC_PAGESIZE);
+    out << "# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+        << "# TYPE process_resident_memory_bytes gauge\n"
+        << "process_resident_memory_bytes " << residentPages * pageSize << "\n"
+        << "# HELP process_virtual_memory_bytes Virtual memory size in bytes.\n"
+        << "# TYPE process_virtual_memory_bytes gauge\n"
+        << "process_virtual_memory_bytes " << pages * pageSize << "\n";
+    return out.str();
+}
+
+/**
+ * @brief Serves GET /metrics on the listening socket, one connection at a time.
+ */
+static void *metricsServerLoop(void *arg) {
+    int listenFd = (int)(long)arg;
+    char request[1024];
+
+    while (true) {
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0) continue;
+
+        ssize_t received = read(clientFd, request, sizeof(request) - 1);
+        request[received > 0 ? received : 0] = '\0';
+
+        string body, status = "200 OK";
+        if (strncmp(request, "GET /metrics", 12) == 0) {
+            body = renderMetrics();
+        } else {
+            status = "404 Not Found";
+            body = "not found\n";
+        }
+
+        string response = "HTTP/1.1 " + status +
+                          "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t n = write(clientFd, response.data() + sent, response.size() - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(clientFd);
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Starts the metrics listener on 127.0.0.1:port in a detached thread.
+ * @return false if the socket could not be bound.
+ */
+static bool startMetricsServer(int port) {
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return false;
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listenFd, (sockaddr *)&address, sizeof(address)) < 0 || listen(listenFd, 16) < 0) {
+        close(listenFd);
+        return false;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, metricsServerLoop, (void *)(long)listenFd) != 0) {
+        close(listenFd);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+#define METRIC_FAIL(reason) opMetrics.failed(reason)
+#define METRIC_LOCKED() bump(threadMetrics().locksAcquired)
+#define METRIC_UNLOCKED() bump(threadMetrics().locksReleased)
+#define METRIC_SUCCEEDED() opMetrics.succeeded()
+#else
+#define METRIC_FAIL(reason) ((void)0)
+#define METRIC_LOCKED() ((void)0)
+#define METRIC_UNLOCKED() ((void)0)
+#define METRIC_SUCCEEDED() ((void)0)
+#endif
+
+// ----------------------------------------------------------------------
+// 5. FLIGHT RECORDER (disable with -DNO_FLIGHT_RECORDER)
+// ----------------------------------------------------------------------
+
+#ifdef FLIGHT_RECORDER
+
+#ifndef FLIGHT_RECORDER_SIZE
+#define FLIGHT_RECORDER_SIZE 4096 // Records kept per thread; must be a power of two.
+#endif
+
+/**
+ * @brief One completed operation, packed into 16 bytes.
+ * stampAndOp holds the completion time in nanoseconds since the process
+ * started (upper 56 bits, enough for over two years of uptime),
+ * the opcode (4 bits) and the outcome (4 bits: 0 = success, 1 + FailReason
+ * on failure, 15 = unknown label).
+ */
+struct FlightRecord {
+    uint64_t stampAndOp;
+    uint32_t nodeIndex; // UINT32_MAX for an unknown label.
+    int32_t userID;
+};
+
+/**
+ * @brief Fixed-size ring written only by its owning thread.
+ */
+struct FlightRing {
+    FlightRecord records[FLIGHT_RECORDER_SIZE];
+    uint64_t head = 0;          // Total records ever written.
+    uint64_t threadIndex = 0;
+    FlightRing *next = nullptr;
+};
+
+/**
+ * @brief Header of the binary dump; followed by, for each thread, a
+ * FlightThreadHeader and its records from oldest to newest.
+ */
+struct FlightFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;
+};
+
+struct FlightThreadHeader {
+    uint64_t threadIndex;
+    uint64_t count;
+};
+
+static FlightRing *flightRingsHead = nullptr; // Lock-free list of every thread's ring.
+static uint64_t flightThreadCount = 0;
+static thread_local FlightRing *localFlightRing = nullptr;
+static char flightDumpPath[256] = "flight-recorder.bin";
+
+static uint64_t monotonicNanos() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Stamps count from here, not from boot, so 56 bits cannot wrap with the machine's uptime.
+static const uint64_t flightStartNanos = monotonicNanos();
+
+static FlightRing& flightRing() {
+    if (!localFlightRing) {
+        FlightRing *ring = new FlightRing();
+        ring->threadIndex = __atomic_fetch_add(&flightThreadCount, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&flightRingsHead, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&flightRingsHead, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        localFlightRing = ring;
+    }
+    return *localFlightRing;
+}
+
+/**
+ * @brief Captures one operation and appends it to the thread's ring when it goes out of scope.
+ */
+class FlightEntry {
+private:
+    int opcode;
+    int userID;
+    uint32_t nodeIndex = UINT32_MAX;
+    int outcome = 15;
+
+public:
+    FlightEntry(int op, int id) : opcode(op), userID(id) {}
+
+    void node(int index) { nodeIndex = (uint32_t)index; }
+    void succeeded() { outcome = 0; }
+    void failed(FailReason reason) { outcome = 1 + reason; }
+
+    ~FlightEntry() {
+        uint64_t nanos = monotonicNanos() - flightStartNanos;
+
+        FlightRing& ring = flightRing();
+        FlightRecord& record = ring.records[ring.head & (FLIGHT_RECORDER_SIZE - 1)];
+        record.stampAndOp = (nanos << 8) | ((uint64_t)opcode << 4) | (uint64_t)outcome;
+        record.nodeIndex = nodeIndex;
+        record.userID = userID;
+        __atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+    }
+};
+
+static bool writeAll(int fd, const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0) return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes every thread's ring to 'path' in the binary format above.
+ * Async-signal-safe: uses only open/write/close and never allocates. A
+ * record being written concurrently by its owner may appear torn.
+ */
+static bool dumpFlightRecorder(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    FlightFileHeader header = {{'L', 'T', 'F', 'R'}, 2, sizeof(FlightRecord), FLIGHT_RECORDER_SIZE};
+    bool ok = writeAll(fd, &header, sizeof(header));
+
+    for (FlightRing *ring = __atomic_load_n(&flightRingsHead, __ATOMIC_ACQUIRE); ring && ok; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t count = head < FLIGHT_RECORDER_SIZE ? head : FLIGHT_RECORDER_SIZE;
+        uint64_t oldest = (head - count) & (FLIGHT_RECORDER_SIZE - 1);
+
+        FlightThreadHeader threadHeader = {ring->threadIndex, count};
+        ok = writeAll(fd, &threadHeader, sizeof(threadHeader));
+
+        // Oldest records run to the end of the array, the rest wrap to the start.
+        uint64_t firstChunk = oldest + count <= FLIGHT_RECORDER_SIZE ? count : FLIGHT_RECORDER_SIZE - oldest;
+        ok = ok && writeAll(fd, ring->records + oldest, firstChunk * sizeof(FlightRecord));
+        ok = ok && writeAll(fd, ring->records, (count - firstChunk) * sizeof(FlightRecord));
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void flightDumpSignal(int) {
+    dumpFlightRecorder(flightDumpPath);
+}
+
+static void flightCrashSignal(int signalNumber) {
+    dumpFlightRecorder(flightDumpPath);
+    // The handler was installed with SA_RESETHAND, so this re-raises with the default action.
+    raise(signalNumber);
+}
+
+/**
+ * @brief Dumps to 'path' on SIGUSR1 and on fatal signals.
+ */
+static inline void installFlightRecorder(const char *path) {
+    strncpy(flightDumpPath, path, sizeof(flightDumpPath) - 1);
+
+    struct sigaction action = {};
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = flightDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+
+    action.sa_handler = flightCrashSignal;
+    action.sa_flags = SA_RESETHAND;
+    for (int signalNumber : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        sigaction(signalNumber, &action, nullptr);
+}
+
+/**
+ * @brief Prints a binary dump as text, merged across threads in time order.
+ */
+static inline int decodeFlightRecorder(const char *path) {
+    static const char *opNames[4] = {"?", "lock", "unlock", "upgrade"};
+
+    FILE *in = fopen(path, "rb");
+    if (!in) { cerr << "cannot open " << path << "\n"; return 1; }
+
+    FlightFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, "LTFR", 4) != 0 ||
+        header.recordSize != sizeof(FlightRecord)) {
+        cerr << path << ": not a flight recorder dump\n";
+        fclose(in);
+        return 1;
+    }
+
+    vector<pair<FlightRecord, uint64_t>> records; // (record, thread)
+    FlightThreadHeader threadHeader;
+    while (fread(&threadHeader, sizeof(threadHeader), 1, in) == 1) {
+        for (uint64_t i = 0; i < threadHeader.count; i++) {
+            FlightRecord record;
+            if (fread(&record, sizeof(record), 1, in) != 1) break;
+            records.push_back({record, threadHeader.threadIndex});
+        }
+    }
+    fclose(in);
+
+    sort(records.begin(), records.end(), [](const pair<FlightRecord, uint64_t>& a, const pair<FlightRecord, uint64_t>& b) {
+        return a.first.stampAndOp < b.first.stampAndOp;
+    });
+
+    for (auto& entry : records) {
+        const FlightRecord& record = entry.first;
+        int opcode = (record.stampAndOp >> 4) & 15;
+        int outcome = record.stampAndOp & 15;
+        cout << (record.stampAndOp >> 8) << " thread=" << entry.second
+             << " op=" << opNames[opcode < 4 ? opcode : 0] << " node=";
+        if (record.nodeIndex == UINT32_MAX) cout << "?";
+        else cout << record.nodeIndex;
+        cout << " user=" << record.userID << " result=";
+        if (outcome == 0) cout << "true";
+        else if (outcome <= NUM_FAIL_REASONS) cout << "false(" << failReasonNames[outcome - 1] << ")";
+        else cout << "false(unknown)";
+        cout << "\n";
+    }
+    return 0;
+}
+
+#define RECORD_NODE(nodeIndex) flightEntry.node(nodeIndex)
+#define RECORD_FAIL(reason) flightEntry.failed(reason)
+#define RECORD_SUCCEEDED() flightEntry.succeeded()
+#else
+#define RECORD_NODE(nodeIndex) ((void)0)
+#define RECORD_FAIL(reason) ((void)0)
+#define RECORD_SUCCEEDED() ((void)0)
+#endif
+
+// ----------------------------------------------------------------------
+// 6. OBSERVER POLICY
+// ----------------------------------------------------------------------
+
+/**
+ * @brief The instrumentation as an observer policy of policy::LockingTree:
+ * each hook fans out to the enabled collectors and compiles to nothing when
+ * none is enabled.
+ */
+class TreeInstruments {
+public:
+    static const bool enabled = true;
+
+#ifdef LOCK_HEATMAP
+    LockHeatmap heatmap;
+#endif
+
+    void build(int numNodes) {
+#ifdef LOCK_HEATMAP
+        heatmap.resize(numNodes);
+#endif
+    }
+
+    /**
+     * @brief One operation: the probes, metrics and flight record are
+     * completed when it goes out of scope, after the tree's lock is released.
+     */
+    template <int OPCODE>
+    class Operation {
+    private:
+        TreeInstruments& instruments;
+#ifdef USDT0
+        ProbeReturn<OPCODE> probeReturn;
+#endif
+#ifdef METRICS_PORT
+        OpMetrics opMetrics;
+#endif
+#ifdef FLIGHT_RECORDER
+        FlightEntry flightEntry;
+#endif
+
+    public:
+        Operation(TreeInstruments& observer, const string& label, int id)
+            : instruments(observer)
+#ifdef USDT0
+            , probeReturn(label, id)
+#endif
+#ifdef METRICS_PORT
+            , opMetrics(OPCODE)
+#endif
+#ifdef FLIGHT_RECORDER
+            , flightEntry(OPCODE, id)
+#endif
+        {
+            PROBE_ENTRY(OPCODE, label, id);
+        }
+
+        void attempt(int nodeIndex) { HEAT_ATTEMPT(nodeIndex); RECORD_NODE(nodeIndex); }
+        void failed(int nodeIndex, FailReason reason) { HEAT_FAIL(nodeIndex, reason); METRIC_FAIL(reason); RECORD_FAIL(reason); }
+        void updateStart(int nodeIndex, int delta) { PROBE_BROADCAST_START(nodeIndex, delta); }
+        void updateEnd(int nodeIndex, int delta) { PROBE_BROADCAST_END(nodeIndex, delta); }
+        void locked(int nodeIndex) { HEAT_LOCKED(nodeIndex); METRIC_LOCKED(); }
+        void unlocked(int nodeIndex) { HEAT_UNLOCKED(nodeIndex); METRIC_UNLOCKED(); }
+        void succeeded() { METRIC_SUCCEEDED(); RECORD_SUCCEEDED(); PROBE_SUCCEEDED(); }
+    };
+};
+
+// ----------------------------------------------------------------------
+// 7. TREE STRUCTURE AND INITIALIZATION
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Builds the M-ary tree structure using vectors to store parent/child relationships.
+ * @param numChildren The maximum branching factor.
+ * @param nodeLabels The list of all node labels.
+ * @param parentID Output vector storing parent index for each node.
+ * @param childrenIDs Output vector of vectors storing children indices for each node.
+ * @param labelToID Output map from label string to node index.
+ * @param idToLabel Output vector storing label string for each node index.
+ * @return The index of the root node (always 0).
+ */
+inline int buildTree(int numChildren, const vector<string>& nodeLabels,
+              vector<int>& parentID, vector<vector<int>>& childrenIDs,
+              unordered_map<string, int>& labelToID, vector<string>& idToLabel) {
+    
+    int numNodes = nodeLabels.size();
+    parentID.assign(numNodes, -1);
+    childrenIDs.assign(numNodes, vector<int>());
+    idToLabel = nodeLabels;
+
+    labelToID[nodeLabels[0]] = 0;
+    queue<int> q;
+    q.push(0);
+
+    int startIndex = 1; 
+
+    while (!q.empty() && startIndex < numNodes) {
+        int parentIndex = q.front();
+        q.pop();
+
+        int endIndex = min(numNodes, startIndex + numChildren);
+        
+        for (int i = startIndex; i < endIndex; i++) {
+            int childIndex = i;
+            
+            labelToID[nodeLabels[childIndex]] = childIndex;
+            parentID[childIndex] = parentIndex;
+            childrenIDs[parentIndex].push_back(childIndex);
+            
+            q.push(childIndex);
+        }
+        startIndex = endIndex;
+    }
+
+    return 0; // Root is always at index 0
+}
+
+
+// ----------------------------------------------------------------------
+// 8. LOCKING TREE IMPLEMENTATION
+// ----------------------------------------------------------------------
+
+/**
+ * @brief policy::LockingTree on flat arrays with owner summaries and versions,
+ * guarded by CustomSpinLock and observed by the instrumentation above.
+ */
+class LockingTree : public policy::LockingTree<policy::SoAStorage, policy::OwnerSummaryIndex, CustomSpinLock, TreeInstruments> {
+private:
+    typedef policy::LockingTree<policy::SoAStorage, policy::OwnerSummaryIndex, CustomSpinLock, TreeInstruments> Engine;
+
+    vector<string> outputLog;
+
+public:
+    LockingTree(int numNodes, int numChildren, const vector<string>& nodeLabels) : Engine(numChildren, nodeLabels) {}
+
+    /**
+     * @brief Builds a tree of any shape from each node's parent index (-1 for the
+     * root, index 0); parents must come before their children. Used for the part
+     * of a larger tree that one shard holds.
+     */
+    LockingTree(const vector<string>& nodeLabels, const vector<int>& parents) : Engine(nodeLabels, parents) {}
+
+    /**
+     * @brief Changes whenever the lock state in nodeIndex's lineage changes:
+     * its own lock or owner, or a lock on any ancestor or descendant (through
+     * the counters). Every operation on nodeIndex reads nothing else, so while
+     * the version stands, a repeated operation gets the same result.
+     */
+    uint64_t versionOf(int nodeIndex) const { return index.version(nodeIndex); }
+
+    /**
+     * @brief Processes a list of queries sequentially.
+     */
+    void processQueries(const vector<pair<int, pair<string, int>>>& queries) {
+        for (const auto& query : queries) {
+            int opcode = query.first;
+            const string& nodeLabel = query.second.first;
+            int userId = query.second.second;
+
+            bool result = false;
+            switch (opcode) {
+                case 1: result = lockNode(nodeLabel, userId); break;
+                case 2: result = unlockNode(nodeLabel, userId); break;
+                case 3: result = upgradeNode(nodeLabel, userId); break;
+            }
+            // Writing to outputLog needs to be protected if processQueries were multithreaded,
+            // but assuming single-threaded query processing, a simple push_back is fine.
+            outputLog.push_back(result ? "true" : "false");
+        }
+    }
+
+    /**
+     * @brief Prints the final output log.
+     */
+    void printOutputLog() {
+        for (const string& result : outputLog) {
+            cout << result << "\n";
+        }
+    }
+
+#ifdef LOCK_HEATMAP
+    /**
+     * @brief Prints the contention heatmap: the top 'limit' nodes, then the tree view.
+     */
+    void dumpHeatmap(ostream& out, int limit) {
+        vector<string> idToLabel(size());
+        vector<vector<int>> childrenIDs(size());
+        for (int i = 0; i < size(); i++) {
+            idToLabel[i] = labelOf(i);
+            forEachChild(i, [&](int childIndex) { childrenIDs[i].push_back(childIndex); });
+        }
+        sync.lock();
+        observer.heatmap.dumpRanked(out, idToLabel, limit);
+        out << "\n";
+        observer.heatmap.dumpTree(out, 0, childrenIDs, idToLabel);
+        sync.unlock();
+    }
+#endif
+};
+
+#endif // LOCKING_TREE_H
@@ -3,9 +3,94 @@
 #include <unordered_map>
 #include <vector>
 #include <algorithm> // for std::min
+#ifdef TRACK_ALLOCATIONS
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#endif
 
 using namespace std;
 
+#ifdef TRACK_ALLOCATIONS
+// ----------------------------------------------------------------------
+// ALLOCATION TRACKING (build with -DTRACK_ALLOCATIONS)
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Program phases that allocations are attributed to.
+ */
+enum AllocPhase { PHASE_PARSE, PHASE_BUILD, PHASE_INDEX, PHASE_EXECUTE, PHASE_OUTPUT, NUM_PHASES };
+static const char *allocPhaseNames[NUM_PHASES] = {"parse", "build", "index", "execute", "output"};
+
+/**
+ * @brief Allocation counters for one phase or one opcode.
+ */
+struct AllocCounters
+{
+    unsigned long long allocations;
+    unsigned long long bytes;
+    unsigned long long frees;
+};
+
+static AllocCounters phaseAllocs[NUM_PHASES];
+static AllocCounters opcodeAllocs[4]; // Index 0 = outside any query, 1..3 = lock/unlock/upgrade.
+static int currentAllocPhase = PHASE_PARSE;
+static int currentAllocOpcode = 0;
+
+static void *trackedAlloc(size_t size)
+{
+    phaseAllocs[currentAllocPhase].allocations++;
+    phaseAllocs[currentAllocPhase].bytes += size;
+    opcodeAllocs[currentAllocOpcode].allocations++;
+    opcodeAllocs[currentAllocOpcode].bytes += size;
+
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+static void trackedFree(void *ptr)
+{
+    if (!ptr)
+        return;
+    phaseAllocs[currentAllocPhase].frees++;
+    opcodeAllocs[currentAllocOpcode].frees++;
+    free(ptr);
+}
+
+void *operator new(size_t size) { return trackedAlloc(size); }
+void *operator new[](size_t size) { return trackedAlloc(size); }
+void operator delete(void *ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void *ptr) noexcept { trackedFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { trackedFree(ptr); }
+
+/**
+ * @brief Prints the per-phase and per-opcode allocation report to stderr.
+ */
+static void printAllocReport()
+{
+    static const char *opcodeNames[4] = {"(none)", "lock", "unlock", "upgrade"};
+
+    fprintf(stderr, "%-10s %12s %14s %12s\n", "phase", "allocs", "bytes", "frees");
+    for (int i = 0; i < NUM_PHASES; i++)
+        fprintf(stderr, "%-10s %12llu %14llu %12llu\n", allocPhaseNames[i],
+                phaseAllocs[i].allocations, phaseAllocs[i].bytes, phaseAllocs[i].frees);
+
+    fprintf(stderr, "%-10s %12s %14s %12s\n", "opcode", "allocs", "bytes", "frees");
+    for (int i = 0; i < 4; i++)
+        fprintf(stderr, "%-10s %12llu %14llu %12llu\n", opcodeNames[i],
+                opcodeAllocs[i].allocations, opcodeAllocs[i].bytes, opcodeAllocs[i].frees);
+}
+
+#define SET_ALLOC_PHASE(phase) (currentAllocPhase = (phase))
+#define SET_ALLOC_OPCODE(opcode) (currentAllocOpcode = (opcode))
+#else
+#define SET_ALLOC_PHASE(phase) ((void)0)
+#define SET_ALLOC_OPCODE(opcode) ((void)0)
+#endif
+
 // Forward declaration for buildTree
 struct Node;
 Node *buildTree(Node *root, int &numChildren, vector<string> &nodeLabels);
@@ -61,7 +146,59 @@ class LockingTree
 private:
     Node *root;
     unordered_map<string, Node *> labelToNode; // O(1) lookup of node by label.
-    vector<string> outputLog;
+    vector<char> outputLog;                    // One entry per query: 1 = true, 0 = false.
+    vector<Node *> lockedDescendants;          // Scratch buffer reused by upgradeNode.
+
+    /**
+     * @brief Finds the node for 'label' without inserting into the map.
+     */
+    Node *findNode(const string &label)
+    {
+        auto it = labelToNode.find(label);
+        return (it != labelToNode.end()) ? it->second : nullptr;
+    }
+
+    /**
+     * @brief Marks targetNode as locked by 'id' and updates ancestor/descendant counters.
+     */
+    void applyLock(Node *targetNode, int id)
+    {
+        // 1. Update ancestors (Upward traversal)
+        Node *currentNode = targetNode->parent;
+        while (currentNode)
+        {
+            currentNode->descendantLocked++;
+            currentNode = currentNode->parent;
+        }
+
+        // 2. Update descendants (Downward traversal)
+        updateDescendant(targetNode, 1);
+
+        // 3. Lock the node
+        targetNode->isLocked = true;
+        targetNode->userID = id;
+    }
+
+    /**
+     * @brief Clears the lock on targetNode and updates ancestor/descendant counters.
+     */
+    void applyUnlock(Node *targetNode)
+    {
+        // 1. Update ancestors (Upward traversal)
+        Node *currentNode = targetNode->parent;
+        while (currentNode)
+        {
+            currentNode->descendantLocked--;
+            currentNode = currentNode->parent;
+        }
+
+        // 2. Update descendants (Downward traversal)
+        updateDescendant(targetNode, -1);
+
+        // 3. Unlock the node
+        targetNode->isLocked = false;
+        targetNode->userID = 0;
+    }
 
 public:
     LockingTree(Node *treeRoot) { root = treeRoot; }
@@ -79,6 +216,11 @@ public:
             fillLabelToNode(child);
     }
 
+    /**
+     * @brief Sizes the upgrade scratch buffer once the map is built, so queries never grow it.
+     */
+    void reserveScratch() { lockedDescendants.reserve(labelToNode.size()); }
+
     /**
      * @brief Updates the ancestorLocked counter for all descendants of currentNode.
      */
@@ -123,30 +265,17 @@ public:
     /**
      * @brief Locks the node 'label' by user 'id'.
      */
-    bool lockNode(string label, int id)
+    bool lockNode(const string &label, int id)
     {
-        Node *targetNode = labelToNode[label];
+        Node *targetNode = findNode(label);
 
-        if (targetNode->isLocked)
+        if (!targetNode || targetNode->isLocked)
             return false;
 
         if (targetNode->ancestorLocked != 0 || targetNode->descendantLocked != 0)
             return false;
 
-        // 1. Update ancestors (Upward traversal)
-        Node *currentNode = targetNode->parent;
-        while (currentNode)
-        {
-            currentNode->descendantLocked++;
-            currentNode = currentNode->parent;
-        }
-
-        // 2. Update descendants (Downward traversal)
-        updateDescendant(targetNode, 1);
-        
-        // 3. Lock the node
-        targetNode->isLocked = true;
-        targetNode->userID = id;
+        applyLock(targetNode, id);
 
         return true;
     }
@@ -154,30 +283,17 @@ public:
     /**
      * @brief Unlocks the node 'label' by user 'id'.
      */
-    bool unlockNode(string label, int id)
+    bool unlockNode(const string &label, int id)
     {
-        Node *targetNode = labelToNode[label];
+        Node *targetNode = findNode(label);
 
-        if (!targetNode->isLocked)
+        if (!targetNode || !targetNode->isLocked)
             return false;
 
-        if (targetNode->isLocked && targetNode->userID != id)
+        if (targetNode->userID != id)
             return false;
 
-        // 1. Update ancestors (Upward traversal)
-        Node *currentNode = targetNode->parent;
-        while (currentNode)
-        {
-            currentNode->descendantLocked--;
-            currentNode = currentNode->parent;
-        }
-
-        // 2. Update descendants (Downward traversal)
-        updateDescendant(targetNode, -1);
-        
-        // 3. Unlock the node
-        targetNode->isLocked = false;
-        targetNode->userID = 0;
+        applyUnlock(targetNode);
 
         return true;
     }
@@ -185,64 +301,62 @@ public:
     /**
      * @brief Upgrades user 'id''s lock to node 'label'.
      */
-    bool upgradeNode(string label, int id)
+    bool upgradeNode(const string &label, int id)
     {
-        Node *targetNode = labelToNode[label];
+        Node *targetNode = findNode(label);
 
-        if (targetNode->isLocked)
+        if (!targetNode || targetNode->isLocked)
             return false;
 
         if (targetNode->ancestorLocked != 0 || targetNode->descendantLocked == 0)
             return false;
 
-        vector<Node *> lockedDescendants;
+        lockedDescendants.clear();
 
-        if (checkDescendantsLocked(targetNode, id, lockedDescendants))
-        {
-            for (auto lockedDescendant : lockedDescendants)
-            {
-                // Unlocking descendants, which updates the descendant/ancestor counters
-                if (!unlockNode(lockedDescendant->label, id))
-                {
-                    return false;
-                }
-            }
-        }
-        else
-            return false; 
+        if (!checkDescendantsLocked(targetNode, id, lockedDescendants))
+            return false;
+
+        // Unlocking descendants, which updates the descendant/ancestor counters
+        for (auto lockedDescendant : lockedDescendants)
+            applyUnlock(lockedDescendant);
 
         // Lock the target node (descendantLocked is now 0)
-        lockNode(label, id); 
+        applyLock(targetNode, id);
 
         return true;
     }
 
     /**
      * @brief Processes a list of queries.
+     * The loop itself performs no heap allocation: labels are passed by
+     * reference and the output log is reserved up front.
      */
-    void processQueries(vector<pair<int, pair<string, int>>> queries)
+    void processQueries(const vector<pair<int, pair<string, int>>> &queries)
     {
-        for (auto query : queries)
+        outputLog.reserve(outputLog.size() + queries.size());
+
+        for (const auto &query : queries)
         {
             int opcode = query.first;
-            string nodeLabel = query.second.first;
+            const string &nodeLabel = query.second.first;
             int userId = query.second.second;
 
+            bool result = false;
+            SET_ALLOC_OPCODE(opcode);
             switch (opcode)
             {
             case 1:
-                lockNode(nodeLabel, userId) ? outputLog.push_back("true")
-                                           : outputLog.push_back("false");
+                result = lockNode(nodeLabel, userId);
                 break;
             case 2:
-                unlockNode(nodeLabel, userId) ? outputLog.push_back("true")
-                                             : outputLog.push_back("false");
+                result = unlockNode(nodeLabel, userId);
                 break;
             case 3:
-                upgradeNode(nodeLabel, userId) ? outputLog.push_back("true")
-                                               : outputLog.push_back("false");
+                result = upgradeNode(nodeLabel, userId);
                 break;
             }
+            SET_ALLOC_OPCODE(0);
+            outputLog.push_back(result);
         }
     }
 
@@ -251,9 +365,9 @@ public:
      */
     void printOutputLog()
     {
-        for (const string &result : outputLog)
+        for (char result : outputLog)
         {
-            cout << result << "\n";
+            cout << (result ? "true" : "false") << "\n";
         }
     }
     
@@ -314,12 +428,16 @@ int main()
         cin >> nodeLabels[i];
 
     // Build the tree
+    SET_ALLOC_PHASE(PHASE_BUILD);
     Node *rootNode = new Node(nodeLabels[0], nullptr);
     rootNode = buildTree(rootNode, numChildren, nodeLabels);
 
+    SET_ALLOC_PHASE(PHASE_INDEX);
     LockingTree lockingTree(rootNode);
     lockingTree.fillLabelToNode(lockingTree.getRoot());
+    lockingTree.reserveScratch();
 
+    SET_ALLOC_PHASE(PHASE_PARSE);
     vector<pair<int, pair<string, int>>> queries(numQueries);
 
     for (int i = 0; i < numQueries; i++)
@@ -328,8 +446,15 @@ int main()
             queries[i].second.second;
     }
 
+    SET_ALLOC_PHASE(PHASE_EXECUTE);
     lockingTree.processQueries(queries);
+
+    SET_ALLOC_PHASE(PHASE_OUTPUT);
     lockingTree.printOutputLog();
+
+#ifdef TRACK_ALLOCATIONS
+    printAllocReport();
+#endif
     
     // The LockingTree destructor handles deleting the nodes via 'delete rootNode'
     
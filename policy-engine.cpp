@@ -0,0 +1,79 @@
+#include "policy-locking-tree.h"
+
+#include <iostream>
+
+using namespace std;
+
+// The combination is fixed when compiling, e.g.
+//   g++ -O2 -DTREE_STORAGE=ImplicitStorage -DTREE_INDEX=FenwickIndex -DTREE_SYNC=NoSync policy-engine.cpp
+// With -DTREE_ADAPTIVE the index is chosen at run time instead (AdaptiveLockingTree).
+#ifndef TREE_STORAGE
+#define TREE_STORAGE SoAStorage
+#endif
+#ifndef TREE_INDEX
+#define TREE_INDEX SubtreeBroadcastIndex
+#endif
+#ifndef TREE_SYNC
+#define TREE_SYNC SpinSync
+#endif
+
+struct Query {
+    int opcode;
+    string label;
+    int user;
+};
+
+/**
+ * @brief Runs the queries on the engine specialised for arity M (0: any).
+ * They are read first and then run as one pipelined batch (see runQueries()).
+ */
+template <int M>
+static string runQueries(int numChildren, const vector<string>& nodeLabels, int numQueries) {
+    typedef typename policy::WithArity<policy::TREE_STORAGE, M>::type Storage;
+#ifdef TREE_ADAPTIVE
+    policy::AdaptiveLockingTree<Storage, policy::TREE_SYNC> lockingTree(numChildren, nodeLabels);
+#else
+    policy::LockingTree<Storage, policy::TREE_INDEX, policy::TREE_SYNC> lockingTree(numChildren, nodeLabels);
+#endif
+
+    vector<Query> queries(numQueries);
+    for (Query& query : queries) cin >> query.opcode >> query.label >> query.user;
+    vector<uint8_t> results(numQueries);
+    lockingTree.runQueries(queries.data(), queries.size(), results.data());
+
+    string output;
+    for (uint8_t result : results) output += result ? "true\n" : "false\n";
+    return output;
+}
+
+// ----------------------------------------------------------------------
+// MAIN EXECUTION
+// ----------------------------------------------------------------------
+
+/**
+ * Runs the usual query input on the policy-based LockingTree chosen with
+ * -DTREE_STORAGE, -DTREE_INDEX and -DTREE_SYNC (see policy-locking-tree.h),
+ * or on the AdaptiveLockingTree with -DTREE_ADAPTIVE (it logs its switches to stderr).
+ * With ImplicitStorage, M = 2, 4, 8 and 16 run an engine specialised for that M.
+ */
+int main() {
+    // Standard fast I/O setup
+    ios_base::sync_with_stdio(false);
+    cin.tie(NULL);
+
+    int numNodes, numChildren, numQueries;
+    if (!(cin >> numNodes >> numChildren >> numQueries)) return 0;
+
+    vector<string> nodeLabels(numNodes);
+    for (int i = 0; i < numNodes; i++) {
+        cin >> nodeLabels[i];
+    }
+
+    // A storage with a compile-time form for this M gets it; other values run the generic engine.
+    string output;
+    policy::dispatchArity(numChildren, [&](auto arity) {
+        output = runQueries<decltype(arity)::value>(numChildren, nodeLabels, numQueries);
+    });
+    cout << output;
+    return 0;
+}
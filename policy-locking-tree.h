@@ -0,0 +1,1727 @@
+/**
+ * @file policy-locking-tree.h
+ * @brief LockingTree assembled at compile time from four policies, so one
+ * implementation of the lock/unlock/upgrade rules serves every layout the
+ * standalone programs hard-wire:
+ *
+ *   policy::LockingTree<policy::SoAStorage, policy::FenwickIndex, policy::SpinSync> tree(M, labels);
+ *
+ * StoragePolicy   how the nodes and their lock state are laid out
+ *   PointerStorage   heap nodes linked by pointers (optimised.cpp)
+ *   SoAStorage       parallel arrays, children in one flat array; any shape
+ *   ImplicitStorage  no topology at all: node i's parent is (i - 1) / M
+ *   BasicImplicitStorage<M>  the same with M a compile-time constant (see dispatchArity())
+ * IndexPolicy     how "locked ancestor?" / "locked descendant?" are answered
+ *   SubtreeBroadcastIndex  per-node counters; a lock walks up and broadcasts down, O(H + subtree)
+ *   FenwickIndex           two Fenwick trees over the Euler tour, O(log N)
+ *   IntervalIndex          ordered set of the locked nodes' Euler intervals, O(log L)
+ *   BitmaskIndex           per-node subtree and ancestor bitmasks, O(N / 256) AVX2 tests, N <= 4096
+ *   OwnerSummaryIndex      SubtreeBroadcastIndex plus per-node owner sums and versions
+ * SyncPolicy      what serialises the operations
+ *   NoSync, MutexSync (std::mutex), SpinSync (test-and-test-and-set),
+ *   AtomicSync (ticket lock on std::atomic counters)
+ * ObserverPolicy  what sees each operation (optional)
+ *   NoObserver (the default)
+ *
+ * Every policy is a concrete class called through the template, so the chosen
+ * combination inlines completely; there are no virtual calls. With a constant
+ * M the parent and child arithmetic and the child loops are constants too, and
+ * a subtree is visited one contiguous range per level. Nodes are numbered
+ * breadth-first as in buildTree(), and all combinations give the same results
+ * as the other engines.
+ *
+ * thread-safe-mutex.cpp is <PointerStorage, SubtreeBroadcastIndex, MutexSync>;
+ * the LockingTree of locking-tree.h, behind the batch program, the lock server
+ * and the Raft replicas, is <SoAStorage, OwnerSummaryIndex, CustomSpinLock,
+ * TreeInstruments>, its instrumentation being the observer; shared-memory.cpp's
+ * SharedLockingTree binds its policies to a shared segment.
+ *
+ * AdaptiveLockingTree<StoragePolicy, SyncPolicy> instead chooses the index
+ * policy at run time from the tree's shape and the workload it sees, and
+ * migrates its locks when the choice changes.
+ */
+#ifndef POLICY_LOCKING_TREE_H
+#define POLICY_LOCKING_TREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace policy {
+
+// ----------------------------------------------------------------------
+// 1. STORAGE POLICIES
+// ----------------------------------------------------------------------
+
+/**
+ * A storage policy provides:
+ *   Handle                      a reference to a node, nil() for none
+ *   build(numChildren, numNodes)
+ *   build(shape)                optional: any other shape; SoAStorage takes each
+ *                               node's parent index (-1 for the root, index 0),
+ *                               parents before children
+ *   size(), handle(index), index(handle)
+ *   parent(h), forEachChild(h, visit)
+ *   isLocked(h), owner(h), setLocked(h, userID), setUnlocked(h)
+ *   prefetch(index)             hints the cache to load the node's lock state
+ *   levelRanges                 true if forEachLevelBelow(h, visit) is available: it
+ *                               calls visit(first, end) with the index range of h's
+ *                               descendants on each level below it
+ *   flatLockArrays              true if lockedData() and ownerData() return the lock
+ *                               flags (one byte per node, padded so a 4-byte load at
+ *                               any node stays in bounds) and owners, indexed by node
+ */
+
+/**
+ * @brief One heap node per tree node with parent and child pointers; the lock
+ * state lives in the node.
+ */
+class PointerStorage {
+public:
+    struct Node {
+        Node *parent = nullptr;
+        std::vector<Node *> children;
+        int index = 0;
+        int userID = 0;
+        bool locked = false;
+    };
+    using Handle = Node *;
+    static const bool levelRanges = false;
+    static const bool flatLockArrays = false;
+
+private:
+    std::vector<Node *> nodes; // By index, for handle().
+
+public:
+    PointerStorage() = default;
+    PointerStorage(const PointerStorage&) = delete;
+    PointerStorage& operator=(const PointerStorage&) = delete;
+
+    ~PointerStorage() {
+        for (Node *node : nodes) delete node;
+    }
+
+    void build(int numChildren, int numNodes) {
+        nodes.resize(numNodes);
+        for (int i = 0; i < numNodes; i++) {
+            nodes[i] = new Node();
+            nodes[i]->index = i;
+            if (i > 0) {
+                nodes[i]->parent = nodes[(i - 1) / numChildren];
+                nodes[i]->parent->children.push_back(nodes[i]);
+            }
+        }
+    }
+
+    static Handle nil() { return nullptr; }
+    int size() const { return (int)nodes.size(); }
+    Handle handle(int index) const { return nodes[index]; }
+    static int index(Handle node) { return node->index; }
+    static Handle parent(Handle node) { return node->parent; }
+
+    template <typename Visit>
+    static void forEachChild(Handle node, Visit visit) {
+        for (Node *child : node->children) visit(child);
+    }
+
+    static bool isLocked(Handle node) { return node->locked; }
+    void prefetch(int index) const { __builtin_prefetch(nodes[index]); }
+    static int owner(Handle node) { return node->userID; }
+
+    static void setLocked(Handle node, int userID) {
+        node->locked = true;
+        node->userID = userID;
+    }
+
+    static void setUnlocked(Handle node) {
+        node->locked = false;
+        node->userID = 0;
+    }
+};
+
+/**
+ * @brief Structure of arrays indexed by node: parents, children in one flat
+ * array (node i's are children[childStart[i] .. childStart[i + 1])), lock state.
+ */
+class SoAStorage {
+public:
+    using Handle = int;
+    static const bool levelRanges = false;
+    static const bool flatLockArrays = true;
+
+private:
+    std::vector<int> parents;
+    std::vector<int> childStart;
+    std::vector<int> children;
+    std::vector<int> userIDs;
+    std::vector<char> locked;
+
+public:
+    void build(int numChildren, int numNodes) {
+        std::vector<int> breadthFirst(numNodes, -1);
+        for (int i = 1; i < numNodes; i++) breadthFirst[i] = (i - 1) / numChildren;
+        build(breadthFirst);
+    }
+
+    void build(const std::vector<int>& parentIDs) {
+        int numNodes = (int)parentIDs.size();
+        parents = parentIDs;
+        childStart.assign(numNodes + 1, 0);
+        for (int i = 0; i < numNodes; i++)
+            if (parents[i] != -1) childStart[parents[i] + 1]++;
+        for (int i = 0; i < numNodes; i++) childStart[i + 1] += childStart[i];
+        children.resize(childStart[numNodes]);
+        std::vector<int> next(childStart.begin(), childStart.end() - 1);
+        for (int i = 0; i < numNodes; i++)
+            if (parents[i] != -1) children[next[parents[i]]++] = i; // Each node's children in index order.
+        userIDs.assign(numNodes, 0);
+        locked.assign(numNodes + 3, 0); // Padded for 4-byte gathers.
+    }
+
+    static Handle nil() { return -1; }
+    int size() const { return (int)parents.size(); }
+    static Handle handle(int index) { return index; }
+    static int index(Handle node) { return node; }
+    Handle parent(Handle node) const { return parents[node]; }
+
+    template <typename Visit>
+    void forEachChild(Handle node, Visit visit) const {
+        for (int i = childStart[node]; i < childStart[node + 1]; i++) visit(children[i]);
+    }
+
+    bool isLocked(Handle node) const { return locked[node]; }
+    void prefetch(int index) const {
+        __builtin_prefetch(&locked[index]);
+        __builtin_prefetch(&userIDs[index]);
+    }
+    int owner(Handle node) const { return userIDs[node]; }
+    const char *lockedData() const { return locked.data(); }
+    const int *ownerData() const { return userIDs.data(); }
+
+    void setLocked(Handle node, int userID) {
+        locked[node] = 1;
+        userIDs[node] = userID;
+    }
+
+    void setUnlocked(Handle node) {
+        locked[node] = 0;
+        userIDs[node] = 0;
+    }
+};
+
+/**
+ * @brief Complete M-ary tree in breadth-first order: the topology is computed
+ * from the index, only the lock state is stored. Arity is M when it is a
+ * compile-time constant, or 0 to take it from build().
+ */
+template <int Arity>
+class BasicImplicitStorage {
+public:
+    using Handle = int;
+    static const bool levelRanges = true;
+    static const bool flatLockArrays = true;
+
+private:
+    int numChildren = Arity;
+    std::vector<int> userIDs;
+    std::vector<char> locked;
+
+    int arity() const { return Arity ? Arity : numChildren; }
+
+public:
+    void build(int children, int numNodes) {
+        numChildren = children;
+        userIDs.assign(numNodes, 0);
+        locked.assign(numNodes + 3, 0); // Padded for 4-byte gathers.
+    }
+
+    static Handle nil() { return -1; }
+    int size() const { return (int)userIDs.size(); }
+    static Handle handle(int index) { return index; }
+    static int index(Handle node) { return node; }
+    Handle parent(Handle node) const { return node == 0 ? -1 : (node - 1) / arity(); }
+
+    template <typename Visit>
+    void forEachChild(Handle node, Visit visit) const {
+        long first = (long)node * arity() + 1;
+        if (first + arity() <= size()) {
+            for (int k = 0; k < arity(); k++) visit((int)(first + k)); // A full node: a constant trip count.
+            return;
+        }
+        for (long child = first; child < size(); child++) visit((int)child);
+    }
+
+    /**
+     * @brief The descendants of a node on the level below [first, last] are
+     * [first * M + 1, last * M + M], so each level is one contiguous range.
+     */
+    template <typename Visit>
+    void forEachLevelBelow(Handle node, Visit visit) const {
+        long first = node, last = node, numNodes = size();
+        while (true) {
+            first = first * arity() + 1;
+            last = last * arity() + arity();
+            if (first >= numNodes) return;
+            visit((int)first, (int)std::min(last + 1, numNodes));
+        }
+    }
+
+    bool isLocked(Handle node) const { return locked[node]; }
+    void prefetch(int index) const {
+        __builtin_prefetch(&locked[index]);
+        __builtin_prefetch(&userIDs[index]);
+    }
+    int owner(Handle node) const { return userIDs[node]; }
+    const char *lockedData() const { return locked.data(); }
+    const int *ownerData() const { return userIDs.data(); }
+
+    void setLocked(Handle node, int userID) {
+        locked[node] = 1;
+        userIDs[node] = userID;
+    }
+
+    void setUnlocked(Handle node) {
+        locked[node] = 0;
+        userIDs[node] = 0;
+    }
+};
+
+typedef BasicImplicitStorage<0> ImplicitStorage;
+
+/**
+ * @brief WithArity<Storage, M>::type is Storage specialised for a constant M
+ * where it has such a form, otherwise Storage itself.
+ */
+template <typename Storage, int M>
+struct WithArity {
+    typedef Storage type;
+};
+
+template <int Arity, int M>
+struct WithArity<BasicImplicitStorage<Arity>, M> {
+    typedef BasicImplicitStorage<M> type;
+};
+
+/**
+ * @brief Runtime dispatcher: calls visit(std::integral_constant<int, M>()) with
+ * M = numChildren for the specialised arities 2, 4, 8 and 16, and with M = 0
+ * (the generic, runtime-M version) for any other.
+ */
+template <typename Visit>
+void dispatchArity(int numChildren, Visit visit) {
+    switch (numChildren) {
+        case 2: visit(std::integral_constant<int, 2>()); break;
+        case 4: visit(std::integral_constant<int, 4>()); break;
+        case 8: visit(std::integral_constant<int, 8>()); break;
+        case 16: visit(std::integral_constant<int, 16>()); break;
+        default: visit(std::integral_constant<int, 0>()); break;
+    }
+}
+
+// ----------------------------------------------------------------------
+// 2. INDEX POLICIES
+// ----------------------------------------------------------------------
+
+/**
+ * An index policy provides, for any storage policy S:
+ *   build(s)
+ *   hasLockedAncestor(s, h), hasLockedDescendant(s, h)   (h itself excluded)
+ *   locked(s, h), unlocked(s, h)                          (after / before the storage change)
+ *   forEachLockedDescendant(s, h, visit)   visit(h) returns false to stop; returns false if stopped
+ *   prefetch(s, index)                     hints the cache to load what the checks read first
+ *   ownerSummaries                         true if descendantsOwnedBy(s, h, id) tells in O(1)
+ *                                          whether 'id' holds every locked descendant of h
+ */
+
+/**
+ * @brief Numbers the nodes in depth-first order: node x's subtree is the
+ * range [enter[x], leave[x]] and 'order' maps a position back to its node.
+ */
+template <typename Storage>
+void eulerTour(const Storage& storage, std::vector<int>& enter, std::vector<int>& leave, std::vector<int>& order) {
+    int numNodes = storage.size();
+    enter.assign(numNodes, 0);
+    leave.assign(numNodes, 0);
+    order.assign(numNodes, 0);
+    if (numNodes == 0) return;
+    std::vector<typename Storage::Handle> stack;
+    std::vector<typename Storage::Handle> reversed;
+    stack.push_back(storage.handle(0));
+    int position = 0;
+    while (!stack.empty()) {
+        typename Storage::Handle node = stack.back();
+        stack.pop_back();
+        enter[storage.index(node)] = position;
+        order[position++] = storage.index(node);
+        reversed.clear();
+        storage.forEachChild(node, [&](typename Storage::Handle child) { reversed.push_back(child); });
+        stack.insert(stack.end(), reversed.rbegin(), reversed.rend()); // Leftmost child first.
+    }
+    // Breadth-first numbering puts every child after its parent, so leave[] fills bottom-up.
+    for (int i = numNodes - 1; i >= 0; i--) {
+        typename Storage::Handle node = storage.handle(i);
+        leave[i] = enter[i];
+        storage.forEachChild(node, [&](typename Storage::Handle child) {
+            leave[i] = std::max(leave[i], leave[storage.index(child)]);
+        });
+    }
+}
+
+/**
+ * @brief The counters of locking-tree.h: per node, the number of locked
+ * ancestors and of locked descendants.
+ */
+class SubtreeBroadcastIndex {
+private:
+    std::vector<int> ancestorCounts;
+    std::vector<int> descendantCounts;
+
+protected:
+    int *ancestorLocked = nullptr;
+    int *descendantLocked = nullptr;
+
+    /**
+     * @brief Keeps the counters in arrays owned elsewhere (e.g. a shared
+     * segment) instead of allocating them in build().
+     */
+    void bind(int *ancestors, int *descendants) {
+        ancestorLocked = ancestors;
+        descendantLocked = descendants;
+    }
+
+private:
+
+    template <typename Storage>
+    void broadcast(const Storage& s, typename Storage::Handle node, int value, std::false_type) {
+        s.forEachChild(node, [&](typename Storage::Handle child) {
+            ancestorLocked[s.index(child)] += value;
+            broadcast(s, child, value, std::false_type());
+        });
+    }
+
+    /**
+     * @brief Level by level over contiguous ranges: plain loops the compiler vectorises.
+     */
+    template <typename Storage>
+    void broadcast(const Storage& s, typename Storage::Handle node, int value, std::true_type) {
+        int *counts = ancestorLocked;
+        s.forEachLevelBelow(node, [&](int first, int end) {
+            for (int i = first; i < end; i++) counts[i] += value;
+        });
+    }
+
+    template <typename Storage>
+    void propagate(const Storage& s, typename Storage::Handle node, int value) {
+        for (auto current = s.parent(node); current != s.nil(); current = s.parent(current))
+            descendantLocked[s.index(current)] += value;
+        broadcast(s, node, value, std::integral_constant<bool, Storage::levelRanges>());
+    }
+
+public:
+    static const bool ownerSummaries = false;
+
+    template <typename Storage>
+    void build(const Storage& s) {
+        ancestorCounts.assign(s.size(), 0);
+        descendantCounts.assign(s.size(), 0);
+        bind(ancestorCounts.data(), descendantCounts.data());
+    }
+
+    template <typename Storage>
+    bool hasLockedAncestor(const Storage& s, typename Storage::Handle node) const {
+        return ancestorLocked[s.index(node)] != 0;
+    }
+
+    template <typename Storage>
+    bool hasLockedDescendant(const Storage& s, typename Storage::Handle node) const {
+        return descendantLocked[s.index(node)] != 0;
+    }
+
+    template <typename Storage>
+    void locked(const Storage& s, typename Storage::Handle node) { propagate(s, node, 1); }
+
+    template <typename Storage>
+    void unlocked(const Storage& s, typename Storage::Handle node) { propagate(s, node, -1); }
+
+    template <typename Storage>
+    void prefetch(const Storage&, int index) const {
+        __builtin_prefetch(&ancestorLocked[index]);
+        __builtin_prefetch(&descendantLocked[index]);
+    }
+
+#ifdef __AVX2__
+    /**
+     * @brief The checks of eight operations (opcodes 1 lock, 2 unlock, 3
+     * upgrade, 0 none) on the current state, by gathers. Bit k is set if
+     * operation k passes them; an upgrade still has to find only the user's
+     * locks below it. Like the scalar checks, each gather only loads the
+     * lanes whose earlier checks passed. Needs a storage with flatLockArrays.
+     */
+    template <typename Storage>
+    unsigned checkEight(const Storage& s, const int *nodes, const int *opcodes, const int *users) const {
+        __m256i node = _mm256_loadu_si256((const __m256i *)nodes);
+        __m256i opcode = _mm256_loadu_si256((const __m256i *)opcodes);
+        __m256i zero = _mm256_setzero_si256();
+        __m256i isUnlock = _mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(2));
+        __m256i isUpgrade = _mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(3));
+        __m256i isLockOrUpgrade = _mm256_or_si256(_mm256_cmpeq_epi32(opcode, _mm256_set1_epi32(1)), isUpgrade);
+
+        __m256i flags = _mm256_i32gather_epi32((const int *)s.lockedData(), node, 1);
+        __m256i unlocked = _mm256_cmpeq_epi32(_mm256_and_si256(flags, _mm256_set1_epi32(0xFF)), zero);
+
+        __m256i wanted = _mm256_and_si256(unlocked, isLockOrUpgrade);
+        __m256i ancestors = _mm256_mask_i32gather_epi32(zero, ancestorLocked, node, wanted, 4);
+        wanted = _mm256_and_si256(wanted, _mm256_cmpeq_epi32(ancestors, zero));
+        __m256i descendants = _mm256_mask_i32gather_epi32(zero, descendantLocked, node, wanted, 4);
+        __m256i noDescendant = _mm256_cmpeq_epi32(descendants, zero);
+        // Lock wants no locked descendant, upgrade at least one.
+        __m256i freeOk = _mm256_and_si256(wanted, _mm256_xor_si256(noDescendant, isUpgrade));
+
+        __m256i unlockWanted = _mm256_andnot_si256(unlocked, isUnlock);
+        __m256i users8 = _mm256_loadu_si256((const __m256i *)users);
+        __m256i owners = _mm256_mask_i32gather_epi32(_mm256_xor_si256(users8, _mm256_set1_epi32(-1)), s.ownerData(), node, unlockWanted, 4);
+        __m256i unlockOk = _mm256_and_si256(unlockWanted, _mm256_cmpeq_epi32(owners, users8));
+
+        return (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(freeOk, unlockOk)));
+    }
+#endif
+
+    template <typename Storage, typename Visit>
+    bool forEachLockedDescendant(const Storage& s, typename Storage::Handle node, Visit& visit) const {
+        bool complete = true;
+        s.forEachChild(node, [&](typename Storage::Handle child) {
+            if (!complete) return;
+            if (s.isLocked(child)) complete = visit(child); // Locks never nest: nothing below it.
+            else if (descendantLocked[s.index(child)] != 0) complete = forEachLockedDescendant(s, child, visit);
+        });
+        return complete;
+    }
+};
+
+/**
+ * @brief SubtreeBroadcastIndex that also keeps, per node, the sum and the sum
+ * of squares of the owners of its locked descendants, and a version bumped
+ * with every change to the node's lock or counters. With c locked descendants
+ * whose owners sum to S and whose squares sum to Q, Q - 2 id S + c id^2 is
+ * the sum of (owner - id)^2, which is 0 exactly when every owner is 'id'.
+ */
+class OwnerSummaryIndex : public SubtreeBroadcastIndex {
+private:
+    std::vector<int64_t> ownerSum;
+    std::vector<__int128> ownerSquares; // 128 bits keep it exact.
+    std::vector<uint64_t> versions;
+
+    template <typename Storage>
+    void broadcast(const Storage& s, typename Storage::Handle node, int value) {
+        s.forEachChild(node, [&](typename Storage::Handle child) {
+            ancestorLocked[s.index(child)] += value;
+            versions[s.index(child)]++;
+            broadcast(s, child, value);
+        });
+    }
+
+    template <typename Storage>
+    void propagate(const Storage& s, typename Storage::Handle node, int value) {
+        int64_t owner = s.owner(node);
+        versions[s.index(node)]++;
+        for (auto current = s.parent(node); current != s.nil(); current = s.parent(current)) {
+            int i = s.index(current);
+            descendantLocked[i] += value;
+            ownerSum[i] += value * owner;
+            ownerSquares[i] += (__int128)value * owner * owner;
+            versions[i]++;
+        }
+        broadcast(s, node, value);
+    }
+
+public:
+    static const bool ownerSummaries = true;
+
+    template <typename Storage>
+    void build(const Storage& s) {
+        SubtreeBroadcastIndex::build(s);
+        ownerSum.assign(s.size(), 0);
+        ownerSquares.assign(s.size(), 0);
+        versions.assign(s.size(), 0);
+    }
+
+    template <typename Storage>
+    void locked(const Storage& s, typename Storage::Handle node) { propagate(s, node, 1); }
+
+    template <typename Storage>
+    void unlocked(const Storage& s, typename Storage::Handle node) { propagate(s, node, -1); }
+
+    template <typename Storage>
+    bool descendantsOwnedBy(const Storage& s, typename Storage::Handle node, int id) const {
+        int i = s.index(node);
+        __int128 count = descendantLocked[i];
+        return ownerSquares[i] - 2 * (__int128)id * ownerSum[i] + count * id * id == 0;
+    }
+
+    uint64_t version(int index) const { return versions[index]; }
+};
+
+/**
+ * @brief Fenwick (binary indexed) tree over positions 1..n.
+ */
+class Fenwick {
+private:
+    std::vector<int> tree;
+    int highBit = 0;
+
+public:
+    void reset(int n) {
+        tree.assign(n + 1, 0);
+        for (highBit = 1; highBit * 2 <= n; highBit *= 2) {}
+    }
+
+    void add(int position, int value) {
+        for (; position < (int)tree.size(); position += position & -position) tree[position] += value;
+    }
+
+    int prefix(int position) const {
+        int sum = 0;
+        for (; position > 0; position -= position & -position) sum += tree[position];
+        return sum;
+    }
+
+    /**
+     * @brief Smallest position whose prefix sum reaches 'target' (values are
+     * non-negative), or n + 1 if none does.
+     */
+    int lowerBound(int target) const {
+        int position = 0;
+        for (int step = highBit; step > 0; step /= 2) {
+            if (position + step < (int)tree.size() && tree[position + step] < target) {
+                position += step;
+                target -= tree[position];
+            }
+        }
+        return position + 1;
+    }
+};
+
+/**
+ * @brief Euler-tour index. 'covering' adds +1 over a locked node's whole
+ * range, so a point query counts the locked nodes containing it; 'points'
+ * adds +1 at its entry, so a range sum counts the locked nodes inside.
+ */
+class FenwickIndex {
+private:
+    std::vector<int> enter, leave, order;
+    Fenwick covering;
+    Fenwick points;
+
+    int lockedWithin(int first, int last) const { return points.prefix(last + 1) - points.prefix(first); }
+
+public:
+    static const bool ownerSummaries = false;
+
+    template <typename Storage>
+    void build(const Storage& s) {
+        eulerTour(s, enter, leave, order);
+        covering.reset(s.size() + 1);
+        points.reset(s.size());
+    }
+
+    template <typename Storage>
+    bool hasLockedAncestor(const Storage& s, typename Storage::Handle node) const {
+        return covering.prefix(enter[s.index(node)] + 1) - (s.isLocked(node) ? 1 : 0) != 0;
+    }
+
+    template <typename Storage>
+    bool hasLockedDescendant(const Storage& s, typename Storage::Handle node) const {
+        int i = s.index(node);
+        return lockedWithin(enter[i] + 1, leave[i]) != 0;
+    }
+
+    template <typename Storage>
+    void prefetch(const Storage&, int index) const {
+        __builtin_prefetch(&enter[index]);
+        __builtin_prefetch(&leave[index]);
+    }
+
+    template <typename Storage>
+    void locked(const Storage& s, typename Storage::Handle node) {
+        int i = s.index(node);
+        covering.add(enter[i] + 1, 1);
+        covering.add(leave[i] + 2, -1);
+        points.add(enter[i] + 1, 1);
+    }
+
+    template <typename Storage>
+    void unlocked(const Storage& s, typename Storage::Handle node) {
+        int i = s.index(node);
+        covering.add(enter[i] + 1, -1);
+        covering.add(leave[i] + 2, 1);
+        points.add(enter[i] + 1, -1);
+    }
+
+    /**
+     * @brief Jumps from one locked descendant to the next in Euler order, O(log N) each.
+     */
+    template <typename Storage, typename Visit>
+    bool forEachLockedDescendant(const Storage& s, typename Storage::Handle node, Visit& visit) const {
+        int i = s.index(node);
+        int seen = points.prefix(enter[i] + 1);
+        while (true) {
+            int position = points.lowerBound(seen + 1); // 1-based position of the next locked node.
+            if (position - 1 > leave[i]) return true;
+            if (!visit(s.handle(order[position - 1]))) return false;
+            seen++;
+        }
+    }
+};
+
+/**
+ * @brief Ordered set of the Euler entries of the locked nodes. Locked nodes
+ * never nest, so their ranges are disjoint: a node's only possible locked
+ * ancestor is the locked node entered last before it.
+ */
+class IntervalIndex {
+private:
+    std::vector<int> enter, leave, order;
+    std::set<int> lockedEntries;
+
+public:
+    static const bool ownerSummaries = false;
+
+    template <typename Storage>
+    void build(const Storage& s) {
+        eulerTour(s, enter, leave, order);
+        lockedEntries.clear();
+    }
+
+    template <typename Storage>
+    bool hasLockedAncestor(const Storage& s, typename Storage::Handle node) const {
+        int i = s.index(node);
+        auto it = lockedEntries.lower_bound(enter[i]);
+        if (it == lockedEntries.begin()) return false;
+        return leave[order[*--it]] >= enter[i];
+    }
+
+    template <typename Storage>
+    bool hasLockedDescendant(const Storage& s, typename Storage::Handle node) const {
+        int i = s.index(node);
+        auto it = lockedEntries.upper_bound(enter[i]);
+        return it != lockedEntries.end() && *it <= leave[i];
+    }
+
+    template <typename Storage>
+    void prefetch(const Storage&, int index) const {
+        __builtin_prefetch(&enter[index]);
+        __builtin_prefetch(&leave[index]);
+    }
+
+    template <typename Storage>
+    void locked(const Storage& s, typename Storage::Handle node) { lockedEntries.insert(enter[s.index(node)]); }
+
+    template <typename Storage>
+    void unlocked(const Storage& s, typename Storage::Handle node) { lockedEntries.erase(enter[s.index(node)]); }
+
+    template <typename Storage, typename Visit>
+    bool forEachLockedDescendant(const Storage& s, typename Storage::Handle node, Visit& visit) const {
+        int i = s.index(node);
+        for (auto it = lockedEntries.upper_bound(enter[i]); it != lockedEntries.end() && *it <= leave[i]; ++it)
+            if (!visit(s.handle(order[*it]))) return false;
+        return true;
+    }
+};
+
+/**
+ * @brief Bit-parallel index for small trees (at most MAX_NODES nodes). Every
+ * node has a bitmask of its descendants and one of its ancestors, and the
+ * locked nodes form one more, so each check is an AND of two bit arrays
+ * (with AVX2, a 256-bit VPTEST per four words). A mask is stored only over
+ * the 4-word groups between its first and last set bit, so a leaf's empty
+ * descendant mask costs nothing to test.
+ */
+class BitmaskIndex {
+public:
+    static const int MAX_NODES = 4096;
+    static const bool ownerSummaries = false;
+
+private:
+    /**
+     * @brief Words [first, end) of a mask, stored at packed[offset]; first and
+     * end are multiples of 4.
+     */
+    struct Span {
+        int offset, first, end;
+    };
+
+    std::vector<Span> descendantSpans, ancestorSpans;
+    std::vector<uint64_t> packed;
+    std::vector<uint64_t> lockedBits; // A multiple of 4 words.
+
+    /**
+     * @brief Whether a & b has a set bit in their first 'count' words (a multiple of 4).
+     */
+    static bool intersects(const uint64_t *a, const uint64_t *b, int count) {
+#ifdef __AVX2__
+        for (int w = 0; w < count; w += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + w));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + w));
+            if (!_mm256_testz_si256(x, y)) return true;
+        }
+        return false;
+#else
+        uint64_t any = 0;
+        for (int w = 0; w < count; w++) any |= a[w] & b[w];
+        return any != 0;
+#endif
+    }
+
+    bool intersectsLocked(const Span& span) const {
+        return intersects(lockedBits.data() + span.first, packed.data() + span.offset, span.end - span.first);
+    }
+
+    Span pack(const uint64_t *mask, int words) {
+        int first = 0, end = words;
+        while (first < end && mask[first] == 0) first++;
+        while (end > first && mask[end - 1] == 0) end--;
+        first = first / 4 * 4;
+        end = (end + 3) / 4 * 4;
+        Span span = {(int)packed.size(), first, end};
+        packed.insert(packed.end(), mask + first, mask + end);
+        return span;
+    }
+
+public:
+    template <typename Storage>
+    void build(const Storage& s) {
+        int numNodes = s.size();
+        if (numNodes > MAX_NODES) throw std::length_error("BitmaskIndex: more than MAX_NODES nodes");
+        int words = ((numNodes + 63) / 64 + 3) / 4 * 4;
+        std::vector<uint64_t> descendants((size_t)numNodes * words, 0), ancestors((size_t)numNodes * words, 0);
+        // Parents come before their children: ancestors fill top-down, descendants bottom-up.
+        for (int i = 0; i < numNodes; i++) {
+            auto parent = s.parent(s.handle(i));
+            if (parent == s.nil()) continue;
+            int p = s.index(parent);
+            std::copy(&ancestors[(size_t)p * words], &ancestors[(size_t)(p + 1) * words], &ancestors[(size_t)i * words]);
+            ancestors[(size_t)i * words + p / 64] |= uint64_t(1) << (p % 64);
+        }
+        for (int i = numNodes - 1; i >= 0; i--) {
+            auto parent = s.parent(s.handle(i));
+            if (parent == s.nil()) continue;
+            int p = s.index(parent);
+            for (int w = i / 64; w < words; w++) descendants[(size_t)p * words + w] |= descendants[(size_t)i * words + w];
+            descendants[(size_t)p * words + i / 64] |= uint64_t(1) << (i % 64);
+        }
+        packed.clear();
+        descendantSpans.resize(numNodes);
+        ancestorSpans.resize(numNodes);
+        for (int i = 0; i < numNodes; i++) {
+            descendantSpans[i] = pack(&descendants[(size_t)i * words], words);
+            ancestorSpans[i] = pack(&ancestors[(size_t)i * words], words);
+        }
+        packed.shrink_to_fit();
+        lockedBits.assign(words, 0);
+    }
+
+    template <typename Storage>
+    bool hasLockedAncestor(const Storage& s, typename Storage::Handle node) const {
+        return intersectsLocked(ancestorSpans[s.index(node)]);
+    }
+
+    template <typename Storage>
+    bool hasLockedDescendant(const Storage& s, typename Storage::Handle node) const {
+        return intersectsLocked(descendantSpans[s.index(node)]);
+    }
+
+    template <typename Storage>
+    void prefetch(const Storage&, int index) const {
+        __builtin_prefetch(&descendantSpans[index]);
+        __builtin_prefetch(&ancestorSpans[index]);
+    }
+
+    template <typename Storage>
+    void locked(const Storage& s, typename Storage::Handle node) {
+        int i = s.index(node);
+        lockedBits[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    template <typename Storage>
+    void unlocked(const Storage& s, typename Storage::Handle node) {
+        int i = s.index(node);
+        lockedBits[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+
+    template <typename Storage, typename Visit>
+    bool forEachLockedDescendant(const Storage& s, typename Storage::Handle node, Visit& visit) const {
+        const Span& span = descendantSpans[s.index(node)];
+        const uint64_t *mask = packed.data() + span.offset - span.first;
+        for (int w = span.first; w < span.end; w++) {
+            for (uint64_t bits = lockedBits[w] & mask[w]; bits != 0; bits &= bits - 1)
+                if (!visit(s.handle(w * 64 + __builtin_ctzll(bits)))) return false;
+        }
+        return true;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 3. SYNCHRONISATION POLICIES
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Single-threaded use: no synchronisation at all.
+ */
+struct NoSync {
+    void lock() {}
+    void unlock() {}
+};
+
+class MutexSync {
+private:
+    std::mutex mutex;
+
+public:
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+};
+
+/**
+ * @brief Test-and-test-and-set spinlock: waiters spin on a plain load, so
+ * the cache line is only written when the lock looks free.
+ */
+class SpinSync {
+private:
+    std::atomic<bool> held{false};
+
+public:
+    void lock() {
+        while (held.exchange(true, std::memory_order_acquire))
+            while (held.load(std::memory_order_relaxed)) __builtin_ia32_pause();
+    }
+
+    void unlock() { held.store(false, std::memory_order_release); }
+};
+
+/**
+ * @brief Ticket lock built from two atomic counters: threads are served in
+ * arrival order. (Atomic counters per node, as in thread-safe-atomic-ds.cpp,
+ * cannot keep a multi-node update consistent, so the operations stay serialised.)
+ */
+class AtomicSync {
+private:
+    std::atomic<unsigned> nextTicket{0};
+    std::atomic<unsigned> nowServing{0};
+
+public:
+    void lock() {
+        unsigned ticket = nextTicket.fetch_add(1, std::memory_order_relaxed);
+        while (nowServing.load(std::memory_order_acquire) != ticket) __builtin_ia32_pause();
+    }
+
+    void unlock() { nowServing.store(nowServing.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+};
+
+// ----------------------------------------------------------------------
+// 4. OBSERVER POLICIES
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Why a lock/unlock/upgrade attempt on a node was rejected.
+ */
+enum FailReason {
+    FAIL_SELF_LOCKED,        // The node itself is already locked.
+    FAIL_ANCESTOR_LOCKED,    // Some ancestor holds a lock.
+    FAIL_DESCENDANT_LOCKED,  // Some descendant holds a lock.
+    FAIL_WRONG_OWNER,        // Locked by a different user.
+    FAIL_NOT_LOCKED,         // Unlock of a node that is not locked.
+    FAIL_NOTHING_TO_UPGRADE, // Upgrade of a node with no locked descendant.
+    NUM_FAIL_REASONS
+};
+
+static const char *const failReasonNames[NUM_FAIL_REASONS] = {
+    "self", "ancestor", "descendant", "owner", "unlocked", "nothing"};
+
+/**
+ * An observer policy provides:
+ *   enabled                 false if it records nothing
+ *   build(numNodes)
+ *   Operation<OPCODE>       constructed as (observer, label, userID) for each
+ *                           operation (1 lock, 2 unlock, 3 upgrade) and destroyed
+ *                           when it returns; a single call constructs it before
+ *                           taking the sync policy, so it also spans the wait.
+ *                           The tree then calls, under the sync policy:
+ *     attempt(nodeIndex)                      first, unless the node is unknown
+ *     failed(nodeIndex, reason)               when a check rejects the operation
+ *     updateStart(nodeIndex, delta), updateEnd(nodeIndex, delta)
+ *                                             around the writes of a lock (delta
+ *                                             +1) or an unlock (-1): the node's
+ *                                             lock state and the index
+ *     locked(nodeIndex), unlocked(nodeIndex)  for each lock taken or released
+ *     succeeded()                             last, if the operation succeeded
+ */
+struct NoObserver {
+    static const bool enabled = false;
+
+    void build(int) {}
+
+    template <int OPCODE>
+    struct Operation {
+        Operation() = default;
+        Operation(NoObserver&, const std::string&, int) {}
+
+        void attempt(int) {}
+        void failed(int, FailReason) {}
+        void updateStart(int, int) {}
+        void updateEnd(int, int) {}
+        void locked(int) {}
+        void unlocked(int) {}
+        void succeeded() {}
+    };
+};
+
+// ----------------------------------------------------------------------
+// 5. LOCKING TREE
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Label -> node index map with linear probing over one flat slot
+ * array, so a lookup can be split into stages: hash(), prefetch() of the
+ * home slot, candidate() (the first slot with a matching tag), and
+ * matches() on the label itself; find() runs them all.
+ */
+class LabelTable {
+private:
+    struct Slot {
+        uint32_t tag;
+        int index; // -1: empty.
+    };
+
+    std::vector<Slot> slots = std::vector<Slot>(1, Slot{0, -1});
+    size_t mask = 0;
+    std::vector<std::string> labels;
+    std::string unknown;
+
+    static uint32_t tagOf(size_t hash) { return (uint32_t)(hash >> 32) | 1; }
+
+public:
+    void build(const std::vector<std::string>& nodeLabels) {
+        size_t capacity = 1;
+        while (capacity < nodeLabels.size() * 2) capacity *= 2;
+        slots.assign(capacity, Slot{0, -1});
+        mask = capacity - 1;
+        labels = nodeLabels;
+        for (int i = 0; i < (int)labels.size(); i++) {
+            size_t h = hash(labels[i]);
+            size_t position = h & mask;
+            while (slots[position].index >= 0 && labels[slots[position].index] != labels[i]) position = (position + 1) & mask;
+            slots[position] = Slot{tagOf(h), i}; // A repeated label maps to its last node.
+        }
+    }
+
+    static size_t hash(const std::string& label) { return std::hash<std::string>()(label); }
+
+    void prefetch(size_t hash) const { __builtin_prefetch(&slots[hash & mask]); }
+
+    /**
+     * @brief The node of the first slot in the probe sequence whose tag
+     * matches, or -1 if an empty slot comes first.
+     */
+    int candidate(size_t hash) const {
+        uint32_t tag = tagOf(hash);
+        for (size_t position = hash & mask; slots[position].index >= 0; position = (position + 1) & mask)
+            if (slots[position].tag == tag) return slots[position].index;
+        return -1;
+    }
+
+    void prefetchLabel(int index) const { __builtin_prefetch(&labels[index]); }
+    bool matches(int index, const std::string& label) const { return labels[index] == label; }
+
+    int find(const std::string& label, size_t hash) const {
+        uint32_t tag = tagOf(hash);
+        for (size_t position = hash & mask; slots[position].index >= 0; position = (position + 1) & mask) {
+            const Slot& slot = slots[position];
+            if (slot.tag == tag && labels[slot.index] == label) return slot.index;
+        }
+        return -1;
+    }
+
+    int find(const std::string& label) const { return find(label, hash(label)); }
+
+    /**
+     * @brief The label of node 'index', or an empty string if it has none.
+     */
+    const std::string& label(int index) const { return (size_t)index < labels.size() ? labels[index] : unknown; }
+};
+
+template <typename StoragePolicy, typename IndexPolicy, typename SyncPolicy, typename ObserverPolicy = NoObserver>
+class LockingTree {
+private:
+    using Handle = typename StoragePolicy::Handle;
+    template <int OPCODE>
+    using Observed = typename ObserverPolicy::template Operation<OPCODE>;
+    using Unobserved = NoObserver::Operation<0>; // For restore(), which is not an operation.
+
+    LabelTable labelToID;
+    std::vector<Handle> lockedDescendants; // Upgrade scratch, reused.
+    int numLocked = 0;
+
+    class Guard {
+    private:
+        SyncPolicy& sync;
+
+    public:
+        explicit Guard(SyncPolicy& policy) : sync(policy) { sync.lock(); }
+        ~Guard() { sync.unlock(); }
+    };
+
+    void prepare() {
+        index.build(storage);
+        observer.build(size());
+        lockedDescendants.reserve(size()); // So that no upgrade ever allocates.
+    }
+
+    template <typename Operation>
+    void lockHandle(Handle node, int userID, Operation& observed) {
+        int nodeIndex = storage.index(node);
+        observed.updateStart(nodeIndex, 1);
+        storage.setLocked(node, userID);
+        index.locked(storage, node);
+        observed.updateEnd(nodeIndex, 1);
+        observed.locked(nodeIndex);
+        numLocked++;
+    }
+
+    template <typename Operation>
+    void unlockHandle(Handle node, Operation& observed) {
+        int nodeIndex = storage.index(node);
+        observed.updateStart(nodeIndex, -1);
+        index.unlocked(storage, node);
+        storage.setUnlocked(node);
+        observed.updateEnd(nodeIndex, -1);
+        observed.unlocked(nodeIndex);
+        numLocked--;
+    }
+
+    template <typename Operation>
+    bool reject(Handle node, FailReason reason, Operation& observed) {
+        observed.failed(storage.index(node), reason);
+        return false;
+    }
+
+    bool ownsDescendants(Handle node, int id, std::true_type) const { return index.descendantsOwnedBy(storage, node, id); }
+
+    bool ownsDescendants(Handle node, int id, std::false_type) const {
+        auto owned = [&](Handle descendant) { return storage.owner(descendant) == id; };
+        return index.forEachLockedDescendant(storage, node, owned);
+    }
+
+    /**
+     * @brief Collects the locked descendants of node into lockedDescendants,
+     * failing at the first one 'id' does not hold; with owner summaries that
+     * is known before the walk.
+     */
+    bool collectOwnDescendants(Handle node, int id, std::true_type) {
+        if (!ownsDescendants(node, id, std::true_type())) return false;
+        lockedDescendants.clear();
+        auto collect = [&](Handle descendant) {
+            lockedDescendants.push_back(descendant);
+            return true;
+        };
+        return index.forEachLockedDescendant(storage, node, collect);
+    }
+
+    bool collectOwnDescendants(Handle node, int id, std::false_type) {
+        lockedDescendants.clear();
+        auto collect = [&](Handle descendant) {
+            if (storage.owner(descendant) != id) return false;
+            lockedDescendants.push_back(descendant);
+            return true;
+        };
+        return index.forEachLockedDescendant(storage, node, collect);
+    }
+
+    template <typename Operation>
+    bool lockAt(Handle node, int id, Operation& observed) {
+        observed.attempt(storage.index(node));
+        if (storage.isLocked(node)) return reject(node, FAIL_SELF_LOCKED, observed);
+        if (index.hasLockedAncestor(storage, node)) return reject(node, FAIL_ANCESTOR_LOCKED, observed);
+        if (index.hasLockedDescendant(storage, node)) return reject(node, FAIL_DESCENDANT_LOCKED, observed);
+        lockHandle(node, id, observed);
+        observed.succeeded();
+        return true;
+    }
+
+    template <typename Operation>
+    bool unlockAt(Handle node, int id, Operation& observed) {
+        observed.attempt(storage.index(node));
+        if (!storage.isLocked(node)) return reject(node, FAIL_NOT_LOCKED, observed);
+        if (storage.owner(node) != id) return reject(node, FAIL_WRONG_OWNER, observed);
+        unlockHandle(node, observed);
+        observed.succeeded();
+        return true;
+    }
+
+    template <typename Operation>
+    bool upgradeAt(Handle node, int id, Operation& observed) {
+        observed.attempt(storage.index(node));
+        if (storage.isLocked(node)) return reject(node, FAIL_SELF_LOCKED, observed);
+        if (index.hasLockedAncestor(storage, node)) return reject(node, FAIL_ANCESTOR_LOCKED, observed);
+        if (!index.hasLockedDescendant(storage, node)) return reject(node, FAIL_NOTHING_TO_UPGRADE, observed);
+        if (!collectOwnDescendants(node, id, std::integral_constant<bool, IndexPolicy::ownerSummaries>()))
+            return reject(node, FAIL_WRONG_OWNER, observed);
+        for (Handle descendant : lockedDescendants) unlockHandle(descendant, observed);
+        lockHandle(node, id, observed);
+        observed.succeeded();
+        return true;
+    }
+
+    bool runAt(int nodeIndex, int opcode, int id) {
+        Handle node = storage.handle(nodeIndex);
+        switch (opcode) {
+            case 1: {
+                Observed<1> observed(observer, labelOf(nodeIndex), id);
+                return lockAt(node, id, observed);
+            }
+            case 2: {
+                Observed<2> observed(observer, labelOf(nodeIndex), id);
+                return unlockAt(node, id, observed);
+            }
+            case 3: {
+                Observed<3> observed(observer, labelOf(nodeIndex), id);
+                return upgradeAt(node, id, observed);
+            }
+        }
+        return false;
+    }
+
+    template <typename Op>
+    bool runOne(const Op& op) {
+        if ((uint32_t)op.node >= (uint32_t)size()) return false;
+        return runAt((int)op.node, op.opcode, op.user);
+    }
+
+    template <typename Op>
+    size_t runSequential(const Op *ops, size_t count, uint8_t *results) {
+        size_t succeeded = 0;
+        for (size_t i = 0; i < count; i++) {
+            results[i] = runOne(ops[i]);
+            succeeded += results[i];
+        }
+        return succeeded;
+    }
+
+    template <typename Op>
+    size_t runBatch(const Op *ops, size_t count, uint8_t *results, std::false_type) {
+        return runSequential(ops, count, results);
+    }
+
+#ifdef __AVX2__
+    template <typename Op>
+    size_t runBatch(const Op *ops, size_t count, uint8_t *results, std::true_type) {
+        size_t succeeded = 0;
+        size_t i = 0;
+        int nodes[8], opcodes[8], users[8];
+        while (i < count) {
+            int group = (int)std::min<size_t>(8, count - i);
+            for (int k = 0; k < 8; k++) {
+                bool valid = k < group && (uint32_t)ops[i + k].node < (uint32_t)size();
+                nodes[k] = valid ? (int)ops[i + k].node : 0; // Lanes without an operation read node 0.
+                opcodes[k] = valid ? ops[i + k].opcode : 0;
+                users[k] = valid ? ops[i + k].user : 0;
+            }
+            unsigned pass = index.checkEight(storage, nodes, opcodes, users);
+            int failed = pass ? __builtin_ctz(pass) : group;
+            for (int k = 0; k < failed; k++) results[i + k] = 0;
+            i += failed;
+            if (failed == group) continue;
+            // While most operations pass, a gather is mostly wasted: run the next group one by one.
+            size_t end = failed < 2 ? std::min(count, i + 8) : i + 1;
+            for (; i < end; i++) {
+                results[i] = runOne(ops[i]);
+                succeeded += results[i];
+            }
+        }
+        return succeeded;
+    }
+#endif
+
+protected:
+    StoragePolicy storage;
+    IndexPolicy index;
+    SyncPolicy sync;
+    ObserverPolicy observer;
+
+public:
+    LockingTree(int numChildren, const std::vector<std::string>& nodeLabels)
+        : LockingTree(numChildren, (int)nodeLabels.size()) {
+        labelToID.build(nodeLabels);
+    }
+
+    /**
+     * @brief A tree used by node index only: getIndex() finds nothing.
+     */
+    LockingTree(int numChildren, int numNodes) {
+        storage.build(numChildren, numNodes);
+        prepare();
+    }
+
+    /**
+     * @brief A tree of whatever shape the storage policy's build(shape)
+     * takes, e.g. each node's parent index for SoAStorage.
+     */
+    template <typename Shape>
+    LockingTree(const std::vector<std::string>& nodeLabels, const Shape& shape) {
+        storage.build(shape);
+        prepare();
+        labelToID.build(nodeLabels);
+    }
+
+    LockingTree(const LockingTree&) = delete;
+    LockingTree& operator=(const LockingTree&) = delete;
+
+    static const int GATHER_MAX_NODES = 16384;
+    static const size_t PIPELINE_DISTANCE = 8;
+
+    int size() const { return storage.size(); }
+    int lockCount() const { return numLocked; }
+
+    /**
+     * @brief Calls visit(nodeIndex, userID) for every locked node, in index order.
+     */
+    template <typename Visit>
+    void forEachLock(Visit visit) const {
+        for (int i = 0; i < size(); i++) {
+            Handle node = storage.handle(i);
+            if (storage.isLocked(node)) visit(i, storage.owner(node));
+        }
+    }
+
+    /**
+     * @brief Index of the node labelled 'label', or -1.
+     */
+    int getIndex(const std::string& label) const { return labelToID.find(label); }
+
+    bool validIndex(int nodeIndex) const { return nodeIndex >= 0 && nodeIndex < size(); }
+
+    /**
+     * @brief The label of nodeIndex, or an empty string for an invalid index.
+     */
+    const std::string& labelOf(int nodeIndex) const { return labelToID.label(nodeIndex); }
+
+    /**
+     * @brief Read-only views of the structure and lock state. They take no
+     * lock, so callers must serialise them with the operations (as the lock
+     * server's single event loop does).
+     */
+    int parentOf(int nodeIndex) const {
+        Handle parent = storage.parent(storage.handle(nodeIndex));
+        return parent == storage.nil() ? -1 : storage.index(parent);
+    }
+
+    template <typename Visit>
+    void forEachChild(int nodeIndex, Visit visit) const {
+        storage.forEachChild(storage.handle(nodeIndex), [&](Handle child) { visit(storage.index(child)); });
+    }
+
+    bool isLocked(int nodeIndex) const { return storage.isLocked(storage.handle(nodeIndex)); }
+    bool hasLockedAncestor(int nodeIndex) const { return index.hasLockedAncestor(storage, storage.handle(nodeIndex)); }
+    bool hasLockedDescendant(int nodeIndex) const { return index.hasLockedDescendant(storage, storage.handle(nodeIndex)); }
+    int ownerOf(int nodeIndex) const { return isLocked(nodeIndex) ? storage.owner(storage.handle(nodeIndex)) : 0; }
+
+    /**
+     * @brief Whether the operation (1 lock, 2 unlock, 3 upgrade) would succeed
+     * now, without running it. Takes no lock, like the views above.
+     */
+    bool wouldSucceed(int opcode, int nodeIndex, int id) const {
+        if (!validIndex(nodeIndex)) return false;
+        Handle node = storage.handle(nodeIndex);
+        bool free = !storage.isLocked(node) && !index.hasLockedAncestor(storage, node);
+        switch (opcode) {
+            case 1: return free && !index.hasLockedDescendant(storage, node);
+            case 2: return storage.isLocked(node) && storage.owner(node) == id;
+            case 3:
+                return free && index.hasLockedDescendant(storage, node) &&
+                       ownsDescendants(node, id, std::integral_constant<bool, IndexPolicy::ownerSummaries>());
+        }
+        return false;
+    }
+
+    /**
+     * @brief Serialises the lock state: an (index, userID) pair of host-order
+     * int32s for every locked node. The index policy's state is not stored;
+     * restore() rebuilds it.
+     */
+    std::string snapshot() {
+        Guard guard(sync);
+        std::string data;
+        forEachLock([&](int nodeIndex, int userID) {
+            int32_t pair[2] = {nodeIndex, userID};
+            data.append((const char *)pair, sizeof(pair));
+        });
+        return data;
+    }
+
+    /**
+     * @brief Replaces the lock state with a snapshot() of a tree of the same shape.
+     * @return false, leaving every node unlocked, if it does not describe one.
+     */
+    bool restore(const std::string& data) {
+        Guard guard(sync);
+        Unobserved unobserved;
+        auto unlockAll = [&] {
+            forEachLock([&](int nodeIndex, int) { unlockHandle(storage.handle(nodeIndex), unobserved); });
+        };
+        unlockAll();
+        bool valid = data.size() % (2 * sizeof(int32_t)) == 0;
+        for (size_t offset = 0; valid && offset < data.size(); offset += 2 * sizeof(int32_t)) {
+            int32_t pair[2];
+            memcpy(pair, data.data() + offset, sizeof(pair));
+            // Locked nodes never nest, so each one must still be free and unblocked.
+            valid = validIndex(pair[0]) && lockAt(storage.handle(pair[0]), pair[1], unobserved);
+        }
+        if (!valid) unlockAll();
+        return valid;
+    }
+
+    bool lockNode(const std::string& label, int id) { return lockIndex(getIndex(label), id); }
+    bool unlockNode(const std::string& label, int id) { return unlockIndex(getIndex(label), id); }
+    bool upgradeNode(const std::string& label, int id) { return upgradeIndex(getIndex(label), id); }
+
+    /**
+     * @brief Locks the node if it, its ancestors and its descendants are all free.
+     */
+    bool lockIndex(int nodeIndex, int id) {
+        Observed<1> observed(observer, labelOf(nodeIndex), id);
+        if (!validIndex(nodeIndex)) return false;
+        Guard guard(sync);
+        return lockAt(storage.handle(nodeIndex), id, observed);
+    }
+
+    /**
+     * @brief Unlocks the node if user 'id' holds it.
+     */
+    bool unlockIndex(int nodeIndex, int id) {
+        Observed<2> observed(observer, labelOf(nodeIndex), id);
+        if (!validIndex(nodeIndex)) return false;
+        Guard guard(sync);
+        return unlockAt(storage.handle(nodeIndex), id, observed);
+    }
+
+    /**
+     * @brief Replaces the locks 'id' holds below a free node with one lock on
+     * it; fails unless there is at least one and 'id' holds them all. On
+     * success, the descendants it unlocked are stored in unlockedNodes if given.
+     */
+    bool upgradeIndex(int nodeIndex, int id, std::vector<int> *unlockedNodes = nullptr) {
+        Observed<3> observed(observer, labelOf(nodeIndex), id);
+        if (!validIndex(nodeIndex)) return false;
+        Guard guard(sync);
+        if (!upgradeAt(storage.handle(nodeIndex), id, observed)) return false;
+        if (unlockedNodes) {
+            unlockedNodes->clear(); // A caller that reuses its buffer does not allocate either.
+            for (Handle descendant : lockedDescendants) unlockedNodes->push_back(storage.index(descendant));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Runs ops[0 .. count) in order under one acquisition of the sync
+     * policy, with exactly the results of lockIndex(), unlockIndex() and
+     * upgradeIndex() called one by one (opcode 1, 2 and 3; any other fails).
+     * results[i] is set to 1 or 0; returns the number that succeeded. Op is any
+     * struct with opcode, node and user fields, such as the C API's tos_op.
+     *
+     * With SubtreeBroadcastIndex (or OwnerSummaryIndex) on flat lock arrays,
+     * AVX2 and no observer, the checks of the next eight operations are
+     * gathered at once. Every operation before
+     * the first that passes fails on the unchanged state, so those results
+     * are final; the one that passes runs normally, and the next eight are
+     * gathered after it. Only trees of up to GATHER_MAX_NODES are gathered:
+     * beyond that the lock arrays leave the cache, and the scalar checks,
+     * which stop at the first failing load, are faster.
+     */
+    template <typename Op>
+    size_t runBatch(const Op *ops, size_t count, uint8_t *results) {
+        Guard guard(sync);
+#ifdef __AVX2__
+        const bool gathered = std::is_base_of<SubtreeBroadcastIndex, IndexPolicy>::value && StoragePolicy::flatLockArrays &&
+                              !ObserverPolicy::enabled;
+#else
+        const bool gathered = false;
+#endif
+        if (size() == 0 || size() > GATHER_MAX_NODES) return runSequential(ops, count, results);
+        return runBatch(ops, count, results, std::integral_constant<bool, gathered>());
+    }
+
+    /**
+     * @brief Runs queries[0 .. count) in order under one acquisition of the
+     * sync policy, with the results of lockNode(), unlockNode() and
+     * upgradeNode() called one by one. Query is any struct with opcode,
+     * label (std::string) and user fields.
+     *
+     * The queries go through a software pipeline, each stage PIPELINE_DISTANCE
+     * queries ahead of the next: hash the label and prefetch its slot; read
+     * the slot and prefetch the label and the node's lock state; execute.
+     * The cache misses of a window of queries then overlap instead of
+     * following one another. Execution itself stays in order.
+     */
+    template <typename Query>
+    size_t runQueries(const Query *queries, size_t count, uint8_t *results) {
+        Guard guard(sync);
+        const size_t D = PIPELINE_DISTANCE;
+        size_t hashes[2 * PIPELINE_DISTANCE];
+        int candidates[2 * PIPELINE_DISTANCE];
+        size_t succeeded = 0;
+        // Stages run back to front, so a ring entry is read before it is reused.
+        for (size_t i = 0; i < count + 2 * D; i++) {
+            if (i >= 2 * D) {
+                size_t j = i - 2 * D;
+                const Query& query = queries[j];
+                int node = candidates[j % (2 * D)];
+                if (node >= 0 && !labelToID.matches(node, query.label)) node = labelToID.find(query.label, hashes[j % (2 * D)]);
+                results[j] = node >= 0 && runAt(node, query.opcode, query.user);
+                succeeded += results[j];
+            }
+            if (i >= D && i - D < count) {
+                size_t j = i - D;
+                int candidate = labelToID.candidate(hashes[j % (2 * D)]);
+                candidates[j % (2 * D)] = candidate;
+                if (candidate >= 0) {
+                    labelToID.prefetchLabel(candidate);
+                    storage.prefetch(candidate);
+                    index.prefetch(storage, candidate);
+                }
+            }
+            if (i < count) {
+                hashes[i % (2 * D)] = LabelTable::hash(queries[i].label);
+                labelToID.prefetch(hashes[i % (2 * D)]);
+            }
+        }
+        return succeeded;
+    }
+};
+
+// ----------------------------------------------------------------------
+// 6. ADAPTIVE LOCKING TREE
+// ----------------------------------------------------------------------
+
+/**
+ * @brief A LockingTree that picks its index policy at run time. It runs one
+ * engine at a time, SubtreeBroadcastIndex or FenwickIndex, on the same
+ * storage policy. Every operation is charged to both engines by a cost model
+ * in index steps (one counter, array slot or Fenwick level each):
+ *
+ *                          broadcast                    Euler (Fenwick)
+ *   checks, any operation  2                            3 log N
+ *   lock or unlock x       depth(x) + size(x) * step    3 log N
+ *   upgrade x, k released  twice that + k (depth(x)+1)  (2k + 1) 3 log N
+ *
+ * where size(x) counts x's subtree and 'step' is 1/4 for storages that visit
+ * a subtree as contiguous level ranges and 1 otherwise. So broadcast wins on
+ * shallow, wide trees and on failing operations, the Euler index on deep
+ * trees and on locks near the root.
+ *
+ * After every window of operations, if the other engine was estimated at
+ * most SWITCH_RATIO of the running one and its saving would repay the
+ * migration (O(N + locks)) within PAYBACK_WINDOWS windows, the locks are
+ * moved into a freshly built engine and the old one is freed. Each switch is
+ * logged to the stream set by logSwitchesTo() (std::cerr by default).
+ */
+template <typename StoragePolicy, typename SyncPolicy>
+class AdaptiveLockingTree {
+public:
+    enum Engine { BROADCAST, EULER };
+
+private:
+    using BroadcastTree = LockingTree<StoragePolicy, SubtreeBroadcastIndex, NoSync>;
+    using EulerTree = LockingTree<StoragePolicy, FenwickIndex, NoSync>;
+
+    static const int WINDOW = 4096;
+    static constexpr double SWITCH_RATIO = 0.7;
+    static const int PAYBACK_WINDOWS = 4;
+
+    int numChildren;
+    Engine engine;
+    std::unique_ptr<BroadcastTree> broadcastTree;
+    std::unique_ptr<EulerTree> eulerTree;
+    SyncPolicy sync;
+    std::unordered_map<std::string, int> labelToID;
+    std::ostream *log = &std::cerr;
+
+    // Shape statistics, fixed at construction.
+    std::vector<int> depth;
+    std::vector<int> subtreeSize;
+    double eulerSteps;     // 3 log N
+    double broadcastStep;  // Cost of one subtree slot.
+
+    // Workload statistics of the current window.
+    int windowOperations = 0;
+    double broadcastCost = 0;
+    double eulerCost = 0;
+    long long operations = 0;
+    int switches = 0;
+
+    double broadcastChange(int node) const { return depth[node] + subtreeSize[node] * broadcastStep; }
+
+    /**
+     * @brief Charges one operation on 'node' to both engines; 'released' is
+     * the number of locks an upgrade replaced.
+     */
+    void account(int opcode, int node, bool succeeded, int released) {
+        broadcastCost += 2;
+        eulerCost += eulerSteps;
+        if (succeeded) {
+            if (opcode == 3) {
+                broadcastCost += 2 * broadcastChange(node) + released * (depth[node] + 1.0);
+                eulerCost += (2 * released + 1) * eulerSteps;
+            } else {
+                broadcastCost += broadcastChange(node);
+                eulerCost += eulerSteps;
+            }
+        }
+        operations++;
+        if (++windowOperations == WINDOW) decide();
+    }
+
+    void decide() {
+        double current = engine == BROADCAST ? broadcastCost : eulerCost;
+        double other = engine == BROADCAST ? eulerCost : broadcastCost;
+        double migration = (double)depth.size() + lockCount() * eulerSteps;
+        if (other <= current * SWITCH_RATIO && (current - other) * PAYBACK_WINDOWS > migration) {
+            int moved = lockCount();
+            if (engine == BROADCAST) migrate(broadcastTree, eulerTree);
+            else migrate(eulerTree, broadcastTree);
+            engine = engine == BROADCAST ? EULER : BROADCAST;
+            switches++;
+            if (log) {
+                *log << "adaptive: " << engineName(engine == BROADCAST ? EULER : BROADCAST) << " -> "
+                     << engineName(engine) << " after " << operations << " operations (estimated "
+                     << other / windowOperations << " vs " << current / windowOperations
+                     << " steps per operation, " << moved << " locks moved)\n";
+            }
+        }
+        windowOperations = 0;
+        broadcastCost = eulerCost = 0;
+    }
+
+    template <typename From, typename To>
+    void migrate(std::unique_ptr<From>& from, std::unique_ptr<To>& to) {
+        to.reset(new To(numChildren, from->size()));
+        from->forEachLock([&](int nodeIndex, int userID) { to->lockIndex(nodeIndex, userID); }); // Locks never nest.
+        from.reset();
+    }
+
+    int lockCount() const { return engine == BROADCAST ? broadcastTree->lockCount() : eulerTree->lockCount(); }
+
+    template <typename Operation>
+    bool run(int opcode, int nodeIndex, Operation operation) {
+        if (nodeIndex < 0 || nodeIndex >= size()) return false;
+        std::lock_guard<SyncPolicy> guard(sync);
+        int before = lockCount();
+        bool result = engine == BROADCAST ? operation(*broadcastTree) : operation(*eulerTree);
+        account(opcode, nodeIndex, result, before - lockCount() + 1);
+        return result;
+    }
+
+public:
+    AdaptiveLockingTree(int numChildren, const std::vector<std::string>& nodeLabels)
+        : AdaptiveLockingTree(numChildren, (int)nodeLabels.size()) {
+        labelToID.reserve(nodeLabels.size());
+        for (int i = 0; i < (int)nodeLabels.size(); i++) labelToID[nodeLabels[i]] = i;
+    }
+
+    /**
+     * @brief Measures the shape and starts on the engine the cost model
+     * prefers for successful locks and unlocks on uniformly chosen nodes.
+     */
+    AdaptiveLockingTree(int numChildren, int numNodes) : numChildren(numChildren) {
+        StoragePolicy shape;
+        shape.build(numChildren, numNodes);
+        std::vector<int> enter, leave, order;
+        eulerTour(shape, enter, leave, order);
+        depth.assign(numNodes, 0);
+        subtreeSize.assign(numNodes, 0);
+        double meanChange = 0;
+        for (int i = 0; i < numNodes; i++) {
+            auto parent = shape.parent(shape.handle(i));
+            if (parent != shape.nil()) depth[i] = depth[shape.index(parent)] + 1; // Parents come first.
+            subtreeSize[i] = leave[i] - enter[i] + 1;
+        }
+        eulerSteps = 3 * std::log2(numNodes + 1.0);
+        broadcastStep = StoragePolicy::levelRanges ? 0.25 : 1;
+        for (int i = 0; i < numNodes; i++) meanChange += broadcastChange(i) / std::max(numNodes, 1);
+
+        engine = 2 + meanChange <= 2 * eulerSteps ? BROADCAST : EULER;
+        if (engine == BROADCAST) broadcastTree.reset(new BroadcastTree(numChildren, numNodes));
+        else eulerTree.reset(new EulerTree(numChildren, numNodes));
+    }
+
+    AdaptiveLockingTree(const AdaptiveLockingTree&) = delete;
+    AdaptiveLockingTree& operator=(const AdaptiveLockingTree&) = delete;
+
+    static const char *engineName(Engine engine) { return engine == BROADCAST ? "subtree-broadcast" : "euler-fenwick"; }
+
+    /**
+     * @brief Where switches are logged; nullptr turns logging off.
+     */
+    void logSwitchesTo(std::ostream *out) { log = out; }
+
+    Engine currentEngine() const { return engine; }
+    int switchCount() const { return switches; }
+    int size() const { return (int)depth.size(); }
+
+    int getIndex(const std::string& label) const {
+        auto it = labelToID.find(label);
+        return it == labelToID.end() ? -1 : it->second;
+    }
+
+    bool lockNode(const std::string& label, int id) { return lockIndex(getIndex(label), id); }
+    bool unlockNode(const std::string& label, int id) { return unlockIndex(getIndex(label), id); }
+    bool upgradeNode(const std::string& label, int id) { return upgradeIndex(getIndex(label), id); }
+
+    bool lockIndex(int nodeIndex, int id) {
+        return run(1, nodeIndex, [&](auto& tree) { return tree.lockIndex(nodeIndex, id); });
+    }
+
+    bool unlockIndex(int nodeIndex, int id) {
+        return run(2, nodeIndex, [&](auto& tree) { return tree.unlockIndex(nodeIndex, id); });
+    }
+
+    bool upgradeIndex(int nodeIndex, int id) {
+        return run(3, nodeIndex, [&](auto& tree) { return tree.upgradeIndex(nodeIndex, id); });
+    }
+
+    /**
+     * @brief LockingTree::runQueries() without the pipeline: each query is accounted one by one.
+     */
+    template <typename Query>
+    size_t runQueries(const Query *queries, size_t count, uint8_t *results) {
+        size_t succeeded = 0;
+        for (size_t i = 0; i < count; i++) {
+            const Query& query = queries[i];
+            switch (query.opcode) {
+                case 1: results[i] = lockNode(query.label, query.user); break;
+                case 2: results[i] = unlockNode(query.label, query.user); break;
+                case 3: results[i] = upgradeNode(query.label, query.user); break;
+                default: results[i] = false;
+            }
+            succeeded += results[i];
+        }
+        return succeeded;
+    }
+};
+
+} // namespace policy
+
+#endif // POLICY_LOCKING_TREE_H
@@ -0,0 +1,497 @@
+/**
+ * @file shared-locking-tree.h
+ * @brief The index-based LockingTree placed in a POSIX shared-memory segment so
+ * that co-located processes lock nodes directly, without an IPC round trip.
+ *
+ * Segment layout (all offsets are from the start of the segment, so every
+ * process may map it at a different address):
+ *
+ *   SharedTreeHeader
+ *   int32  parentID[numNodes]
+ *   int32  firstChild[numNodes], childCount[numNodes]   (BFS children are contiguous)
+ *   int32  ancestorLockedCount[numNodes], descendantLockedCount[numNodes]
+ *   int32  currentUserID[numNodes]
+ *   uint8  isNodeLocked[numNodes]
+ *   uint32 labelStart[numNodes + 1], then the label bytes
+ *
+ * The rules are policy::LockingTree's, over policies bound to the segment:
+ * the arrays above as storage and index, the segment's mutex as the sync
+ * policy and its pending-operation record as the observer.
+ *
+ * All operations run under one robust, process-shared pthread mutex (a kernel
+ * robust futex). If a process dies while holding it, the next locker gets
+ * EOWNERDEAD and repairs the table before carrying on: the dying operation is
+ * recorded in the header before its first write, so it is rolled forward, and
+ * the counters are then rebuilt from the lock flags in O(numNodes).
+ */
+#ifndef SHARED_LOCKING_TREE_H
+#define SHARED_LOCKING_TREE_H
+
+#include "locking-tree.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------
+// 1. SEGMENT LAYOUT
+// ----------------------------------------------------------------------
+
+static const char SHARED_TREE_MAGIC[4] = {'L', 'T', 'S', '1'};
+
+/**
+ * @brief The operation in progress, written before its first change to the
+ * table and cleared after its last one. opcode 0 means none.
+ */
+struct SharedPendingOp {
+    int32_t opcode;
+    int32_t nodeIndex;
+    int32_t userID;
+};
+
+struct SharedTreeHeader {
+    char magic[4];
+    uint32_t ready;          // Set (release) by the creator once the segment is initialised.
+    uint32_t numNodes;
+    uint32_t numChildren;
+    uint64_t labelHash;      // FNV-1a over the labels, so attachers can check they agree.
+    uint64_t segmentSize;
+    uint64_t parentOffset;
+    uint64_t firstChildOffset;
+    uint64_t childCountOffset;
+    uint64_t ancestorOffset;
+    uint64_t descendantOffset;
+    uint64_t ownerOffset;
+    uint64_t lockedOffset;
+    uint64_t labelStartOffset;
+    uint64_t labelBytesOffset;
+    uint64_t recoveries;     // Times the table was repaired after a holder died.
+    SharedPendingOp pending;
+    pthread_mutex_t mutex;
+};
+
+inline uint64_t hashLabels(const vector<string>& nodeLabels) {
+    uint64_t hash = 1469598103934665603ull;
+    for (const string& label : nodeLabels) {
+        for (unsigned char c : label) hash = (hash ^ c) * 1099511628211ull;
+        hash = (hash ^ 0xFF) * 1099511628211ull; // Separator, so "ab","c" differs from "a","bc".
+    }
+    return hash;
+}
+
+// ----------------------------------------------------------------------
+// 2. SEGMENT POLICIES
+// ----------------------------------------------------------------------
+
+/**
+ * @brief Storage policy over the segment's arrays. build() binds an
+ * initialised segment instead of allocating.
+ */
+class SegmentStorage {
+public:
+    using Handle = int;
+    static const bool levelRanges = false;
+    static const bool flatLockArrays = false;
+
+private:
+    SharedTreeHeader *header = nullptr;
+    int32_t *parentID = nullptr;
+    int32_t *firstChild = nullptr;
+    int32_t *childCount = nullptr;
+    int32_t *currentUserID = nullptr;
+    uint8_t *isNodeLocked = nullptr;
+
+public:
+    void build(SharedTreeHeader *segment) {
+        header = segment;
+        parentID = view<int32_t>(header->parentOffset);
+        firstChild = view<int32_t>(header->firstChildOffset);
+        childCount = view<int32_t>(header->childCountOffset);
+        currentUserID = view<int32_t>(header->ownerOffset);
+        isNodeLocked = view<uint8_t>(header->lockedOffset);
+    }
+
+    template <typename T>
+    T *view(uint64_t offset) const { return (T *)((char *)header + offset); }
+
+    SharedTreeHeader *segment() const { return header; }
+
+    static Handle nil() { return -1; }
+    int size() const { return header ? (int)header->numNodes : 0; }
+    static Handle handle(int index) { return index; }
+    static int index(Handle node) { return node; }
+    Handle parent(Handle node) const { return parentID[node]; }
+
+    template <typename Visit>
+    void forEachChild(Handle node, Visit visit) const {
+        for (int c = 0; c < childCount[node]; c++) visit(firstChild[node] + c);
+    }
+
+    bool isLocked(Handle node) const { return isNodeLocked[node]; }
+    int owner(Handle node) const { return currentUserID[node]; }
+
+    void setLocked(Handle node, int userID) {
+        currentUserID[node] = userID;
+        isNodeLocked[node] = 1;
+    }
+
+    void setUnlocked(Handle node) {
+        isNodeLocked[node] = 0;
+        currentUserID[node] = 0;
+    }
+
+    void prefetch(int index) const { __builtin_prefetch(&isNodeLocked[index]); }
+};
+
+/**
+ * @brief SubtreeBroadcastIndex with its counters in the segment.
+ */
+class SegmentIndex : public policy::SubtreeBroadcastIndex {
+public:
+    void build(const SegmentStorage& s) {
+        bind(s.view<int32_t>(s.segment()->ancestorOffset), s.view<int32_t>(s.segment()->descendantOffset));
+    }
+
+    /**
+     * @brief Recomputes both counters from the lock flags. BFS numbering puts
+     * every parent before its children, so one pass in each direction suffices.
+     */
+    void rebuild(const SegmentStorage& s) {
+        int numNodes = s.size();
+        for (int i = 0; i < numNodes; i++) {
+            int parent = s.parent(i);
+            ancestorLocked[i] = parent == -1 ? 0 : ancestorLocked[parent] + s.isLocked(parent);
+            descendantLocked[i] = 0;
+        }
+        for (int i = numNodes - 1; i > 0; i--) descendantLocked[s.parent(i)] += descendantLocked[i] + s.isLocked(i);
+    }
+};
+
+/**
+ * @brief Sync policy over the segment's robust mutex: a locker that finds
+ * the last holder dead runs the repair before carrying on.
+ */
+class RobustSync {
+private:
+    pthread_mutex_t *mutex = nullptr;
+    std::function<void()> repair;
+
+public:
+    void bind(pthread_mutex_t *segmentMutex, std::function<void()> repairTable) {
+        mutex = segmentMutex;
+        repair = std::move(repairTable);
+    }
+
+    void lock() {
+        int result = pthread_mutex_lock(mutex);
+        if (result == EOWNERDEAD) {
+            repair();
+            pthread_mutex_consistent(mutex);
+        } else if (result != 0) {
+            // ENOTRECOVERABLE: a holder released the mutex without repairing
+            // the table, which nothing here does. No operation can go on.
+            errno = result;
+            perror("shared tree: pthread_mutex_lock");
+            abort();
+        }
+    }
+
+    void unlock() { pthread_mutex_unlock(mutex); }
+};
+
+/**
+ * @brief Observer policy that writes the operation to the segment's pending
+ * record before its first change to the table and clears it after its last.
+ */
+class PendingJournal {
+private:
+    SharedPendingOp *pending = nullptr;
+
+public:
+    static const bool enabled = true;
+
+    void build(int) {}
+    void bind(SharedPendingOp *record) { pending = record; }
+
+    void begin(int opcode, int nodeIndex, int userID) {
+        pending->nodeIndex = nodeIndex;
+        pending->userID = userID;
+        __atomic_store_n(&pending->opcode, opcode, __ATOMIC_RELEASE);
+    }
+
+    void end() { __atomic_store_n(&pending->opcode, 0, __ATOMIC_RELEASE); }
+
+    SharedPendingOp current() const { return *pending; }
+
+    template <int OPCODE>
+    class Operation {
+    private:
+        PendingJournal& journal;
+        int userID;
+        int target = -1;
+        bool begun = false;
+
+    public:
+        Operation(PendingJournal& observer, const string&, int id) : journal(observer), userID(id) {}
+
+        void attempt(int nodeIndex) { target = nodeIndex; }
+        void failed(int, policy::FailReason) {}
+
+        void updateStart(int, int) {
+            if (begun) return;
+            journal.begin(OPCODE, target, userID);
+            begun = true;
+        }
+
+        void updateEnd(int, int) {}
+        void locked(int) {}
+        void unlocked(int) {}
+        void succeeded() { journal.end(); }
+    };
+};
+
+// ----------------------------------------------------------------------
+// 3. SHARED LOCKING TREE
+// ----------------------------------------------------------------------
+
+class SharedLockingTree {
+private:
+    /**
+     * @brief The rules over the mapped segment; repairs the table when the
+     * mutex reports that its last holder died.
+     */
+    class Engine : public policy::LockingTree<SegmentStorage, SegmentIndex, RobustSync, PendingJournal> {
+    private:
+        vector<int> scratch;
+
+    public:
+        Engine(const vector<string>& nodeLabels, SharedTreeHeader *header) : LockingTree(nodeLabels, header) {
+            observer.bind(&header->pending);
+            sync.bind(&header->mutex, [this] { recover(); });
+        }
+
+        /**
+         * @brief Rolls the interrupted operation forward on the lock flags,
+         * then rebuilds the counters from the flags.
+         */
+        void recover() {
+            SharedPendingOp pending = observer.current();
+            if (pending.opcode == 1) {
+                storage.setLocked(pending.nodeIndex, pending.userID);
+            } else if (pending.opcode == 2) {
+                storage.setUnlocked(pending.nodeIndex);
+            } else if (pending.opcode == 3) {
+                // The precondition held before the first write: every lock below
+                // the target belonged to userID, so all of them go.
+                scratch.assign(1, pending.nodeIndex);
+                while (!scratch.empty()) {
+                    int nodeIndex = scratch.back();
+                    scratch.pop_back();
+                    storage.setUnlocked(nodeIndex);
+                    storage.forEachChild(nodeIndex, [&](int child) { scratch.push_back(child); });
+                }
+                storage.setLocked(pending.nodeIndex, pending.userID);
+            }
+            for (int i = 0; i < size(); i++)
+                if (!storage.isLocked(i)) storage.setUnlocked(i);
+            index.rebuild(storage);
+            observer.end();
+            storage.segment()->recoveries++;
+        }
+    };
+
+    char *base = nullptr;
+    size_t mappedSize = 0;
+    SharedTreeHeader *header = nullptr;
+    unique_ptr<Engine> engine;
+
+    static uint64_t alignUp(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+    template <typename T>
+    T *at(uint64_t offset) const { return (T *)(base + offset); }
+
+    /**
+     * @brief Binds the rules to the segment, with the labels from its table.
+     */
+    void bindEngine() {
+        header = (SharedTreeHeader *)base;
+        int numNodes = header->numNodes;
+        const uint32_t *labelStart = at<uint32_t>(header->labelStartOffset);
+        const char *labelBytes = at<char>(header->labelBytesOffset);
+        vector<string> idToLabel(numNodes);
+        for (int i = 0; i < numNodes; i++)
+            idToLabel[i].assign(labelBytes + labelStart[i], labelStart[i + 1] - labelStart[i]);
+        engine.reset(new Engine(idToLabel, header));
+    }
+
+    /**
+     * @brief Lays out and initialises a freshly created (zero-filled) segment.
+     */
+    void initialise(int numChildren, const vector<string>& nodeLabels, const vector<int>& parents,
+                    const vector<vector<int>>& children, uint64_t labelBytes) {
+        int numNodes = nodeLabels.size();
+        header = (SharedTreeHeader *)base;
+        uint64_t offset = alignUp(sizeof(SharedTreeHeader));
+        auto reserve = [&](uint64_t bytes) { uint64_t at = offset; offset = alignUp(offset + bytes); return at; };
+        header->parentOffset = reserve(numNodes * sizeof(int32_t));
+        header->firstChildOffset = reserve(numNodes * sizeof(int32_t));
+        header->childCountOffset = reserve(numNodes * sizeof(int32_t));
+        header->ancestorOffset = reserve(numNodes * sizeof(int32_t));
+        header->descendantOffset = reserve(numNodes * sizeof(int32_t));
+        header->ownerOffset = reserve(numNodes * sizeof(int32_t));
+        header->lockedOffset = reserve(numNodes);
+        header->labelStartOffset = reserve((numNodes + 1) * sizeof(uint32_t));
+        header->labelBytesOffset = reserve(labelBytes);
+        header->segmentSize = offset;
+        header->numNodes = numNodes;
+        header->numChildren = numChildren;
+        header->labelHash = hashLabels(nodeLabels);
+
+        int32_t *parentView = at<int32_t>(header->parentOffset);
+        int32_t *firstView = at<int32_t>(header->firstChildOffset);
+        int32_t *countView = at<int32_t>(header->childCountOffset);
+        uint32_t *labelStart = at<uint32_t>(header->labelStartOffset);
+        char *labelView = at<char>(header->labelBytesOffset);
+        uint32_t labelOffset = 0;
+        for (int i = 0; i < numNodes; i++) {
+            parentView[i] = parents[i];
+            firstView[i] = children[i].empty() ? 0 : children[i][0];
+            countView[i] = children[i].size();
+            labelStart[i] = labelOffset;
+            memcpy(labelView + labelOffset, nodeLabels[i].data(), nodeLabels[i].size());
+            labelOffset += nodeLabels[i].size();
+        }
+        labelStart[numNodes] = labelOffset;
+
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+
+        memcpy(header->magic, SHARED_TREE_MAGIC, sizeof(SHARED_TREE_MAGIC));
+        __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    }
+
+    static uint64_t segmentBytes(int numNodes, uint64_t labelBytes) {
+        return alignUp(sizeof(SharedTreeHeader)) + 6 * alignUp(numNodes * sizeof(int32_t)) +
+               alignUp(numNodes) + alignUp((numNodes + 1) * sizeof(uint32_t)) + alignUp(labelBytes);
+    }
+
+public:
+    SharedLockingTree() = default;
+    SharedLockingTree(const SharedLockingTree&) = delete;
+    SharedLockingTree& operator=(const SharedLockingTree&) = delete;
+
+    ~SharedLockingTree() {
+        if (base) munmap(base, mappedSize);
+    }
+
+    /**
+     * @brief Attaches to the segment 'name' (e.g. "/tree-of-space"), creating and
+     * initialising it from the tree description if it does not exist yet.
+     * Fails if an existing segment holds a different tree.
+     */
+    bool open(const string& name, int numChildren, const vector<string>& nodeLabels) {
+        uint64_t labelBytes = 0;
+        for (const string& label : nodeLabels) labelBytes += label.size();
+
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            vector<int> parents;
+            vector<vector<int>> children;
+            unordered_map<string, int> labels;
+            vector<string> ids;
+            buildTree(numChildren, nodeLabels, parents, children, labels, ids);
+
+            mappedSize = segmentBytes(nodeLabels.size(), labelBytes);
+            if (ftruncate(fd, mappedSize) < 0) {
+                perror("shared tree: ftruncate");
+                close(fd);
+                shm_unlink(name.c_str());
+                return false;
+            }
+            base = (char *)mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                perror("shared tree: mmap");
+                base = nullptr;
+                shm_unlink(name.c_str());
+                return false;
+            }
+            initialise(numChildren, nodeLabels, parents, children, labelBytes);
+            bindEngine();
+            return true;
+        }
+        if (errno != EEXIST || (fd = shm_open(name.c_str(), O_RDWR, 0)) < 0) {
+            perror("shared tree: shm_open");
+            return false;
+        }
+
+        // The creator sizes the segment, then initialises it: wait for both.
+        struct stat info;
+        for (int tries = 0; (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(SharedTreeHeader)); tries++) {
+            if (tries == 1000) {
+                cerr << "shared tree: " << name << " was never initialised\n";
+                close(fd);
+                return false;
+            }
+            usleep(1000);
+        }
+        mappedSize = info.st_size;
+        base = (char *)mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            perror("shared tree: mmap");
+            base = nullptr;
+            return false;
+        }
+        header = (SharedTreeHeader *)base;
+        for (int tries = 0; !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE); tries++) {
+            if (tries == 1000) {
+                cerr << "shared tree: " << name << " was never initialised\n";
+                return false;
+            }
+            usleep(1000);
+        }
+        if (memcmp(header->magic, SHARED_TREE_MAGIC, sizeof(SHARED_TREE_MAGIC)) != 0 ||
+            header->segmentSize != mappedSize || header->numNodes != nodeLabels.size() ||
+            header->numChildren != (uint32_t)numChildren || header->labelHash != hashLabels(nodeLabels)) {
+            cerr << "shared tree: " << name << " holds a different tree\n";
+            return false;
+        }
+        bindEngine();
+        return true;
+    }
+
+    /**
+     * @brief Removes the segment name; processes already attached keep their mapping.
+     */
+    static void unlink(const string& name) { shm_unlink(name.c_str()); }
+
+    int size() const { return engine ? engine->size() : 0; }
+
+    bool validIndex(int nodeIndex) const { return nodeIndex >= 0 && nodeIndex < size(); }
+
+    int getIndex(const string& label) const { return engine ? engine->getIndex(label) : -1; }
+
+    uint64_t recoveries() const { return __atomic_load_n(&header->recoveries, __ATOMIC_RELAXED); }
+
+    bool lockNode(const string& label, int id) { return lockIndex(getIndex(label), id); }
+    bool unlockNode(const string& label, int id) { return unlockIndex(getIndex(label), id); }
+    bool upgradeNode(const string& label, int id) { return upgradeIndex(getIndex(label), id); }
+
+    bool lockIndex(int targetIndex, int id) { return engine && engine->lockIndex(targetIndex, id); }
+    bool unlockIndex(int targetIndex, int id) { return engine && engine->unlockIndex(targetIndex, id); }
+    bool upgradeIndex(int targetIndex, int id) { return engine && engine->upgradeIndex(targetIndex, id); }
+};
+
+#endif // SHARED_LOCKING_TREE_H
@@ -0,0 +1,64 @@
+#include "shared-locking-tree.h"
+
+// ----------------------------------------------------------------------
+// MAIN EXECUTION
+// ----------------------------------------------------------------------
+
+/**
+ * Runs the usual query input against a lock table in shared memory. Every
+ * process started with the same --name and tree shares one table, so several
+ * of them can run their queries concurrently against the same locks.
+ *
+ *   shared-memory [--name /tree-of-space] [--unlink] < input.txt
+ *
+ * --unlink removes the segment name on exit.
+ */
+int main(int argc, char **argv) {
+    string name = "/tree-of-space";
+    bool unlinkOnExit = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--name" && i + 1 < argc) name = argv[++i];
+        else if (arg == "--unlink") unlinkOnExit = true;
+        else {
+            cerr << "usage: " << argv[0] << " [--name /segment] [--unlink]\n";
+            return 2;
+        }
+    }
+
+    // Standard fast I/O setup
+    ios_base::sync_with_stdio(false);
+    cin.tie(NULL);
+
+    int numNodes, numChildren, numQueries;
+    if (!(cin >> numNodes >> numChildren >> numQueries)) return 0;
+
+    vector<string> nodeLabels(numNodes);
+    for (int i = 0; i < numNodes; i++) {
+        cin >> nodeLabels[i];
+    }
+
+    SharedLockingTree lockingTree;
+    if (!lockingTree.open(name, numChildren, nodeLabels)) return 1;
+    uint64_t recoveriesBefore = lockingTree.recoveries();
+
+    string output;
+    string nodeLabel;
+    for (int i = 0; i < numQueries; i++) {
+        int opcode, userId;
+        cin >> opcode >> nodeLabel >> userId;
+        bool result = false;
+        switch (opcode) {
+            case 1: result = lockingTree.lockNode(nodeLabel, userId); break;
+            case 2: result = lockingTree.unlockNode(nodeLabel, userId); break;
+            case 3: result = lockingTree.upgradeNode(nodeLabel, userId); break;
+        }
+        output += result ? "true\n" : "false\n";
+    }
+    cout << output;
+
+    if (lockingTree.recoveries() != recoveriesBefore)
+        cerr << "shared tree: repaired after " << lockingTree.recoveries() - recoveriesBefore << " dead holder(s)\n";
+    if (unlinkOnExit) SharedLockingTree::unlink(name);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "tree-of-space.h"
+#include "policy-locking-tree.h"
+#include "lock-protocol.h"
+
+#include <cstddef>
+#include <new>
+
+using namespace std;
+
+// Batches are forwarded to and from the lock server's BATCH frames as they are.
+static_assert(sizeof(tos_op) == sizeof(BatchRecord), "tos_op must match BatchRecord");
+static_assert(offsetof(tos_op, node) == offsetof(BatchRecord, nodeIndex), "tos_op must match BatchRecord");
+static_assert(offsetof(tos_op, user) == offsetof(BatchRecord, userID), "tos_op must match BatchRecord");
+
+/**
+ * @brief The part of a tree that does not depend on the engine's arity. The
+ * engine is reached through 'submit', set once by tos_create().
+ */
+struct tos_tree {
+    size_t (*submit)(tos_tree *tree, const tos_op *ops, size_t count, uint8_t *results);
+    uint32_t numNodes;
+    bool synchronised;
+    policy::SpinSync batchLock; // Taken once per batch, not per operation.
+    unordered_map<string, uint32_t> labelToID;
+
+    virtual ~tos_tree() {}
+};
+
+namespace {
+
+/**
+ * @brief Single-threaded engine for arity M; synchronisation is per batch.
+ */
+template <int M>
+struct TreeEngine : tos_tree {
+    policy::LockingTree<typename policy::WithArity<policy::ImplicitStorage, M>::type, policy::SubtreeBroadcastIndex, policy::NoSync> tree;
+
+    TreeEngine(int numChildren, int numNodes) : tree(numChildren, numNodes) { submit = submitBatch; }
+
+    static size_t submitBatch(tos_tree *base, const tos_op *ops, size_t count, uint8_t *results) {
+        TreeEngine& engine = static_cast<TreeEngine&>(*base);
+        if (engine.synchronised) engine.batchLock.lock();
+        size_t succeeded = engine.tree.runBatch(ops, count, results);
+        if (engine.synchronised) engine.batchLock.unlock();
+        return succeeded;
+    }
+};
+
+} // namespace
+
+extern "C" {
+
+tos_tree *tos_create(const char *const *labels, uint32_t num_nodes, uint32_t num_children, uint32_t flags) {
+    if (num_nodes == 0 || num_nodes > (uint32_t)INT32_MAX) return nullptr;
+    if (num_children == 0 || num_children > (uint32_t)INT32_MAX) return nullptr;
+    tos_tree *tree = nullptr;
+    try {
+        policy::dispatchArity((int)num_children, [&](auto arity) {
+            tree = new TreeEngine<decltype(arity)::value>((int)num_children, (int)num_nodes);
+        });
+        tree->numNodes = num_nodes;
+        tree->synchronised = (flags & TOS_SYNCHRONISED) != 0;
+        if (labels) {
+            tree->labelToID.reserve(num_nodes);
+            for (uint32_t i = 0; i < num_nodes; i++) tree->labelToID[labels[i]] = i;
+        }
+        return tree;
+    } catch (const bad_alloc&) {
+        delete tree;
+        return nullptr; // Nothing may unwind into C code.
+    }
+}
+
+void tos_destroy(tos_tree *tree) { delete tree; }
+
+uint32_t tos_size(const tos_tree *tree) { return tree->numNodes; }
+
+uint32_t tos_resolve(const tos_tree *tree, const char *label) {
+    auto it = tree->labelToID.find(label);
+    return it == tree->labelToID.end() ? UINT32_MAX : it->second;
+}
+
+size_t tos_submit_batch(tos_tree *tree, const tos_op *ops, size_t count, uint8_t *results) {
+    return tree->submit(tree, ops, count, results);
+}
+
+} // extern "C"
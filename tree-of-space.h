@@ -0,0 +1,97 @@
+/**
+ * @file tree-of-space.h
+ * @brief C interface of the locking-tree engine, built as libtree-of-space.a
+ * and libtree-of-space.so (see the build tasks in .vscode/tasks.json).
+ *
+ * The engine is the policy-based LockingTree of policy-locking-tree.h on the
+ * implicit storage, specialised for M = 2, 4, 8 and 16. Operations name nodes
+ * by index: node i is the i-th label of the tree in breadth-first order, as in
+ * the batch input. Resolve labels once with tos_resolve() and keep the indices.
+ *
+ *   tos_tree *tree = tos_create(labels, numNodes, 4, TOS_SYNCHRONISED);
+ *   tos_op ops[2] = {{TOS_LOCK, {0}, tos_resolve(tree, "node7"), 42},
+ *                    {TOS_UNLOCK, {0}, tos_resolve(tree, "node7"), 42}};
+ *   uint8_t results[2];
+ *   tos_submit_batch(tree, ops, 2, results);
+ *   tos_destroy(tree);
+ *
+ * tos_submit_batch() reads the caller's records in place, writes the caller's
+ * result bytes and allocates nothing: one indirect call per batch, then a loop
+ * with the engine inlined into it. Built with -mavx2 (the "AVX2" build tasks),
+ * the loop checks eight operations at a time with gathers (see
+ * LockingTree::runBatch()); the other tasks run on any x86-64.
+ *
+ * The library is compiled with -fvisibility=hidden, and the shared library is
+ * linked with tree-of-space.map: only the functions marked TOS_API are
+ * exported, not the engine's C++ templates or the standard library's.
+ */
+#ifndef TREE_OF_SPACE_H
+#define TREE_OF_SPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TOS_API __attribute__((visibility("default")))
+#else
+#define TOS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    TOS_LOCK = 1,
+    TOS_UNLOCK = 2,
+    TOS_UPGRADE = 3,
+};
+
+/* tos_create() flags. */
+enum {
+    TOS_SYNCHRONISED = 1, /* Batches from several threads are serialised; otherwise one thread at a time. */
+};
+
+/**
+ * One operation; the same 12-byte layout as a BatchRecord of the lock
+ * server's binary protocol, so batches can be forwarded without conversion.
+ */
+typedef struct tos_op {
+    uint8_t opcode; /* TOS_LOCK, TOS_UNLOCK or TOS_UPGRADE. */
+    uint8_t reserved[3];
+    uint32_t node;  /* Node index. */
+    int32_t user;
+} tos_op;
+
+typedef struct tos_tree tos_tree;
+
+/**
+ * Creates an M-ary tree of 'num_nodes' nodes with every node unlocked.
+ * 'labels' (num_nodes strings) is only needed for tos_resolve() and may be NULL.
+ * Returns NULL if num_nodes or num_children is 0 or above INT32_MAX, or if
+ * memory runs out.
+ */
+TOS_API tos_tree *tos_create(const char *const *labels, uint32_t num_nodes, uint32_t num_children, uint32_t flags);
+
+TOS_API void tos_destroy(tos_tree *tree);
+
+TOS_API uint32_t tos_size(const tos_tree *tree);
+
+/**
+ * Index of the node labelled 'label', or UINT32_MAX if there is none (or the
+ * tree was created without labels).
+ */
+TOS_API uint32_t tos_resolve(const tos_tree *tree, const char *label);
+
+/**
+ * Runs 'count' operations in order, setting results[i] to 1 if ops[i]
+ * succeeded and 0 if it failed. Unknown opcodes and out-of-range nodes fail.
+ * Returns the number of operations that succeeded.
+ */
+TOS_API size_t tos_submit_batch(tos_tree *tree, const tos_op *ops, size_t count, uint8_t *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TREE_OF_SPACE_H */
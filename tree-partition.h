@@ -0,0 +1,76 @@
+/**
+ * @file tree-partition.h
+ * @brief Assignment of an M-ary tree's nodes to shards, shared by the shard
+ * servers (lock-server --shard) and the router (lock-router).
+ *
+ * Nodes are numbered breadth-first as in buildTree(), so the parent of node i
+ * is (i - 1) / M. Every node at depth 'cutDepth' roots a subtree that belongs,
+ * whole, to one shard: the k-th such node (left to right) goes to shard
+ * k % numShards. The nodes above the cut form the top of the tree; every shard
+ * holds a replica of it, and operations on it run on all shards at once.
+ */
+#ifndef TREE_PARTITION_H
+#define TREE_PARTITION_H
+
+#include <istream>
+#include <string>
+#include <vector>
+
+struct TreePartition {
+    static const int TOP = -1; // shardOf() for nodes above the cut.
+
+    long numNodes;
+    long numChildren;
+    int cutDepth;
+    int numShards;
+    long cutStart; // Index of the first node at depth cutDepth.
+
+    TreePartition(long nodes, long children, int depth, int shards)
+        : numNodes(nodes), numChildren(children), cutDepth(depth), numShards(shards), cutStart(0) {
+        long levelSize = 1;
+        for (int d = 0; d < cutDepth && cutStart < numNodes; d++) {
+            cutStart += levelSize;
+            levelSize = levelSize > numNodes / numChildren ? numNodes : levelSize * numChildren;
+        }
+    }
+
+    static long parentOf(long nodeIndex, long children) { return nodeIndex == 0 ? -1 : (nodeIndex - 1) / children; }
+
+    /**
+     * @brief Shard that owns nodeIndex, or TOP if it lies above the cut.
+     */
+    int shardOf(long nodeIndex) const {
+        if (nodeIndex < cutStart) return TOP;
+        // Climb to the ancestor at the cut: the first one whose index is below the next level.
+        long root = nodeIndex;
+        while (true) {
+            long parent = parentOf(root, numChildren);
+            if (parent < cutStart) break;
+            root = parent;
+        }
+        return (int)((root - cutStart) % numShards);
+    }
+
+    /**
+     * @brief Reads the numNodes labels from 'in', keeping only those shard
+     * 'shard' holds (the top plus its subtrees), in breadth-first order, with
+     * parents renumbered locally. The rest of the tree is never stored.
+     */
+    bool project(int shard, std::istream& in, std::vector<std::string>& shardLabels,
+                 std::vector<int>& shardParents) const {
+        std::vector<int> localIndex(numNodes, -1);
+        std::string label;
+        for (long i = 0; i < numNodes; i++) {
+            if (!(in >> label)) return false;
+            int owner = shardOf(i);
+            if (owner != TOP && owner != shard) continue;
+            localIndex[i] = (int)shardLabels.size();
+            shardLabels.push_back(label);
+            long parent = parentOf(i, numChildren);
+            shardParents.push_back(parent == -1 ? -1 : localIndex[parent]);
+        }
+        return true;
+    }
+};
+
+#endif // TREE_PARTITION_H